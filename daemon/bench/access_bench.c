@@ -0,0 +1,188 @@
+/**
+ * access_bench - Cost of an access check per backend
+ *
+ * Whitelists live child processes in a store of each backend and times
+ * check_authentication over a mix of half whitelisted and half random
+ * pids below pid_max, for a range of whitelist sizes. The linear column is a scan of a
+ * plain array of pids, which is how the store worked before it was
+ * hashed, for reference.
+ *
+ *   usage: access_bench [checks per size]
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "server/access/access.h"
+#include "loglib/loglib.h"
+
+#define DEFAULT_CHECKS (1 << 22)
+#define NUM_CANDIDATES (1 << 16) // checked round robin, a power of two
+#define PID_MAX_PATH "/proc/sys/kernel/pid_max"
+#define DEFAULT_PID_MAX 32768
+
+static const size_t whitelist_sizes[] = {2, 8, 64, 512, 4096};
+
+static pid_t* spawn_children(size_t n);
+static void reap_children(pid_t* children, size_t n);
+static uint8_t linear_check(pid_t* pids, size_t n, pid_t candidate);
+static double time_linear(pid_t* pids, size_t n, pid_t* candidates, size_t checks);
+static double time_store(pid_t* pids, size_t n, enum access_backend backend, pid_t* candidates, size_t checks);
+static unsigned long read_pid_max();
+static double now_ns();
+
+int main(int argc, char** argv) {
+  size_t checks, max_size;
+  unsigned long pid_max;
+  pid_t* candidates;
+  pid_t* children;
+
+  checks = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_CHECKS;
+  if (checks == 0) {
+    fprintf(stderr, "usage: %s [checks per size]\n", argv[0]);
+    return -1;
+  }
+
+  // every authorization is logged
+  log_threshold = LOG_LEVEL_WARN;
+
+  pid_max = read_pid_max();
+  max_size = whitelist_sizes[sizeof(whitelist_sizes) / sizeof(whitelist_sizes[0]) - 1];
+  children = spawn_children(max_size);
+  candidates = malloc(NUM_CANDIDATES * sizeof(pid_t));
+  if (!children || !candidates) {
+    fprintf(stderr, "failed to set up benchmark\n");
+    return -1;
+  }
+
+  printf("%9s %12s %12s %12s\n", "whitelist", "linear", "hash", "bitmap");
+  for (size_t i = 0; i < sizeof(whitelist_sizes) / sizeof(whitelist_sizes[0]); i++) {
+    size_t n = whitelist_sizes[i];
+
+    srand(42);
+    for (size_t j = 0; j < NUM_CANDIDATES; j++) {
+      candidates[j] = (j & 1) ? children[rand() % n] : 1 + rand() % (pid_max - 1);
+    }
+
+    printf("%9zu %9.1f ns %9.1f ns %9.1f ns\n", n,
+           time_linear(children, n, candidates, checks),
+           time_store(children, n, ACCESS_BACKEND_HASH, candidates, checks),
+           time_store(children, n, ACCESS_BACKEND_BITMAP, candidates, checks));
+  }
+
+  reap_children(children, max_size);
+  free(candidates);
+  return 0;
+}
+
+// the store only whitelists processes that are alive
+static pid_t* spawn_children(size_t n) {
+  pid_t* children;
+
+  children = malloc(n * sizeof(pid_t));
+  if (!children) {
+    return NULL;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    children[i] = fork();
+    if (children[i] == 0) {
+      pause();
+      _exit(0);
+    }
+    if (children[i] < 0) {
+      perror("failed to fork");
+      reap_children(children, i);
+      return NULL;
+    }
+  }
+  return children;
+}
+
+static void reap_children(pid_t* children, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    kill(children[i], SIGKILL);
+  }
+  for (size_t i = 0; i < n; i++) {
+    waitpid(children[i], NULL, 0);
+  }
+  free(children);
+}
+
+static uint8_t linear_check(pid_t* pids, size_t n, pid_t candidate) {
+  for (size_t i = 0; i < n; i++) {
+    if (pids[i] == candidate) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static double time_linear(pid_t* pids, size_t n, pid_t* candidates, size_t checks) {
+  volatile size_t hits;
+  double start;
+
+  hits = 0;
+  start = now_ns();
+  for (size_t i = 0; i < checks; i++) {
+    hits += linear_check(pids, n, candidates[i & (NUM_CANDIDATES - 1)]);
+  }
+  return (now_ns() - start) / checks;
+}
+
+static double time_store(pid_t* pids, size_t n, enum access_backend backend, pid_t* candidates, size_t checks) {
+  struct access_store* store;
+  volatile size_t hits;
+  double start, elapsed;
+
+  store = new_access_store(n, backend);
+  if (!store) {
+    return -1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (authorize_new_process(store, pids[i]) < 0) {
+      free_access_store(store);
+      return -1;
+    }
+  }
+
+  hits = 0;
+  start = now_ns();
+  for (size_t i = 0; i < checks; i++) {
+    hits += check_authentication(store, candidates[i & (NUM_CANDIDATES - 1)]);
+  }
+  elapsed = now_ns() - start;
+
+  free_access_store(store);
+  return elapsed / checks;
+}
+
+// peers can't have pids past it, so neither do the candidates
+static unsigned long read_pid_max() {
+  unsigned long pid_max;
+  FILE* f;
+
+  f = fopen(PID_MAX_PATH, "r");
+  if (!f) {
+    return DEFAULT_PID_MAX;
+  }
+  if (fscanf(f, "%lu", &pid_max) != 1 || pid_max < 2) {
+    pid_max = DEFAULT_PID_MAX;
+  }
+  fclose(f);
+  return pid_max;
+}
+
+static double now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
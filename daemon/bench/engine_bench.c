@@ -0,0 +1,285 @@
+/**
+ * engine_bench - Cost of a request per io engine
+ *
+ * Runs a single reactor datagram server on each engine in a child process,
+ * authorized to talk to it as the process that spawned it, and times
+ * heartbeats sent to it in bursts. Reports the round trip per message, the
+ * CPU time the server spent on each over its lifetime, and how many replies
+ * never came. A reactor that can't set up io_uring falls back to libevent,
+ * and says so on stderr.
+ *
+ * The ring run sends the same requests through a shared ring offered to a
+ * libevent server, as a client of the ring would: any frame the ring can't
+ * take goes out as a datagram instead, and is counted as a fallback.
+ *
+ *   usage: engine_bench [messages per engine]
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "server/server.h"
+#include "protolib/protolib.h"
+#include "commslib/commslib.h"
+#include "loglib/loglib.h"
+#include "ring/ring.h"
+
+#define DEFAULT_MESSAGES (1 << 17)
+#define BURST 8 // stays under the default datagram queue length of 10
+#define WARMUP_BURSTS 64
+#define STARTUP_TRIES 100 // heartbeats sent until the server is up
+#define STARTUP_WAIT_MS 10 // between them, sends fail right away until it binds
+#define REPLY_TIMEOUT_MS 100
+#define RING_CAPACITY 256 // frames
+#define SERVER_ADDR "/tmp/engine_bench.srv"
+#define CLIENT_ADDR "/tmp/engine_bench.cli"
+
+struct engine_result {
+  double us_per_msg; // round trip, as seen by the client
+  double cpu_us_per_msg; // user and system time of the server
+  size_t lost;
+  size_t fallbacks; // frames the ring couldn't take, sent as datagrams
+};
+
+static const struct {
+  const char* name;
+  enum io_engine engine;
+  uint8_t ring; // requests go through a shared ring
+} engines[] = {
+  {"libevent", IO_ENGINE_LIBEVENT, 0},
+  {"io_uring", IO_ENGINE_URING, 0},
+  {"ring", IO_ENGINE_LIBEVENT, 1},
+};
+
+static pid_t spawn_server(enum io_engine engine);
+static int wait_for_server(int fd, struct sockaddr_un* dst);
+static struct ring* attach_client_ring(int fd, struct sockaddr_un* dst);
+static size_t send_burst(int fd, struct sockaddr_un* dst, struct ring* ring, uint64_t seq_num, size_t n,
+                         size_t* fallbacks);
+static int run_engine(enum io_engine engine, uint8_t use_ring, size_t messages, struct engine_result* result);
+static double now_us();
+
+int main(int argc, char** argv) {
+  struct engine_result result;
+  size_t messages;
+
+  messages = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_MESSAGES;
+  if (messages < BURST) {
+    fprintf(stderr, "usage: %s [messages per engine]\n", argv[0]);
+    return -1;
+  }
+
+  log_threshold = LOG_LEVEL_WARN;
+  if (init_message_templates() < 0) {
+    fprintf(stderr, "failed to set up messages\n");
+    return -1;
+  }
+
+  printf("%-9s %12s %14s %8s %10s\n", "engine", "round trip", "server cpu", "lost", "fallbacks");
+  for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+    if (run_engine(engines[i].engine, engines[i].ring, messages, &result) < 0) {
+      fprintf(stderr, "failed to benchmark %s\n", engines[i].name);
+      return -1;
+    }
+    printf("%-9s %7.2f us/msg %7.2f us/msg %8zu %10zu\n", engines[i].name,
+           result.us_per_msg, result.cpu_us_per_msg, result.lost, result.fallbacks);
+  }
+  return 0;
+}
+
+static int run_engine(enum io_engine engine, uint8_t use_ring, size_t messages, struct engine_result* result) {
+  struct sockaddr_un dst;
+  struct ring* ring;
+  struct rusage usage;
+  struct timeval timeout;
+  size_t bursts, received;
+  double start, elapsed, cpu;
+  pid_t server;
+  int fd;
+
+  fd = -1;
+  ring = NULL;
+  result->fallbacks = 0;
+  server = spawn_server(engine);
+  if (server < 0) {
+    return -1;
+  }
+
+  fd = setup_datagram_socket(CLIENT_ADDR);
+  if (fd < 0 || resolve_address(SERVER_ADDR, &dst) < 0) {
+    goto ERROR;
+  }
+  // a lost reply only costs this much, the socket's default is for polling
+  timeout.tv_sec = 0;
+  timeout.tv_usec = REPLY_TIMEOUT_MS * 1000;
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+    goto ERROR;
+  }
+  if (wait_for_server(fd, &dst) < 0) {
+    fprintf(stderr, "server did not come up\n");
+    goto ERROR;
+  }
+  if (use_ring) {
+    ring = attach_client_ring(fd, &dst);
+    if (!ring) {
+      fprintf(stderr, "server did not attach the ring\n");
+      goto ERROR;
+    }
+  }
+
+  for (size_t i = 0; i < WARMUP_BURSTS; i++) {
+    send_burst(fd, &dst, ring, i * BURST, BURST, &result->fallbacks);
+  }
+
+  bursts = messages / BURST;
+  received = 0;
+  result->fallbacks = 0;
+  start = now_us();
+  for (size_t i = 0; i < bursts; i++) {
+    received += send_burst(fd, &dst, ring, (WARMUP_BURSTS + i) * BURST, BURST, &result->fallbacks);
+  }
+  elapsed = now_us() - start;
+
+  kill(server, SIGKILL);
+  if (wait4(server, NULL, 0, &usage) < 0) {
+    server = -1;
+    goto ERROR;
+  }
+  server = -1;
+
+  result->us_per_msg = elapsed / (bursts * BURST);
+  // all the server ever served, its startup is small next to that
+  cpu = usage.ru_utime.tv_sec * 1e6 + usage.ru_utime.tv_usec + usage.ru_stime.tv_sec * 1e6 + usage.ru_stime.tv_usec;
+  result->cpu_us_per_msg = cpu / ((bursts + WARMUP_BURSTS) * BURST);
+  result->lost = bursts * BURST - received;
+
+  if (ring) {
+    free_ring(ring);
+  }
+  close(fd);
+  unlink(CLIENT_ADDR);
+  return 0;
+
+ERROR:
+  if (server > 0) {
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+  }
+  if (ring) {
+    free_ring(ring);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  unlink(CLIENT_ADDR);
+  return -1;
+}
+
+// the server authorizes the process that spawned it, which is us
+static pid_t spawn_server(enum io_engine engine) {
+  struct server_config config;
+  struct server_state* server;
+  pid_t pid;
+
+  pid = fork();
+  if (pid != 0) {
+    if (pid < 0) {
+      perror("failed to fork");
+    }
+    return pid;
+  }
+
+  memset(&config, 0, sizeof(struct server_config));
+  config.addr = SERVER_ADDR;
+  config.access_capacity = DEFAULT_ACCESS_CAPACITY;
+  config.access_backend = ACCESS_BACKEND_HASH;
+  config.num_reactors = 1;
+  config.transport = TRANSPORT_DATAGRAM;
+  config.io_engine = engine;
+
+  server = new_server(&config);
+  if (!server) {
+    _exit(1);
+  }
+  _exit(start_server(server) < 0);
+}
+
+static int wait_for_server(int fd, struct sockaddr_un* dst) {
+  for (int i = 0; i < STARTUP_TRIES; i++) {
+    if (send_burst(fd, dst, NULL, 0, 1, NULL) == 1) {
+      return 0;
+    }
+    usleep(STARTUP_WAIT_MS * 1000);
+  }
+  return -1;
+}
+
+// offers a ring over the socket the server already authorized, and waits
+// for the server to attach it
+static struct ring* attach_client_ring(int fd, struct sockaddr_un* dst) {
+  struct ring* ring;
+
+  ring = new_ring(RING_CAPACITY);
+  if (!ring) {
+    return NULL;
+  }
+  if (offer_ring(ring, fd, dst) < 0) {
+    free_ring(ring);
+    return NULL;
+  }
+  for (int i = 0; i < STARTUP_TRIES && !ring_attached(ring); i++) {
+    usleep(STARTUP_WAIT_MS * 1000);
+  }
+  if (!ring_attached(ring)) {
+    free_ring(ring);
+    return NULL;
+  }
+  return ring;
+}
+
+// sends n heartbeats at once, through ring if there is one and it has room,
+// then waits for their replies, which always come back as datagrams
+static size_t send_burst(int fd, struct sockaddr_un* dst, struct ring* ring, uint64_t seq_num, size_t n,
+                         size_t* fallbacks) {
+  uint8_t buf[MAX_MSG_SIZE];
+  size_t len, received;
+
+  for (size_t i = 0; i < n; i++) {
+    len = marshall_heartbeat_request_into(seq_num + i, buf, sizeof(buf));
+    if (len == 0) {
+      return 0;
+    }
+    if (ring && ring_push(ring, buf, len) == 0) {
+      continue;
+    }
+    if (ring) {
+      (*fallbacks)++;
+    }
+    if (sendto(fd, buf, len, 0, (struct sockaddr*) dst, sizeof(struct sockaddr_un)) < 0) {
+      return 0;
+    }
+  }
+
+  received = 0;
+  while (received < n && recv(fd, buf, sizeof(buf), 0) > 0) {
+    received++;
+  }
+  return received;
+}
+
+static double now_us() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
@@ -10,18 +10,47 @@
 #include <sys/socket.h>
 #include <fcntl.h>
 #include <sys/un.h>
+#include <sys/syscall.h>
 
 #include "service_reader.h"
 #include "service_builder.h"
 #include "service_verifier.h"
 #include "protolib/protolib.h"
+#include "loglib/loglib.h"
 #include "commslib.h"
 
 #define READ_TIMEOUT 10 // timeout for socket read in microseconds
+#define STAT_START_TIME_FIELD 22 // see proc(5)
+#define READY_MSG "READY=1\n" // sd_notify style
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
 
 #undef ns
 #define ns(x) FLATBUFFERS_WRAP_NAMESPACE(service, x) // Specified in the schema.
 
+struct msg_pool {
+  size_t capacity;
+
+  struct msg_slot* slots;
+  struct msg_slot* free_list;
+};
+
+struct msg_batch {
+  size_t capacity;
+  size_t len; // messages currently held
+
+  struct mmsghdr* hdrs;
+  struct msg_slot* slots;
+};
+
+struct peer_cache {
+  size_t capacity;
+  size_t len;
+
+  struct peer* peers; // never moved, so peers can be held on to
+};
 
 /**
  * format_msg: formats a buf into a msghdr struct with permission control
@@ -36,6 +65,43 @@
 */
 static int format_msg(uint8_t* buf, int buf_len, struct msghdr** hdr);
 
+/**
+ * alloc_slots: allocates an array of cache-line-aligned message slots, with
+ * their headers pointing at their own payload, address and control buffers
+ *
+ * @capacity: number of slots
+ *
+ * @returns array of slots or NULL on error. Release with free()
+ *
+**/
+static struct msg_slot* alloc_slots(size_t capacity);
+
+/**
+ * reset_slot: prepares a slot's header to receive a new message
+ *
+ * @slot: slot to reset
+ *
+**/
+static void reset_slot(struct msg_slot* slot);
+
+/**
+ * close_slot_fds: closes the fds a slot still holds
+ *
+ * @slot: message slot
+ *
+**/
+static void close_slot_fds(struct msg_slot* slot);
+
+/**
+ * fill_slot_metadata: records length, source address length, sender
+ * credentials and passed fds of a message received into slot
+ *
+ * @slot: slot holding a received message
+ * @len: number of bytes received
+ *
+**/
+static void fill_slot_metadata(struct msg_slot* slot, size_t len);
+
 /**
  * set_non_blocking: sets the fd to non blocking
  *
@@ -59,13 +125,13 @@ static int clear_non_blocking(int fd);
 
 int resolve_address(char* addr_path, struct sockaddr_un* addr) {
   if (!addr) {
-    fprintf(stderr, "input addr is null\n");
+    log_error("input addr is null");
     return -1;
   }
   memset(addr, 0, sizeof(struct sockaddr_un));
 
   if (strlen(addr_path) > sizeof(addr->sun_path)) {
-    fprintf(stderr, "socket path too long\n");
+    log_error("socket path too long");
     return -1;
   }
  
@@ -80,12 +146,12 @@ int setup_datagram_socket(char* addr) {
   int fd, enabled;
 
   if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
-    perror("failed to create socket");
+    log_perror("failed to create socket");
     return -1;
   }
 
   if (strlen(addr) > sizeof(client.sun_path)) {
-    fprintf(stderr, "socket path too long\n");
+    log_error("socket path too long");
     return -1;
   }
 
@@ -95,13 +161,13 @@ int setup_datagram_socket(char* addr) {
   unlink(client.sun_path);
 
   if (bind(fd, (struct sockaddr*) &client, sizeof(struct sockaddr_un)) < 0) {
-    perror("failed to bind");
+    log_perror("failed to bind");
     return -1;
   }
 
   enabled = 1;
   if (setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &enabled, sizeof(enabled)) < 0) {
-    perror("failed to set up authenticated socket");
+    log_perror("failed to set up authenticated socket");
     return -1;
   } 
 
@@ -110,77 +176,345 @@ int setup_datagram_socket(char* addr) {
     .tv_usec = READ_TIMEOUT,
   };  
   if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &read_timeout, sizeof(read_timeout)) < 0) {
-    perror("failed to set timeout for socket");
+    log_perror("failed to set timeout for socket");
     return -1;
   }
  
   return fd;
 }
 
-int receive_msg(int dst_fd, struct msghdr** msg) {
-  struct msghdr* hdr; 
-  int bytes_read;
-  struct iovec iov[1];
-  uint8_t buf[1024];
-  struct sockaddr_un client;
-  struct cmsghdr* cmh;
-  struct ucred* ucred_data;
+int setup_seqpacket_listener(char* addr) {
+  struct sockaddr_un server;
+  int fd;
 
-  hdr = malloc(sizeof(struct msghdr));
-  if (!hdr) {
-    perror("no memory available for message");
+  if (resolve_address(addr, &server) < 0) {
     return -1;
   }
-  memset(hdr, 0, sizeof(struct msghdr));
 
-  memset(iov, 0, sizeof(iov));
-  iov[0].iov_base = buf;
-  iov[0].iov_len = sizeof(buf);
+  fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    log_perror("failed to create socket");
+    return -1;
+  }
+  unlink(server.sun_path);
 
-  hdr->msg_iov = iov;
-  hdr->msg_iovlen = 1;
+  if (bind(fd, (struct sockaddr*) &server, sizeof(struct sockaddr_un)) < 0) {
+    log_perror("failed to bind");
+    close(fd);
+    return -1;
+  }
 
-  memset(&client, 0, sizeof(struct sockaddr_un));
-  hdr->msg_name = &client;
-  hdr->msg_namelen = sizeof(struct sockaddr_un);
+  if (listen(fd, SOMAXCONN) < 0) {
+    log_perror("failed to listen");
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int accept_connection(int listen_fd, struct ucred* cred) {
+  socklen_t cred_len;
+  int fd;
+
+  fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  // recorded by the kernel when the client called connect, it can't be forged
+  cred_len = sizeof(struct ucred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, cred, &cred_len) < 0 || cred->pid <= 0) {
+    close(fd);
+    errno = EACCES;
+    return -1;
+  }
+
+  return fd;
+}
+
+int shard_path(char* addr_path, size_t shard, size_t num_shards, char* path, size_t path_len) {
+  int len;
 
-  union {
-    struct cmsghdr cmh;
-    char control[CMSG_SPACE(sizeof(struct ucred))];
-  } control_un;
-  memset(&control_un, 0, sizeof(control_un));
+  if (num_shards <= 1) {
+    len = snprintf(path, path_len, "%s", addr_path);
+  } else {
+    len = snprintf(path, path_len, "%s.%zu", addr_path, shard);
+  }
+
+  if (len < 0 || (size_t) len >= path_len) {
+    log_error("socket path too long");
+    return -1;
+  }
+
+  return 0;
+}
+
+size_t shard_for_pid(pid_t process, size_t num_shards) {
+  uint32_t h;
+
+  if (num_shards <= 1) {
+    return 0;
+  }
+
+  // pids are handed out sequentially, so spread neighbours apart
+  h = (uint32_t) process * 0x9e3779b1u;
+  return (size_t) (h >> 16) % num_shards;
+}
+
+struct msg_pool* new_msg_pool(size_t capacity) {
+  struct msg_pool* pool;
+
+  pool = malloc(sizeof(struct msg_pool));
+  if (!pool) {
+    log_perror("no memory available for message pool");
+    return NULL;
+  }
+  memset(pool, 0, sizeof(struct msg_pool));
 
-  control_un.cmh.cmsg_len = CMSG_LEN(sizeof(struct ucred));
-  control_un.cmh.cmsg_level = SOL_SOCKET;
-  control_un.cmh.cmsg_type = SCM_CREDENTIALS;
+  pool->slots = alloc_slots(capacity);
+  if (!pool->slots) {
+    free(pool);
+    return NULL;
+  }
+  pool->capacity = capacity;
+
+  for (size_t i = capacity; i > 0; i--) {
+    pool->slots[i - 1].next = pool->free_list;
+    pool->free_list = &pool->slots[i - 1];
+  }
+
+  return pool;
+}
+
+void free_msg_pool(struct msg_pool* pool) {
+  for (size_t i = 0; i < pool->capacity; i++) {
+    close_slot_fds(&pool->slots[i]);
+  }
+  free(pool->slots);
+  free(pool);
+}
 
-  hdr->msg_control = control_un.control;
-  hdr->msg_controllen = sizeof(control_un.control);
+struct msg_slot* acquire_slot(struct msg_pool* pool) {
+  struct msg_slot* slot;
 
-  bytes_read = recvmsg(dst_fd, hdr, 0 | O_NONBLOCK);
+  slot = pool->free_list;
+  if (!slot) {
+    return NULL;
+  }
+  pool->free_list = slot->next;
+  slot->next = NULL;
+
+  return slot;
+}
+
+void release_slot(struct msg_pool* pool, struct msg_slot* slot) {
+  slot->next = pool->free_list;
+  pool->free_list = slot;
+}
+
+int receive_msg(int dst_fd, struct msg_pool* pool, struct msg_slot** msg) {
+  struct msg_slot* slot;
+  int bytes_read;
+
+  slot = acquire_slot(pool);
+  if (!slot) {
+    log_warn("no free slot available for message");
+    return -1;
+  }
+  reset_slot(slot);
+
+  bytes_read = recvmsg(dst_fd, &slot->hdr, MSG_CMSG_CLOEXEC);
   if (bytes_read < 0) {
-    perror("failed to receive message");
-    free(hdr);
+    log_perror("failed to receive message");
+    release_slot(pool, slot);
     return -1;
   }
 
   if (bytes_read == 0) {
-    fprintf(stderr, "process did not send anything\n");
-    free(hdr);
+    log_warn("process did not send anything");
+    release_slot(pool, slot);
     return -1;
   }
+  fill_slot_metadata(slot, bytes_read);
 
-  *msg = hdr;
+  *msg = slot;
   return bytes_read;
 }
 
+struct msg_batch* new_msg_batch(size_t capacity) {
+  struct msg_batch* batch;
+
+  batch = malloc(sizeof(struct msg_batch));
+  if (!batch) {
+    log_perror("no memory available for message batch");
+    return NULL;
+  }
+  memset(batch, 0, sizeof(struct msg_batch));
+  batch->capacity = capacity;
+
+  batch->hdrs = calloc(capacity, sizeof(struct mmsghdr));
+  batch->slots = alloc_slots(capacity);
+  if (!batch->hdrs || !batch->slots) {
+    log_perror("no memory available for message batch");
+    free_msg_batch(batch);
+    return NULL;
+  }
+
+  return batch;
+}
+
+void free_msg_batch(struct msg_batch* batch) {
+  if (batch->slots) {
+    for (size_t i = 0; i < batch->capacity; i++) {
+      close_slot_fds(&batch->slots[i]);
+    }
+  }
+  free(batch->hdrs);
+  free(batch->slots);
+  free(batch);
+}
+
+int receive_msgs(int dst_fd, struct msg_batch* batch, size_t n) {
+  int received;
+
+  if (n > batch->capacity) {
+    n = batch->capacity;
+  }
+
+  // the kernel shrinks the headers on every receive, and queue_msg
+  // repurposes them for sending, so they must be reset
+  for (size_t i = 0; i < n; i++) {
+    reset_slot(&batch->slots[i]);
+    batch->hdrs[i].msg_hdr = batch->slots[i].hdr;
+    batch->hdrs[i].msg_len = 0;
+  }
+
+  received = recvmmsg(dst_fd, batch->hdrs, n, MSG_DONTWAIT | MSG_CMSG_CLOEXEC, NULL);
+  batch->len = received < 0 ? 0 : received;
+
+  for (size_t i = 0; i < batch->len; i++) {
+    batch->slots[i].hdr = batch->hdrs[i].msg_hdr;
+    fill_slot_metadata(&batch->slots[i], batch->hdrs[i].msg_len);
+  }
+
+  return received;
+}
+
+int receive_conn_msgs(int conn_fd, struct msg_batch* batch, size_t n, struct ucred* cred) {
+  int received;
+
+  if (n > batch->capacity) {
+    n = batch->capacity;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    reset_slot(&batch->slots[i]);
+    batch->slots[i].hdr.msg_namelen = 0;
+    batch->slots[i].hdr.msg_control = NULL;
+    batch->slots[i].hdr.msg_controllen = 0;
+    batch->hdrs[i].msg_hdr = batch->slots[i].hdr;
+    batch->hdrs[i].msg_len = 0;
+  }
+
+  received = recvmmsg(conn_fd, batch->hdrs, n, MSG_DONTWAIT, NULL);
+  if (received < 0) {
+    batch->len = 0;
+    return -1;
+  }
+
+  // the end of the connection reads as an empty message, and we never send those
+  for (batch->len = 0; batch->len < (size_t) received; batch->len++) {
+    struct msg_slot* slot = &batch->slots[batch->len];
+
+    if (batch->hdrs[batch->len].msg_len == 0) {
+      break;
+    }
+    slot->hdr = batch->hdrs[batch->len].msg_hdr;
+    slot->md.len = batch->hdrs[batch->len].msg_len;
+    slot->md.has_credentials = 1;
+    slot->md.pid = cred->pid;
+    slot->md.uid = cred->uid;
+    slot->md.gid = cred->gid;
+  }
+
+  return batch->len;
+}
+
+struct msg_slot* batch_slot(struct msg_batch* batch, size_t i) {
+  return &batch->slots[i];
+}
+
+int queue_msg(struct msg_batch* batch, struct sockaddr_un* dst, socklen_t dst_len,
+              uint8_t* payload, size_t payload_len) {
+  struct msg_slot* slot;
+
+  if (batch->len >= batch->capacity) {
+    log_warn("message batch is full");
+    return -1;
+  }
+
+  if (payload_len > MAX_MSG_SIZE || dst_len > sizeof(struct sockaddr_un)) {
+    log_error("message too large for batch");
+    return -1;
+  }
+
+  slot = &batch->slots[batch->len];
+  reset_slot(slot);
+
+  memcpy(slot->payload, payload, payload_len);
+  slot->iov.iov_len = payload_len;
+
+  if (dst) {
+    memcpy(&slot->addr, dst, dst_len);
+  }
+  slot->hdr.msg_namelen = dst_len;
+  slot->hdr.msg_control = NULL;
+  slot->hdr.msg_controllen = 0;
+
+  batch->hdrs[batch->len].msg_hdr = slot->hdr;
+
+  batch->len++;
+  return 0;
+}
+
+int send_msgs(int src_fd, struct msg_batch* batch) {
+  size_t sent, failed;
+  int n;
+
+  sent = 0;
+  failed = 0;
+  while (sent < batch->len) {
+    n = sendmmsg(src_fd, batch->hdrs + sent, batch->len - sent, MSG_DONTWAIT);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // the destination at the head of the batch is gone or backed up:
+      // drop that message and keep going with the rest
+      log_perror("failed to send message");
+      sent++;
+      failed++;
+      continue;
+    }
+    sent += n;
+  }
+  batch->len = 0;
+
+  return sent - failed;
+}
+
+size_t batch_len(struct msg_batch* batch) {
+  return batch->len;
+}
+
 int send_msg(int src_fd, uint8_t* payload, size_t payload_len) {
   int fd, enabled, return_code;
   struct sockaddr_un source;
   struct msghdr* msg;
 
   if (format_msg(payload, payload_len, &msg) < 0) {
-    perror("failed to format payload");
+    log_perror("failed to format payload");
     return -1;
   }
   return_code = sendmsg(src_fd, msg, 0);
@@ -191,12 +525,127 @@ int send_msg(int src_fd, uint8_t* payload, size_t payload_len) {
 
 int connect_to_destination(int src_fd, struct sockaddr_un* dst) {
   if (connect(src_fd, (struct sockaddr*) dst, sizeof(struct sockaddr_un)) < 0) {
-    perror("could not connect to destination");
+    log_perror("could not connect to destination");
     return -1;
   } 
   return 0;
 }
 
+struct peer_cache* new_peer_cache(size_t capacity) {
+  struct peer_cache* cache;
+
+  cache = malloc(sizeof(struct peer_cache));
+  if (!cache) {
+    return NULL;
+  }
+
+  cache->peers = calloc(capacity, sizeof(struct peer));
+  if (!cache->peers) {
+    free(cache);
+    return NULL;
+  }
+  cache->capacity = capacity;
+  cache->len = 0;
+
+  return cache;
+}
+
+void free_peer_cache(struct peer_cache* cache) {
+  for (size_t i = 0; i < cache->len; i++) {
+    disconnect_peer(&cache->peers[i]);
+  }
+  free(cache->peers);
+  free(cache);
+}
+
+struct peer* get_peer(struct peer_cache* cache, char* addr_path, enum transport transport) {
+  struct peer* peer;
+
+  // looked up once per process and kept, a linear search will do
+  for (size_t i = 0; i < cache->len; i++) {
+    if (strcmp(cache->peers[i].path, addr_path) == 0) {
+      return &cache->peers[i];
+    }
+  }
+
+  if (cache->len == cache->capacity || strlen(addr_path) >= sizeof(peer->path)) {
+    return NULL;
+  }
+
+  peer = &cache->peers[cache->len++];
+  strcpy(peer->path, addr_path);
+  peer->transport = transport;
+  peer->fd = -1;
+  peer->has_credentials = 0;
+
+  return peer;
+}
+
+int connect_peer(struct peer* peer) {
+  struct sockaddr_un dst;
+  struct ucred cred;
+  socklen_t cred_len;
+  int fd, enabled;
+
+  if (peer->fd >= 0) {
+    return peer->fd;
+  }
+
+  if (resolve_address(peer->path, &dst) < 0) {
+    return -1;
+  }
+
+  if (peer->transport == TRANSPORT_SEQPACKET) {
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  } else {
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  }
+  if (fd < 0) {
+    return -1;
+  }
+
+  // also autobinds a datagram socket on connect, so there is an address to
+  // reply to. Replies on a connection need no credentials of their own
+  enabled = 1;
+  if ((peer->transport == TRANSPORT_DATAGRAM &&
+       setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &enabled, sizeof(enabled)) < 0) ||
+      connect(fd, (struct sockaddr*) &dst, sizeof(struct sockaddr_un)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  cred_len = sizeof(cred);
+  peer->has_credentials = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0 && cred.pid > 0;
+  if (peer->has_credentials) {
+    peer->pid = cred.pid;
+    peer->uid = cred.uid;
+    peer->gid = cred.gid;
+  }
+
+  peer->fd = fd;
+  return fd;
+}
+
+void disconnect_peer(struct peer* peer) {
+  if (peer->fd >= 0) {
+    close(peer->fd);
+    peer->fd = -1;
+  }
+  peer->has_credentials = 0;
+}
+
+int send_to_peer(struct peer* peer, uint8_t* payload, size_t payload_len) {
+  if (peer->fd < 0) {
+    errno = ENOTCONN;
+    return -1;
+  }
+
+  if (send(peer->fd, payload, payload_len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
 int format_msg(uint8_t* payload, int payload_len, struct msghdr** hdr_ret) {
   struct iovec iov[1];
   struct msghdr* hdr;
@@ -223,16 +672,149 @@ int format_msg(uint8_t* payload, int payload_len, struct msghdr** hdr_ret) {
 struct ucred* get_header_credentials(struct msghdr* hdr) {
   struct cmsghdr* cmh;
 
-  cmh = CMSG_FIRSTHDR(hdr);
-
-  if (cmh && cmh->cmsg_len == CMSG_LEN(sizeof(struct ucred)) &&
-      cmh->cmsg_level == SOL_SOCKET && cmh->cmsg_type == SCM_CREDENTIALS)
-  {
-    return (struct ucred*) CMSG_DATA(cmh);
+  // fds passed along come in a control message of their own
+  for (cmh = CMSG_FIRSTHDR(hdr); cmh; cmh = CMSG_NXTHDR(hdr, cmh)) {
+    if (cmh->cmsg_len == CMSG_LEN(sizeof(struct ucred)) &&
+        cmh->cmsg_level == SOL_SOCKET && cmh->cmsg_type == SCM_CREDENTIALS)
+    {
+      return (struct ucred*) CMSG_DATA(cmh);
+    }
   }
   return NULL;
 }
 
+int open_pidfd(pid_t process) {
+  return syscall(SYS_pidfd_open, process, 0);
+}
+
+int notify_ready() {
+  char* fd_str;
+  int fd, err;
+
+  fd_str = getenv(READY_FD_ENV);
+  if (!fd_str) {
+    return 0;
+  }
+  fd = atoi(fd_str);
+  // children of this process must not report on our behalf
+  unsetenv(READY_FD_ENV);
+
+  err = 0;
+  if (write(fd, READY_MSG, sizeof(READY_MSG) - 1) < 0) {
+    log_perror("failed to notify readiness");
+    err = -1;
+  }
+  close(fd);
+
+  return err;
+}
+
+uint64_t get_process_start_time(pid_t process) {
+  char path[64], stat[1024];
+  unsigned long long start_time;
+  char* field;
+  size_t len;
+  FILE* f;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", process);
+  f = fopen(path, "r");
+  if (!f) {
+    return 0;
+  }
+  len = fread(stat, 1, sizeof(stat) - 1, f);
+  fclose(f);
+  stat[len] = '\0';
+
+  // the command name may contain spaces and parentheses, fields resume
+  // after its last closing parenthesis with field 3 (state)
+  field = strrchr(stat, ')');
+  if (!field) {
+    return 0;
+  }
+  field++;
+  for (int i = 3; i < STAT_START_TIME_FIELD && field; i++) {
+    field = strchr(field + 1, ' ');
+  }
+  if (!field || sscanf(field, " %llu", &start_time) != 1) {
+    return 0;
+  }
+
+  return start_time;
+}
+
+static struct msg_slot* alloc_slots(size_t capacity) {
+  struct msg_slot* slots;
+
+  slots = aligned_alloc(CACHE_LINE_SIZE, capacity * sizeof(struct msg_slot));
+  if (!slots) {
+    log_perror("no memory available for message slots");
+    return NULL;
+  }
+  memset(slots, 0, capacity * sizeof(struct msg_slot));
+
+  for (size_t i = 0; i < capacity; i++) {
+    slots[i].iov.iov_base = slots[i].payload;
+    slots[i].hdr.msg_iov = &slots[i].iov;
+    slots[i].hdr.msg_iovlen = 1;
+    slots[i].hdr.msg_name = &slots[i].addr;
+  }
+
+  return slots;
+}
+
+static void reset_slot(struct msg_slot* slot) {
+  slot->iov.iov_len = MAX_MSG_SIZE;
+
+  slot->hdr.msg_namelen = sizeof(struct sockaddr_un);
+  slot->hdr.msg_control = slot->control.buf;
+  slot->hdr.msg_controllen = sizeof(slot->control.buf);
+  slot->hdr.msg_flags = 0;
+
+  close_slot_fds(slot);
+  memset(&slot->md, 0, sizeof(struct msg_metadata));
+}
+
+static void close_slot_fds(struct msg_slot* slot) {
+  for (size_t i = 0; i < slot->md.num_fds; i++) {
+    close(slot->md.fds[i]);
+  }
+  slot->md.num_fds = 0;
+}
+
+static void fill_slot_metadata(struct msg_slot* slot, size_t len) {
+  struct ucred* ucred_data;
+  struct cmsghdr* cmh;
+
+  slot->md.len = len;
+  slot->md.addr_len = slot->hdr.msg_namelen;
+
+  ucred_data = get_header_credentials(&slot->hdr);
+  if (ucred_data) {
+    slot->md.has_credentials = 1;
+    slot->md.pid = ucred_data->pid;
+    slot->md.uid = ucred_data->uid;
+    slot->md.gid = ucred_data->gid;
+  }
+
+  for (cmh = CMSG_FIRSTHDR(&slot->hdr); cmh; cmh = CMSG_NXTHDR(&slot->hdr, cmh)) {
+    size_t num_fds;
+    int* fds;
+
+    if (cmh->cmsg_level != SOL_SOCKET || cmh->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    fds = (int*) CMSG_DATA(cmh);
+    num_fds = (cmh->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < num_fds; i++) {
+      if (slot->md.num_fds < MAX_MSG_FDS) {
+        slot->md.fds[slot->md.num_fds++] = fds[i];
+      } else {
+        close(fds[i]);
+      }
+    }
+  }
+}
+
 static int set_non_blocking(int fd) {
   int flags;
 
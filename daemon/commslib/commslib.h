@@ -13,6 +13,79 @@
 #define COMMSLIB_H
 
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_MSG_SIZE 1024 // largest datagram payload we expect to receive
+#define CACHE_LINE_SIZE 64
+#define MAX_MSG_FDS 2 // fds a message can pass along, more are closed on receipt
+#define READY_FD_ENV "READY_FD" // fd a supervised process reports readiness on
+#define LISTEN_FD_ENV "LISTEN_FD" // already bound socket a supervised process should serve
+
+struct msg_pool;
+struct msg_batch;
+struct peer_cache;
+
+// How a server takes requests. Datagrams carry their sender's credentials
+// with every message. A seqpacket server authenticates a client once, from
+// the credentials the kernel records when it connects, and everything the
+// client sends after that arrives on the same connection.
+enum transport {
+  TRANSPORT_DATAGRAM,
+  TRANSPORT_SEQPACKET,
+};
+
+// what we learnt about a message and its sender on receipt
+struct msg_metadata {
+  size_t len;
+  socklen_t addr_len;
+
+  uint8_t has_credentials;
+  pid_t pid;
+  uid_t uid;
+  gid_t gid;
+
+  // passed along with the message. They are closed when the slot is reused
+  // or freed, so a handler keeping one must take it out and clear num_fds
+  int fds[MAX_MSG_FDS];
+  size_t num_fds;
+};
+
+// A message slot holds everything needed to receive one datagram, so
+// that receiving never touches the heap and everything a handler reads
+// lives as long as the slot is held.
+struct msg_slot {
+  struct msghdr hdr;
+  struct iovec iov;
+  struct sockaddr_un addr;
+  union {
+    struct cmsghdr cmh;
+    char buf[CMSG_SPACE(sizeof(struct ucred)) + CMSG_SPACE(MAX_MSG_FDS * sizeof(int))];
+  } control;
+
+  struct msg_metadata md;
+  struct msg_slot* next; // free list link while in a pool
+
+  uint8_t payload[MAX_MSG_SIZE];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+// A socket connected to one destination, so sending to it is a plain
+// send() and the kernel neither resolves the path again nor accepts
+// datagrams on it from anyone else. Replies come back on fd, which is
+// autobound to an abstract address.
+struct peer {
+  char path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+  enum transport transport;
+  int fd; // -1 while not connected
+
+  // process listening on the destination as of connect, if the kernel reports
+  // it. It doesn't for datagram sockets, only for stream and seqpacket ones
+  uint8_t has_credentials;
+  pid_t pid;
+  uid_t uid;
+  gid_t gid;
+};
 
 /**
  * resolve_address: resolves a string socket path to an address
@@ -33,6 +106,57 @@ int resolve_address(char* addr_path, struct sockaddr_un* addr);
 **/
 int setup_datagram_socket(char *addr);
 
+/**
+ * setup_seqpacket_listener: sets up a non-blocking seqpacket socket bound to
+ * addr and listening for connections
+ *
+ * @addr: socket path to bind
+ *
+ * @returns fd of socket or -1 on error
+ *
+**/
+int setup_seqpacket_listener(char* addr);
+
+/**
+ * accept_connection: accepts a pending connection on a seqpacket listener,
+ * without blocking
+ *
+ * @listen_fd: listening fd
+ * @cred: return parameter of the credentials the client connected with
+ *
+ * @returns non-blocking fd of the connection, or -1 on error. errno is EAGAIN
+ * when no connection was pending.
+ *
+**/
+int accept_connection(int listen_fd, struct ucred* cred);
+
+/**
+ * shard_path: derives the socket path of one shard of a sharded server,
+ * which is "<addr_path>.<shard>", or addr_path itself for an unsharded one
+ *
+ * @addr_path: base socket path of the server
+ * @shard: index of shard
+ * @num_shards: number of shards the server runs
+ * @path: return parameter of resulting path
+ * @path_len: size of path buffer
+ *
+ * @returns 0 on success, or -1 if path does not fit
+ *
+**/
+int shard_path(char* addr_path, size_t shard, size_t num_shards, char* path, size_t path_len);
+
+/**
+ * shard_for_pid: picks the shard a client talks to, so that all requests
+ * of a client land on the same reactor
+ *
+ * @process: pid of client
+ * @num_shards: number of shards the server runs
+ *
+ * @returns index of shard
+ *
+**/
+size_t shard_for_pid(pid_t process, size_t num_shards);
+
 /**
  * send_msg: sends payload to addr, with properly formatted
  * control section (creds)
@@ -56,18 +180,229 @@ int send_msg(int src_fd, uint8_t* payload, size_t payload_len);
 **/
 int connect_to_destination(int src_fd, struct sockaddr_un* dst);
 
+/**
+ * new_peer_cache: allocates room for a fixed number of peer connections
+ *
+ * @capacity: maximum number of distinct destinations
+ *
+ * @returns new cache or NULL on error. Caller must free after use by calling
+ * free_peer_cache, which closes every connection
+ *
+**/
+struct peer_cache* new_peer_cache(size_t capacity);
+
+/**
+ * free_peer_cache: closes every connection and releases the cache
+ *
+ * @cache: cache to free
+ *
+**/
+void free_peer_cache(struct peer_cache* cache);
+
+/**
+ * get_peer: finds the entry for a destination, adding it if it is new. The
+ * entry isn't connected until connect_peer is called
+ *
+ * @cache: peer cache
+ * @addr_path: socket path of destination
+ * @transport: kind of socket bound to the destination
+ *
+ * @returns peer, valid as long as the cache, or NULL if the cache is full or
+ * the path too long
+ *
+**/
+struct peer* get_peer(struct peer_cache* cache, char* addr_path, enum transport transport);
+
+/**
+ * connect_peer: connects a non-blocking socket to the peer's destination,
+ * unless it is connected already. Datagram sockets are authenticated, so
+ * replies carry their sender's credentials. Seqpacket ones learn the
+ * credentials of the listening process instead
+ *
+ * @peer: peer to connect
+ *
+ * @returns connected fd, or -1 on error (errno is ENOENT or ECONNREFUSED
+ * while nothing is bound to the destination)
+ *
+**/
+int connect_peer(struct peer* peer);
+
+/**
+ * disconnect_peer: closes the peer's connection, e.g. once whoever served its
+ * destination is gone. Does nothing if not connected
+ *
+ * @peer: peer to disconnect
+ *
+**/
+void disconnect_peer(struct peer* peer);
+
+/**
+ * send_to_peer: sends payload over the peer's connection in a single send(),
+ * without blocking
+ *
+ * @peer: connected peer
+ * @payload: message payload
+ * @payload_len: size of payload in bytes
+ *
+ * @returns -1 on error, with errno ENOTCONN if the peer isn't connected and
+ * ECONNREFUSED once the destination socket is closed, 0 otherwise
+ *
+**/
+int send_to_peer(struct peer* peer, uint8_t* payload, size_t payload_len);
+
+/**
+ * new_msg_pool: allocates a fixed number of message slots to receive into
+ *
+ * @capacity: number of slots in the pool
+ *
+ * @returns new pool or NULL on error. Caller must free after use by calling
+ * free_msg_pool
+ *
+**/
+struct msg_pool* new_msg_pool(size_t capacity);
+
+/**
+ * free_msg_pool: release resources allocated for pool, including all its slots
+ *
+ * @pool: pool to free
+ *
+**/
+void free_msg_pool(struct msg_pool* pool);
+
+/**
+ * acquire_slot: takes a free slot out of pool
+ *
+ * @pool: message pool
+ *
+ * @returns slot, or NULL if every slot is in use
+ *
+**/
+struct msg_slot* acquire_slot(struct msg_pool* pool);
+
+/**
+ * release_slot: returns a slot to the pool it was acquired from
+ *
+ * @pool: message pool
+ * @slot: slot to release
+ *
+**/
+void release_slot(struct msg_pool* pool, struct msg_slot* slot);
+
 /**
  * receive_msg: receive a msg into dst_fd
  *
  * @dst_fd: bound fd to receive message
- * @msg: return parameter to place received message
+ * @pool: pool to take the receiving slot from
+ * @msg: return parameter to place received message, with its metadata filled in
  *
  * @returns -1 on erorr or number of bytes received
  *
- * Clients are responsible for msg's resource release
+ * Clients are responsible for releasing msg back to pool
+**/
+int receive_msg(int dst_fd, struct msg_pool* pool, struct msg_slot** msg);
+
+/**
+ * new_msg_batch: allocates a batch of message headers, payload buffers,
+ * source addresses and credential control blocks, ready to be filled by
+ * receive_msgs
+ *
+ * @capacity: maximum number of messages the batch can hold
+ *
+ * @returns new batch or NULL on error. Caller must free after use by calling
+ * free_msg_batch
+ *
+**/
+struct msg_batch* new_msg_batch(size_t capacity);
+
+/**
+ * free_msg_batch: release resources allocated for batch
+ *
+ * @batch: batch to free
+ *
+**/
+void free_msg_batch(struct msg_batch* batch);
+
+/**
+ * receive_msgs: receive up to n queued messages from dst_fd in a single
+ * syscall, without blocking
+ *
+ * @dst_fd: bound fd to receive messages
+ * @batch: preallocated batch to fill in
+ * @n: maximum number of messages to receive (capped to batch capacity)
+ *
+ * @returns -1 on error or number of messages received. errno is EAGAIN
+ * when there was nothing queued on the socket.
+ *
+ * Received messages are valid until the next call to receive_msgs on batch.
+**/
+int receive_msgs(int dst_fd, struct msg_batch* batch, size_t n);
+
+/**
+ * receive_conn_msgs: receive up to n queued messages from a connection in a
+ * single syscall, without blocking. Nothing is parsed out of control data:
+ * every message is attributed to cred, which the connection was
+ * authenticated with
+ *
+ * @conn_fd: connected seqpacket fd
+ * @batch: preallocated batch to fill in
+ * @n: maximum number of messages to receive (capped to batch capacity)
+ * @cred: credentials of the other end of the connection
+ *
+ * @returns -1 on error, 0 once the other end closed the connection, or the
+ * number of messages received. errno is EAGAIN when there was nothing queued.
+ *
+ * Received messages are valid until the next receive on batch.
+**/
+int receive_conn_msgs(int conn_fd, struct msg_batch* batch, size_t n, struct ucred* cred);
+
+/**
+ * batch_slot: returns the i-th message received in batch
+ *
+ * @batch: batch filled in by receive_msgs
+ * @i: index of message in batch
+ *
+ * @returns message slot, with its metadata filled in, owned by batch
+ *
+**/
+struct msg_slot* batch_slot(struct msg_batch* batch, size_t i);
+
+/**
+ * batch_len: returns the number of messages currently held in batch
+ *
+ * @batch: message batch
+ *
 **/
-int receive_msg(int dst_fd, struct msghdr** msg);
+size_t batch_len(struct msg_batch* batch);
 
+/**
+ * queue_msg: copies payload into the next free slot of batch, addressed to dst,
+ * to be transmitted on the next send_msgs
+ *
+ * @batch: batch to queue message on
+ * @dst: address of destination, or NULL for messages sent over a connection
+ * @dst_len: length of dst, as reported by the kernel for received messages
+ * @payload: message payload
+ * @payload_len: size of payload in bytes
+ *
+ * @returns -1 if the batch is full or the payload too large, 0 otherwise
+ *
+**/
+int queue_msg(struct msg_batch* batch, struct sockaddr_un* dst, socklen_t dst_len,
+              uint8_t* payload, size_t payload_len);
+
+/**
+ * send_msgs: transmits every message queued on batch with sendmmsg, each to
+ * its own destination, and empties the batch
+ *
+ * @src_fd: bound fd to send messages from (need not be connected), or the
+ * connection messages queued without a destination go out on
+ * @batch: batch of queued messages
+ *
+ * @returns number of messages sent. Messages whose destination is gone
+ * or would block are dropped.
+ *
+**/
+int send_msgs(int src_fd, struct msg_batch* batch);
 
 /**
  * get_header_credentials: pulls the credentials from a msg header
@@ -79,4 +414,36 @@ int receive_msg(int dst_fd, struct msghdr** msg);
 **/
 struct ucred* get_header_credentials(struct msghdr* hdr);
 
+/**
+ * open_pidfd: opens a pidfd referring to process, which becomes readable
+ * when the process exits
+ *
+ * @process: pid of process
+ *
+ * @returns pidfd, or -1 on error (errno is ENOSYS on kernels without pidfds)
+ *
+**/
+int open_pidfd(pid_t process);
+
+/**
+ * notify_ready: tells the supervising daemon that this process is up and its
+ * socket bound, by writing to and closing the fd named by READY_FD_ENV.
+ * Does nothing for a process that wasn't started by the daemon.
+ *
+ * @returns 0 on success or if not supervised, -1 on error
+ *
+**/
+int notify_ready();
+
+/**
+ * get_process_start_time: reads when process started, which together with
+ * its pid uniquely identifies a process across pid reuse
+ *
+ * @process: pid of process
+ *
+ * @returns start time in clock ticks since boot, or 0 if process is not running
+ *
+**/
+uint64_t get_process_start_time(pid_t process);
+
 #endif // COMMSLIB_H
@@ -0,0 +1,380 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "loglib/loglib.h"
+#include "config.h"
+
+#define MAX_LINE_LEN 1024
+#define AUTHORIZES_SEPARATORS ", \t"
+
+// names of authorized processes are only resolved once the whole file is
+// read, as the graph may point forward
+struct pending_spec {
+  char authorizes[MAX_LINE_LEN];
+  int line;
+};
+
+static struct process_spec* add_spec(struct process_table* table, struct pending_spec** pending,
+                                     size_t* capacity, char* name);
+static int set_field(struct process_spec* spec, struct pending_spec* pending, char* key, char* value);
+static int resolve_authorizes(struct process_table* table, struct pending_spec* pending);
+static int validate_table(struct process_table* table, struct pending_spec* pending);
+static ssize_t find_spec(struct process_table* table, const char* name);
+static int copy_string(char* dst, size_t dst_len, const char* src);
+static char* trim(char* s);
+
+struct process_table* load_process_table(const char* path) {
+  char line[MAX_LINE_LEN];
+  struct process_table* table;
+  struct pending_spec* pending;
+  struct process_spec* spec;
+  size_t capacity;
+  int line_num;
+  FILE* f;
+
+  f = fopen(path, "r");
+  if (!f) {
+    log_perror("could not open process table");
+    return NULL;
+  }
+
+  table = calloc(1, sizeof(struct process_table));
+  if (!table) {
+    fclose(f);
+    return NULL;
+  }
+  pending = NULL;
+  capacity = 0;
+  spec = NULL;
+
+  for (line_num = 1; fgets(line, sizeof(line), f); line_num++) {
+    char* comment, *s, *eq;
+
+    comment = strchr(line, '#');
+    if (comment) {
+      *comment = '\0';
+    }
+    s = trim(line);
+    if (*s == '\0') {
+      continue;
+    }
+
+    if (*s == '[') {
+      char* end = strchr(s, ']');
+      if (!end || *trim(end + 1) != '\0') {
+        log_error("%s:%d: malformed section", path, line_num);
+        goto ERROR;
+      }
+      *end = '\0';
+
+      spec = add_spec(table, &pending, &capacity, trim(s + 1));
+      if (!spec) {
+        log_error("%s:%d: invalid or duplicate process", path, line_num);
+        goto ERROR;
+      }
+      pending[table->len - 1].line = line_num;
+      continue;
+    }
+
+    eq = strchr(s, '=');
+    if (!spec || !eq) {
+      log_error("%s:%d: expected a [process] or key = value", path, line_num);
+      goto ERROR;
+    }
+    *eq = '\0';
+
+    if (set_field(spec, &pending[table->len - 1], trim(s), trim(eq + 1)) < 0) {
+      log_error("%s:%d: invalid value for %s", path, line_num, trim(s));
+      goto ERROR;
+    }
+  }
+
+  if (resolve_authorizes(table, pending) < 0 || validate_table(table, pending) < 0) {
+    goto ERROR;
+  }
+
+  free(pending);
+  fclose(f);
+  return table;
+
+ERROR:
+  free(pending);
+  free_process_table(table);
+  fclose(f);
+  return NULL;
+}
+
+struct process_table* default_process_table(const char* server_addr, const char* proxy_binary,
+                                            const char* proxy_addr) {
+  struct process_table* table;
+  struct pending_spec* pending;
+  struct process_spec* server, *proxy;
+  size_t capacity;
+
+  table = calloc(1, sizeof(struct process_table));
+  if (!table) {
+    return NULL;
+  }
+  pending = NULL;
+  capacity = 0;
+
+  server = add_spec(table, &pending, &capacity, "server");
+  proxy = server ? add_spec(table, &pending, &capacity, "proxy") : NULL;
+  if (!proxy) {
+    goto ERROR;
+  }
+  // add_spec may have moved the first spec
+  server = &table->specs[0];
+
+  if (set_field(server, &pending[0], "kind", "server") < 0 ||
+      set_field(server, &pending[0], "addr", (char*) server_addr) < 0 ||
+      set_field(server, &pending[0], "authorizes", "proxy") < 0 ||
+      set_field(proxy, &pending[1], "kind", "exec") < 0 ||
+      set_field(proxy, &pending[1], "binary", (char*) proxy_binary) < 0 ||
+      set_field(proxy, &pending[1], "addr", (char*) proxy_addr) < 0 ||
+      set_field(proxy, &pending[1], "authorizes", "server") < 0) {
+    goto ERROR;
+  }
+
+  if (resolve_authorizes(table, pending) < 0 || validate_table(table, pending) < 0) {
+    goto ERROR;
+  }
+
+  free(pending);
+  return table;
+
+ERROR:
+  free(pending);
+  free_process_table(table);
+  return NULL;
+}
+
+void free_process_table(struct process_table* table) {
+  for (size_t i = 0; i < table->len; i++) {
+    free(table->specs[i].authorizes);
+  }
+  free(table->specs);
+  free(table);
+}
+
+/**
+ * add_spec: appends a spec with default settings
+ *
+ * @table: table to append to
+ * @pending: unresolved fields of each spec, grown along with table
+ * @capacity: number of specs allocated
+ * @name: name of the process
+ *
+ * @returns the new spec, or NULL if name is invalid or taken
+**/
+static struct process_spec* add_spec(struct process_table* table, struct pending_spec** pending,
+                                     size_t* capacity, char* name) {
+  struct process_spec* spec;
+
+  if (*name == '\0' || find_spec(table, name) >= 0) {
+    return NULL;
+  }
+
+  if (table->len == *capacity) {
+    size_t new_capacity = *capacity ? *capacity * 2 : 8;
+    struct process_spec* specs = realloc(table->specs, new_capacity * sizeof(struct process_spec));
+    if (!specs) {
+      return NULL;
+    }
+    table->specs = specs;
+
+    struct pending_spec* new_pending = realloc(*pending, new_capacity * sizeof(struct pending_spec));
+    if (!new_pending) {
+      return NULL;
+    }
+    *pending = new_pending;
+    *capacity = new_capacity;
+  }
+
+  spec = &table->specs[table->len];
+  memset(spec, 0, sizeof(struct process_spec));
+  memset(&(*pending)[table->len], 0, sizeof(struct pending_spec));
+  if (copy_string(spec->name, sizeof(spec->name), name) < 0) {
+    return NULL;
+  }
+  spec->kind = PROCESS_KIND_EXEC;
+  spec->reactors = DEFAULT_REACTORS;
+  spec->workers = DEFAULT_WORKERS;
+  spec->heartbeat_interval = DEFAULT_HEARTBEAT_INTERVAL;
+  spec->transport = TRANSPORT_DATAGRAM;
+
+  table->len++;
+  return spec;
+}
+
+static int set_field(struct process_spec* spec, struct pending_spec* pending, char* key, char* value) {
+  char* end;
+
+  if (strcmp(key, "kind") == 0) {
+    if (strcmp(value, "server") == 0) {
+      spec->kind = PROCESS_KIND_SERVER;
+    } else if (strcmp(value, "exec") == 0) {
+      spec->kind = PROCESS_KIND_EXEC;
+    } else {
+      return -1;
+    }
+  } else if (strcmp(key, "binary") == 0) {
+    return copy_string(spec->binary, sizeof(spec->binary), value);
+  } else if (strcmp(key, "addr") == 0) {
+    return copy_string(spec->addr, sizeof(spec->addr), value);
+  } else if (strcmp(key, "reactors") == 0) {
+    spec->reactors = strtoul(value, &end, 10);
+    if (*end != '\0' || spec->reactors == 0) {
+      return -1;
+    }
+  } else if (strcmp(key, "workers") == 0) {
+    spec->workers = strtoul(value, &end, 10);
+    if (*end != '\0' || value[0] == '\0') {
+      return -1;
+    }
+  } else if (strcmp(key, "heartbeat_interval") == 0) {
+    spec->heartbeat_interval = strtoul(value, &end, 10);
+    if (*end != '\0' || spec->heartbeat_interval == 0) {
+      return -1;
+    }
+  } else if (strcmp(key, "standby") == 0) {
+    if (strcmp(value, "yes") == 0) {
+      spec->standby = 1;
+    } else if (strcmp(value, "no") == 0) {
+      spec->standby = 0;
+    } else {
+      return -1;
+    }
+  } else if (strcmp(key, "transport") == 0) {
+    if (strcmp(value, "datagram") == 0) {
+      spec->transport = TRANSPORT_DATAGRAM;
+    } else if (strcmp(value, "seqpacket") == 0) {
+      spec->transport = TRANSPORT_SEQPACKET;
+    } else {
+      return -1;
+    }
+  } else if (strcmp(key, "io_engine") == 0) {
+    if (strcmp(value, "libevent") == 0) {
+      spec->io_uring = 0;
+    } else if (strcmp(value, "io_uring") == 0) {
+      spec->io_uring = 1;
+    } else {
+      return -1;
+    }
+  } else if (strcmp(key, "authorizes") == 0) {
+    return copy_string(pending->authorizes, sizeof(pending->authorizes), value);
+  } else {
+    return -1;
+  }
+
+  return 0;
+}
+
+static int resolve_authorizes(struct process_table* table, struct pending_spec* pending) {
+  for (size_t i = 0; i < table->len; i++) {
+    struct process_spec* spec = &table->specs[i];
+    char* name, *save;
+
+    spec->authorizes = malloc(table->len * sizeof(size_t));
+    if (!spec->authorizes) {
+      return -1;
+    }
+
+    for (name = strtok_r(pending[i].authorizes, AUTHORIZES_SEPARATORS, &save); name;
+         name = strtok_r(NULL, AUTHORIZES_SEPARATORS, &save)) {
+      ssize_t peer = find_spec(table, name);
+      if (peer < 0 || (size_t) peer == i) {
+        log_error("line %d: %s can't authorize %s", pending[i].line, spec->name, name);
+        return -1;
+      }
+      // each edge would send every authorization again
+      for (size_t j = 0; j < spec->num_authorizes; j++) {
+        if (spec->authorizes[j] == (size_t) peer) {
+          log_error("line %d: %s authorizes %s twice", pending[i].line, spec->name, name);
+          return -1;
+        }
+      }
+      if (spec->num_authorizes == table->len) {
+        return -1;
+      }
+      spec->authorizes[spec->num_authorizes++] = peer;
+    }
+  }
+
+  return 0;
+}
+
+static int validate_table(struct process_table* table, struct pending_spec* pending) {
+  if (table->len == 0) {
+    log_error("process table is empty");
+    return -1;
+  }
+
+  for (size_t i = 0; i < table->len; i++) {
+    struct process_spec* spec = &table->specs[i];
+
+    if (spec->addr[0] == '\0') {
+      log_error("%s has no addr", spec->name);
+      return -1;
+    }
+    if (spec->kind == PROCESS_KIND_EXEC && spec->binary[0] == '\0') {
+      log_error("%s has no binary", spec->name);
+      return -1;
+    }
+    if (spec->kind == PROCESS_KIND_EXEC &&
+        (spec->standby || spec->reactors != 1 || spec->workers != DEFAULT_WORKERS ||
+         spec->transport != TRANSPORT_DATAGRAM || spec->io_uring)) {
+      log_error("%s: standby, reactors, workers, transport and io_engine only apply to servers", spec->name);
+      return -1;
+    }
+    if (spec->io_uring && spec->transport != TRANSPORT_DATAGRAM) {
+      log_error("%s: io_uring only serves datagrams", spec->name);
+      return -1;
+    }
+    // their sockets, shards and control sockets would all be the same
+    for (size_t j = 0; j < i; j++) {
+      if (strcmp(spec->addr, table->specs[j].addr) == 0) {
+        log_error("line %d: %s has the addr of %s", pending[i].line, spec->name, table->specs[j].name);
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static ssize_t find_spec(struct process_table* table, const char* name) {
+  for (size_t i = 0; i < table->len; i++) {
+    if (strcmp(table->specs[i].name, name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int copy_string(char* dst, size_t dst_len, const char* src) {
+  if (strlen(src) >= dst_len) {
+    return -1;
+  }
+  strcpy(dst, src);
+  return 0;
+}
+
+static char* trim(char* s) {
+  char* end;
+
+  while (isspace((unsigned char) *s)) {
+    s++;
+  }
+  end = s + strlen(s);
+  while (end > s && isspace((unsigned char) end[-1])) {
+    end--;
+  }
+  *end = '\0';
+
+  return s;
+}
@@ -0,0 +1,102 @@
+/**
+ * Config - Process table configuration
+ *
+ * Describes the processes the daemon supervises and who authorizes whom.
+ * The table is read from a file of sections, one per process:
+ *
+ *   # comments run to the end of the line
+ *   [server]
+ *   kind = server            # in-process server, or exec to run binary
+ *   addr = /tmp/server       # socket path it binds, before sharding
+ *   reactors = 1             # server shards, see server_config
+ *   workers = 1              # threads for slow requests, 0 for none (servers only)
+ *   heartbeat_interval = 2000  # ms
+ *   standby = no             # keep a prewarmed standby (servers only)
+ *   transport = datagram     # or seqpacket (servers only)
+ *   io_engine = libevent     # or io_uring, datagram servers only
+ *   authorizes = proxy       # processes whose requests it must accept
+ *
+ *   [proxy]
+ *   kind = exec
+ *   binary = ../proxy-service/bin/proxy
+ *   addr = /tmp/proxy
+ *   authorizes = server
+ *
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/un.h>
+
+#include "commslib/commslib.h"
+
+#define PROCESS_NAME_LEN 32
+#define BINARY_PATH_LEN 256
+#define DEFAULT_HEARTBEAT_INTERVAL 2000 // ms
+#define DEFAULT_REACTORS 1
+#define DEFAULT_WORKERS 1
+
+enum process_kind {
+  PROCESS_KIND_SERVER, // runs new_server in a forked child
+  PROCESS_KIND_EXEC, // runs binary
+};
+
+struct process_spec {
+  char name[PROCESS_NAME_LEN];
+  enum process_kind kind;
+  char binary[BINARY_PATH_LEN];
+  char addr[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+  size_t reactors;
+  size_t workers;
+  unsigned int heartbeat_interval; // ms
+  uint8_t standby;
+  enum transport transport; // how the monitor talks to it
+  uint8_t io_uring; // reactors run on io_uring rather than libevent
+
+  // edges of the dependency graph: indexes of the specs this process
+  // must whitelist once it is up
+  size_t* authorizes;
+  size_t num_authorizes;
+};
+
+struct process_table {
+  struct process_spec* specs;
+  size_t len;
+};
+
+/**
+ * load_process_table: reads and validates a process table
+ *
+ * @path: path of config file
+ *
+ * @returns the table, or NULL if the file can't be read or is invalid, in
+ * which case the reason is printed with its line number. Caller must free
+ * after use by calling free_process_table.
+**/
+struct process_table* load_process_table(const char* path);
+
+/**
+ * default_process_table: the table used when no config file is given, a
+ * server and a proxy that authorize each other
+ *
+ * @server_addr: socket path of the server
+ * @proxy_binary: path of the proxy executable
+ * @proxy_addr: socket path of the proxy
+ *
+ * @returns the table or NULL on error. Caller must free after use by
+ * calling free_process_table.
+**/
+struct process_table* default_process_table(const char* server_addr, const char* proxy_binary,
+                                            const char* proxy_addr);
+
+/**
+ * free_process_table: frees resources used by the table
+ *
+ * @table: table to free
+**/
+void free_process_table(struct process_table* table);
+
+#endif // CONFIG_H
@@ -11,9 +11,17 @@
 #include <sys/socket.h>
 #include <fcntl.h>
 #include <sys/un.h>
+#include <signal.h>
+#include <time.h>
+#include <spawn.h>
+#include <event2/event.h>
 
 #include "commslib/commslib.h"
 #include "protolib/protolib.h"
+#include "detector/detector.h"
+#include "config/config.h"
+#include "inflight/inflight.h"
+#include "loglib/loglib.h"
 #include "service_reader.h"
 #include "service_builder.h"
 #include "service_verifier.h"
@@ -25,275 +33,1617 @@
 #define PROCESS_MONITOR_ADDR "/tmp/process_monitor"
 #define PROXY_ADDR "/tmp/proxy"
 #define SERVER_ADDR "/tmp/server"
+#define STANDBY_SUFFIX ".standby" // standbys bind next to their active
 #define PROXY_BIN "../proxy-service/bin/proxy"
 
-#define SLEEP_TIMEOUT 2
-#define MAX_LAG 2
+#define SUSPICION_CHECK_INTERVAL 100 // ms between suspicion checks of an unanswered heartbeat
+#define INITIAL_RTT 500 // ms, assumed until a process answers its first heartbeat
+#define MIN_RTT_STD_DEV 50 // ms
+#define ACCEPTABLE_PAUSE 250 // ms of scheduling or gc stall tolerated on top of the mean rtt
+#define AUTHORIZE_TIMEOUT 1000 // ms a peer has to answer an authorization
+#define AUTHORIZE_RETRIES 2
+#define READY_TIMEOUT 5 // seconds a new process has to report it is ready
+#define MONITOR_BATCH_SIZE 32 // datagrams drained or sent per syscall
+#define MIN_INDEX_SLOTS 16
+#define MAX_PIPELINED_HEARTBEATS 4 // heartbeats in flight to one process
 
-#define OTHER_PROCESS(i) (!i)
+struct monitor;
+struct process;
+
+enum request_type {
+  REQUEST_HEARTBEAT, // owned by the process
+  REQUEST_AUTHORIZE, // owned by the authorization
+};
+
+extern char** environ;
+
+// An edge of the dependency graph: authorizer must whitelist subject. It
+// carries the last request sent for the edge, in flight as seq while
+// outstanding and resent on timeout at most AUTHORIZE_RETRIES times.
+struct authorization {
+  struct process* authorizer;
+  struct process* subject;
+
+  struct authorize_process_request req;
+  uint64_t seq;
+  uint8_t outstanding;
+  int retries;
+};
 
 struct process {
-  char addr[255];
+  struct process_spec* spec;
+
+  char addr[255]; // socket the monitor talks to
+  char bind_addr[255]; // socket path the process binds, before sharding
 
-  int lag;
-  int max_lag;
   uint64_t seq_num;
 
   pid_t pid;
+
+  // starts a new instance that reports readiness on ready_fd, returns its pid
+  pid_t (*spawn)(struct process* p, int ready_fd);
+
+  // sockets the daemon bound for the process and hands to every instance of
+  // it, so datagrams queue up while it is being replaced. NULL if the
+  // process binds its own
+  int* listen_fds;
+  size_t num_listen_fds;
+
+  // an already started instance waiting to replace this one, or NULL. A
+  // standby is not heartbeated and nothing depends on it
+  struct process* standby;
+  uint8_t is_standby;
+
+  struct monitor* monitor;
+
+  // connection the monitor sends over once the process is ready, and the
+  // replies it gets back on it
+  struct peer* peer;
+  struct event* peer_event;
+
+  // readable as soon as the process exits, -1 if pidfds are unsupported
+  int pidfd;
+  struct event* exit_event;
+
+  // read end of the pipe the process reports readiness on, see notify_ready.
+  // Until then it is neither heartbeated nor asked to authorize anyone
+  uint8_t ready;
+  int ready_fd;
+  struct event* ready_event;
+  struct timespec spawned;
+
+  // seqs of the heartbeats in flight, oldest first. The detector judges
+  // the time since hb_since, when the oldest of them was sent
+  struct event* hb_timer;
+  uint64_t hb_seqs[MAX_PIPELINED_HEARTBEATS];
+  size_t hb_first;
+  size_t hb_outstanding;
+  struct timespec hb_since;
+  struct failure_detector* detector;
+
+  // edges to the processes this one whitelists. A standby's mirror its
+  // active's, index for index
+  struct authorization* authorizes;
+  size_t num_authorizes;
+
+  // edges of the active processes that whitelist this one
+  struct authorization** authorized_by;
+  size_t num_authorized_by;
+};
+
+struct pid_slot {
+  pid_t pid; // 0 if free
+  struct process* process;
+};
+
+// Open addressing map from a pid to the active or standby running as it,
+// so a reply finds its sender in constant time however long the table is.
+struct pid_index {
+  struct pid_slot* slots;
+  size_t mask;
+  size_t len;
 };
 
-static void spawn_server();
-static void spawn_proxy();
+// The monitor heartbeats every process on its own timer and waits for the
+// replies on its event loop, so a slow or dead process only delays itself.
+struct monitor {
+  int fd;
+  struct process* processes;
+  size_t num_processes;
+  struct pid_index index;
+
+  struct msg_batch* replies;
+  struct msg_batch* requests; // to processes we aren't connected to
+  struct peer_cache* peers;
+
+  // every request waiting on a reply, expired by deadline_event
+  struct inflight_table* inflight;
+  uint64_t stale_replies; // matched no request in flight
+  uint64_t lost_heartbeats; // overtaken by the reply to a later one
+
+  struct event_base* evloop;
+  struct event* reply_event;
+  struct event* deadline_event;
+  struct event* flush_event; // sends the requests queued this loop iteration
+  struct event* stats_event; // SIGUSR1 dumps rtt distributions
+  struct event* sigchld_event; // reaps the processes without an exit watch
+
+  struct timespec started;
+  uint8_t all_ready; // every process reported ready at least once
+};
+
+static pid_t spawn_server(struct process* p, int ready_fd);
+static pid_t spawn_exec(struct process* p, int ready_fd);
+static uint8_t is_env_var(const char* var, const char* name);
+static int bind_listen_fds(struct process* p, size_t num_fds);
+
+static struct monitor* new_monitor(int fd, struct process_table* table,
+                                   struct detector_config* detector_config, uint8_t handoff);
+static int init_process(struct monitor* m, struct process* p, struct process_spec* spec,
+                        uint8_t is_standby, struct detector_config* detector_config);
+static int init_authorizations(struct process* p);
+static int link_authorizations(struct monitor* m);
+static void free_process(struct process* p);
+static void free_monitor(struct monitor* m);
+int monitor_processes(struct monitor* m);
+
+static void heartbeat_handler(int fd, short evtype, void* arg);
+static void deadline_handler(int fd, short evtype, void* arg);
+static void flush_handler(int fd, short evtype, void* arg);
+static void reply_handler(int fd, short evtype, void* arg);
+static void peer_reply_handler(int fd, short evtype, void* arg);
+static void child_exit_handler(int pidfd, short evtype, void* arg);
+static void sigchld_handler(int signum, short evtype, void* arg);
+static void reap_unwatched(struct process* p);
+static void log_exit(struct process* p, int status);
+static void stats_handler(int signum, short evtype, void* arg);
+static void ready_handler(int ready_fd, short evtype, void* arg);
+static void handle_reply(struct monitor* m, struct msg_slot* msg);
+static void handle_heartbeat(struct monitor* m, struct process* p, struct inflight_request* req);
+
+static int queue_request(struct monitor* m, struct process* p, uint8_t* payload, size_t payload_len);
+static void arm_deadlines(struct monitor* m);
+static int connect_process(struct process* p);
+static int watch_connection(struct process* p);
+static void disconnect_process(struct process* p);
+static void drop_requests(struct process* p);
+static int start_process(struct process* p);
+static void unwatch_ready(struct process* p);
+static int watch_child(struct process* p);
+static void unwatch_child(struct process* p);
+static int start_heartbeats(struct process* p);
+static int recover_process(struct process* p);
+static int restart_process(struct process* p);
+static void reset_process(struct process* p);
+static int respawn_process(struct process* p);
+static int promote_standby(struct process* p);
+int authorize(struct authorization* auth, pid_t old_pid, pid_t new_pid);
+static int send_authorization(struct authorization* auth);
+static double elapsed_ms(struct timespec* since);
 
-void monitor_processes(int fd, struct process** processes);
-static int recover_process(int fd, struct process** processes, size_t process_entry);
-static int handle_heartbeat(int fd, struct process* p);
-int authorize_peer(int fd, struct process* peer, pid_t old_pid, pid_t new_pid);
+static int init_pid_index(struct pid_index* index, size_t capacity);
+static int index_pid(struct pid_index* index, pid_t pid, struct process* p);
+static void unindex_pid(struct pid_index* index, pid_t pid);
+static struct process* lookup_pid(struct pid_index* index, pid_t pid);
+static size_t pid_home(struct pid_index* index, pid_t pid);
 
 int main(int argc, char** argv) {
-  pid_t server_pid, proxy_pid;
-  int status;
+  int status, opt;
   int fd;
+  uint8_t use_standby, use_handoff;
+  char* config_path;
+  struct process_table* table;
+  enum log_level level;
+
+  struct detector_config detector_config = {
+    .window = DEFAULT_DETECTOR_WINDOW,
+    .threshold = DEFAULT_PHI_THRESHOLD,
+    .initial_rtt = INITIAL_RTT,
+    .min_std_dev = MIN_RTT_STD_DEV,
+    .acceptable_pause = ACCEPTABLE_PAUSE,
+  };
+
+  use_standby = 0;
+  use_handoff = 0;
+  config_path = NULL;
+  level = LOG_LEVEL_INFO;
+  while ((opt = getopt(argc, argv, "c:Hl:st:w:")) != -1) {
+    switch (opt) {
+      case 'c':
+        config_path = optarg;
+        break;
+      case 'H':
+        use_handoff = 1;
+        break;
+      case 'l':
+        if (log_parse_level(optarg, &level) < 0) {
+          fprintf(stderr, "log level must be debug, info, warn or error\n");
+          return -1;
+        }
+        break;
+      case 's':
+        use_standby = 1;
+        break;
+      case 't':
+        detector_config.threshold = atof(optarg);
+        break;
+      case 'w':
+        detector_config.window = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-c process_table] [-H | -s] [-l log_level] [-t phi_threshold] [-w rtt_window]\n",
+                argv[0]);
+        return -1;
+    }
+  }
+
+  // servers forked from here get a flusher of their own, if this one fails
+  // to start everything is logged synchronously
+  log_start(level, STDERR_FILENO);
+
+  if (config_path) {
+    table = load_process_table(config_path);
+  } else {
+    table = default_process_table(SERVER_ADDR, PROXY_BIN, PROXY_ADDR);
+  }
+  if (!table) {
+    log_error("failed to load process table");
+    return -1;
+  }
+
+  for (size_t i = 0; i < table->len; i++) {
+    if (use_standby && table->specs[i].kind == PROCESS_KIND_SERVER) {
+      table->specs[i].standby = 1;
+    }
+    // a standby reading the same sockets would steal the active's requests
+    if (use_handoff && table->specs[i].standby) {
+      log_error("socket handoff and standby servers are exclusive");
+      free_process_table(table);
+      return -1;
+    }
+  }
 
   fd = setup_datagram_socket(PROCESS_MONITOR_ADDR);
   if (fd < 0) {
-    perror("failed to create socket");
+    log_perror("failed to create socket");
+    free_process_table(table);
     return -1;
   }
 
-  proxy_pid = fork();
-  if (proxy_pid < 0) {
-    perror("child fork failed");
+  if (init_message_templates() < 0) {
+    log_warn("heartbeats will be built from scratch");
+  }
+
+  struct monitor* m = new_monitor(fd, table, &detector_config, use_handoff);
+  if (!m) {
+    log_perror("failed to create monitor");
+    free_process_table(table);
     return -1;
   }
 
-  if (proxy_pid == 0) {
-    spawn_proxy();
-  } else {
-    server_pid = fork();
-    if (server_pid < 0) {
-      perror("server fork failed");
+  // every process is started before any reports ready, so each can
+  // authorize the pids it depends on as soon as it does
+  for (size_t i = 0; i < m->num_processes; i++) {
+    struct process* p = &m->processes[i];
+
+    if (start_process(p) < 0) {
+      free_monitor(m);
+      free_process_table(table);
       return -1;
     }
-  
-    if (server_pid == 0) {
-      spawn_server();
-    } else {
-      printf("Starting server at %d and proxy at %d\n", server_pid, proxy_pid);
+    log_info("Starting %s at %d", p->spec->name, p->pid);
+
+    if (p->standby) {
+      start_process(p->standby);
+    }
+  }
+
+  status = monitor_processes(m);
+  free_monitor(m);
+  free_process_table(table);
+  return status;
+}
+
+static struct monitor* new_monitor(int fd, struct process_table* table,
+                                   struct detector_config* detector_config, uint8_t handoff) {
+  size_t capacity;
+
+  struct monitor* m = malloc(sizeof(struct monitor));
+  if (!m) {
+    return NULL;
+  }
+  memset(m, 0, sizeof(struct monitor));
+  m->fd = fd;
 
-      struct process server_process = {
-        .addr = SERVER_ADDR,
-        .lag = 0,
-        .max_lag = MAX_LAG,
-        .seq_num = 0,
-        .pid = server_pid,
-      };
+  m->evloop = event_base_new();
+  if (!m->evloop) {
+    log_perror("could not initialize event loop");
+    goto ERROR;
+  }
+
+  m->replies = new_msg_batch(MONITOR_BATCH_SIZE);
+  m->requests = new_msg_batch(MONITOR_BATCH_SIZE);
+  if (!m->replies || !m->requests) {
+    goto ERROR;
+  }
+
+  m->reply_event = event_new(m->evloop, fd, EV_READ | EV_PERSIST, reply_handler, (void*) m);
+  m->deadline_event = evtimer_new(m->evloop, deadline_handler, (void*) m);
+  m->flush_event = event_new(m->evloop, -1, 0, flush_handler, (void*) m);
+  m->stats_event = evsignal_new(m->evloop, SIGUSR1, stats_handler, (void*) m);
+  m->sigchld_event = evsignal_new(m->evloop, SIGCHLD, sigchld_handler, (void*) m);
+  if (!m->reply_event || !m->deadline_event || !m->flush_event || !m->stats_event || !m->sigchld_event) {
+    log_perror("failed to create monitor events");
+    goto ERROR;
+  }
+
+  // room for every active and its standby
+  if (init_pid_index(&m->index, 2 * table->len) < 0) {
+    goto ERROR;
+  }
+
+  // at most one request per edge, the standby's included, on top of the
+  // pipelined heartbeats
+  capacity = 0;
+  for (size_t i = 0; i < table->len; i++) {
+    capacity += MAX_PIPELINED_HEARTBEATS + (table->specs[i].standby ? 2 : 1) * table->specs[i].num_authorizes;
+  }
+  m->inflight = new_inflight_table(capacity);
+  if (!m->inflight) {
+    goto ERROR;
+  }
+
+  m->peers = new_peer_cache(2 * table->len);
+  if (!m->peers) {
+    goto ERROR;
+  }
 
-      struct process proxy_process = {
-        .addr = PROXY_ADDR,
-        .lag = 0,
-        .max_lag = MAX_LAG,
-        .seq_num = 0,
-        .pid = proxy_pid,
-      };
+  m->processes = calloc(table->len, sizeof(struct process));
+  if (!m->processes) {
+    goto ERROR;
+  }
+  m->num_processes = table->len;
 
-      struct process* processes[2] = { &server_process, &proxy_process };
+  for (size_t i = 0; i < m->num_processes; i++) {
+    struct process* p = &m->processes[i];
+    struct process_spec* spec = &table->specs[i];
 
-      // we need to wait for proxy to come alive
-      sleep(3);
+    if (init_process(m, p, spec, 0, detector_config) < 0) {
+      goto ERROR;
+    }
 
-      authorize_peer(fd, &server_process, 0, proxy_pid);
-      authorize_peer(fd, &proxy_process, 0, server_pid);
+    if (spec->standby) {
+      p->standby = calloc(1, sizeof(struct process));
+      if (!p->standby || init_process(m, p->standby, spec, 1, detector_config) < 0) {
+        goto ERROR;
+      }
+    }
 
-      monitor_processes(fd, processes);
+    if (handoff && bind_listen_fds(p, spec->kind == PROCESS_KIND_SERVER ? spec->reactors : 1) < 0) {
+      goto ERROR;
     }
   }
+
+  // edges point into the table, so it has to be complete first
+  if (link_authorizations(m) < 0) {
+    goto ERROR;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &m->started);
+
+  return m;
+
+ERROR:
+  free_monitor(m);
+  return NULL;
 }
 
-void monitor_processes(int fd, struct process** processes) {
-  uint8_t* payload;
-  struct sockaddr_un server;
-  size_t payload_len;
-  pid_t old_pid;
+static int init_process(struct monitor* m, struct process* p, struct process_spec* spec,
+                        uint8_t is_standby, struct detector_config* detector_config) {
+  int len;
+
+  p->spec = spec;
+  p->monitor = m;
+  p->is_standby = is_standby;
+  p->pidfd = -1;
+  p->ready_fd = -1;
+
+  len = snprintf(p->bind_addr, sizeof(p->bind_addr), "%s%s", spec->addr, is_standby ? STANDBY_SUFFIX : "");
+  if (len < 0 || (size_t) len >= sizeof(p->bind_addr)) {
+    log_error("socket path of %s is too long", spec->name);
+    return -1;
+  }
+
+  if (spec->kind == PROCESS_KIND_SERVER) {
+    p->spawn = spawn_server;
+    // the monitor talks to the server's control socket, away from the traffic
+    // of its clients
+    len = snprintf(p->addr, sizeof(p->addr), "%s%s", p->bind_addr, CONTROL_SUFFIX);
+    if (len < 0 || (size_t) len >= sizeof(p->addr)) {
+      log_error("control socket path of %s is too long", spec->name);
+      return -1;
+    }
+  } else {
+    p->spawn = spawn_exec;
+    memcpy(p->addr, p->bind_addr, sizeof(p->addr));
+  }
 
-  while (1) {
-    for (size_t i = 0; i < 2; i++) {
-      struct process* p = processes[i];
+  p->peer = get_peer(m->peers, p->addr, spec->transport);
+  if (!p->peer) {
+    log_error("pm: no room to connect to %s", p->addr);
+    return -1;
+  }
+
+  p->hb_timer = event_new(m->evloop, -1, EV_PERSIST, heartbeat_handler, (void*) p);
+  if (!p->hb_timer) {
+    log_perror("failed to create heartbeat timer");
+    return -1;
+  }
+
+  p->detector = new_failure_detector(detector_config);
+  if (!p->detector) {
+    log_error("failed to create failure detector");
+    return -1;
+  }
 
-      payload_len = marshall_heartbeat_request(p->seq_num, &payload);
-      if (payload_len == 0) {
-        perror("failed to render payload");
-        // our fault, treat as success
-        p->lag = 0;
-        goto NEXT;
+  return init_authorizations(p);
+}
+
+// the subjects are filled in by link_authorizations
+static int init_authorizations(struct process* p) {
+  if (p->spec->num_authorizes == 0) {
+    return 0;
+  }
+
+  p->authorizes = calloc(p->spec->num_authorizes, sizeof(struct authorization));
+  if (!p->authorizes) {
+    return -1;
+  }
+  p->num_authorizes = p->spec->num_authorizes;
+
+  for (size_t i = 0; i < p->num_authorizes; i++) {
+    p->authorizes[i].authorizer = p;
+  }
+
+  return 0;
+}
+
+static int link_authorizations(struct monitor* m) {
+  for (size_t i = 0; i < m->num_processes; i++) {
+    struct process* p = &m->processes[i];
+
+    for (size_t j = 0; j < p->num_authorizes; j++) {
+      struct process* subject = &m->processes[p->spec->authorizes[j]];
+      struct authorization** edges;
+
+      p->authorizes[j].subject = subject;
+      if (p->standby) {
+        p->standby->authorizes[j].subject = subject;
       }
 
-      if (resolve_address(p->addr, &server) < 0) {
-        perror("could not resolve destination address");
-        p->lag = 0;
-        goto NEXT;
+      edges = realloc(subject->authorized_by, (subject->num_authorized_by + 1) * sizeof(struct authorization*));
+      if (!edges) {
+        return -1;
       }
+      edges[subject->num_authorized_by++] = &p->authorizes[j];
+      subject->authorized_by = edges;
+    }
+  }
 
-      if (connect_to_destination(fd, &server) < 0) {
-        perror("could not connect to destination");
-        p->lag++;
-        if (p->lag >= p->max_lag) {
-          recover_process(fd, processes, i);
+  return 0;
+}
+
+static void free_process(struct process* p) {
+  // never initialized if new_monitor failed early
+  if (!p->monitor) {
+    return;
+  }
+
+  unwatch_child(p);
+  unwatch_ready(p);
+  disconnect_process(p);
+  if (p->hb_timer) {
+    event_free(p->hb_timer);
+    p->hb_timer = NULL;
+  }
+  if (p->detector) {
+    free_failure_detector(p->detector);
+    p->detector = NULL;
+  }
+  free(p->authorizes);
+  p->authorizes = NULL;
+  p->num_authorizes = 0;
+  free(p->authorized_by);
+  p->authorized_by = NULL;
+  p->num_authorized_by = 0;
+  for (size_t i = 0; i < p->num_listen_fds; i++) {
+    close(p->listen_fds[i]);
+  }
+  free(p->listen_fds);
+  p->listen_fds = NULL;
+  p->num_listen_fds = 0;
+  p->monitor = NULL;
+}
+
+static void free_monitor(struct monitor* m) {
+  for (size_t i = 0; i < m->num_processes; i++) {
+    if (m->processes[i].standby) {
+      free_process(m->processes[i].standby);
+      free(m->processes[i].standby);
+    }
+    free_process(&m->processes[i]);
+  }
+  free(m->processes);
+  free(m->index.slots);
+  if (m->peers) {
+    free_peer_cache(m->peers);
+  }
+  if (m->inflight) {
+    free_inflight_table(m->inflight);
+  }
+  if (m->deadline_event) {
+    event_free(m->deadline_event);
+  }
+  if (m->flush_event) {
+    event_free(m->flush_event);
+  }
+  if (m->stats_event) {
+    event_free(m->stats_event);
+  }
+  if (m->sigchld_event) {
+    event_free(m->sigchld_event);
+  }
+  if (m->reply_event) {
+    event_free(m->reply_event);
+  }
+  if (m->replies) {
+    free_msg_batch(m->replies);
+  }
+  if (m->requests) {
+    free_msg_batch(m->requests);
+  }
+  if (m->evloop) {
+    event_base_free(m->evloop);
+  }
+  free(m);
+}
+
+int monitor_processes(struct monitor* m) {
+  if (event_add(m->reply_event, NULL) || event_add(m->stats_event, NULL) || event_add(m->sigchld_event, NULL)) {
+    log_perror("failed to add monitor events");
+    return -1;
+  }
+
+  if (event_base_dispatch(m->evloop)) {
+    log_perror("failed to start event loop");
+    return -1;
+  }
+  return 0;
+}
+
+static void heartbeat_handler(int fd, short evtype, void* arg) {
+  uint8_t payload[MAX_MSG_SIZE];
+  size_t payload_len;
+  struct inflight_request* req;
+  struct process* p;
+  struct monitor* m;
+
+  p = (struct process*) arg;
+  m = p->monitor;
+
+  // too far behind already, the detector decides
+  if (p->hb_outstanding == MAX_PIPELINED_HEARTBEATS) {
+    return;
+  }
+
+  payload_len = marshall_heartbeat_request_into(p->seq_num, payload, sizeof(payload));
+  if (payload_len == 0) {
+    // our fault, skip this round
+    log_perror("failed to render payload");
+    return;
+  }
+
+  req = track_request(m->inflight, p->pid, p->seq_num, REQUEST_HEARTBEAT, p, SUSPICION_CHECK_INTERVAL);
+  if (!req) {
+    log_warn("pm: too many requests in flight, skipping heartbeat to %d", p->pid);
+    return;
+  }
+
+  // a heartbeat that can't be delivered stays outstanding, so the detector
+  // notices it the same as one that is never answered
+  if (queue_request(m, p, payload, payload_len) < 0) {
+    log_warn("pm: could not send heartbeat %lu to %d", p->seq_num, p->pid);
+  }
+
+  if (p->hb_outstanding == 0) {
+    p->hb_since = req->sent;
+  }
+  p->hb_seqs[(p->hb_first + p->hb_outstanding++) % MAX_PIPELINED_HEARTBEATS] = p->seq_num++;
+  arm_deadlines(m);
+}
+
+// Expires requests earliest deadline first. An unanswered heartbeat only
+// asks the detector whether its process is still plausibly alive and comes
+// back every SUSPICION_CHECK_INTERVAL until it is answered or the process
+// is suspected, while an unanswered authorization is resent.
+static void deadline_handler(int fd, short evtype, void* arg) {
+  struct inflight_request* req;
+  struct authorization* auth;
+  struct process* p;
+  struct monitor* m;
+  double elapsed;
+
+  m = (struct monitor*) arg;
+
+  while ((req = next_expired(m->inflight))) {
+    switch (req->type) {
+      case REQUEST_HEARTBEAT:
+        p = (struct process*) req->owner;
+        elapsed = elapsed_ms(&p->hb_since);
+        if (!is_suspected(p->detector, elapsed)) {
+          postpone_request(m->inflight, req, SUSPICION_CHECK_INTERVAL);
+          break;
         }
-        goto NEXT;
-      }
-      
-      if (send_msg(fd, payload, payload_len) < 0) {
-        perror("message failed");
-        p->lag++;
-        if (p->lag >= p->max_lag) {
-          recover_process(fd, processes, i);
+
+        log_warn("pm: %zu heartbeats to %s (%d) unanswered for %.0fms, phi %.1f",
+                 p->hb_outstanding, p->spec->name, p->pid, elapsed, suspicion(p->detector, elapsed));
+        // nothing the instance owes us is worth waiting for anymore
+        drop_requests(p);
+        recover_process(p);
+        break;
+      case REQUEST_AUTHORIZE:
+        auth = (struct authorization*) req->owner;
+        release_request(m->inflight, req);
+        auth->outstanding = 0;
+        if (auth->retries >= AUTHORIZE_RETRIES) {
+          log_warn("pm: %s (%d) never authorized %s (%d)", auth->authorizer->spec->name,
+                   auth->authorizer->pid, auth->subject->spec->name, auth->req.new_pid);
+          break;
         }
-        goto NEXT;
+
+        log_warn("pm: authorization %lu to %d timed out, retrying", auth->seq, auth->authorizer->pid);
+        auth->retries++;
+        send_authorization(auth);
+        break;
+    }
+  }
+
+  arm_deadlines(m);
+}
+
+// Requests are queued as timers and replies produce them and leave together
+// once the loop iteration is over, so processes whose heartbeats fall due
+// at the same time share a sendmmsg.
+static void flush_handler(int fd, short evtype, void* arg) {
+  struct monitor* m;
+
+  m = (struct monitor*) arg;
+  if (batch_len(m->requests) > 0) {
+    send_msgs(m->fd, m->requests);
+  }
+}
+
+static void reply_handler(int fd, short evtype, void* arg) {
+  struct monitor* m;
+  int received;
+
+  m = (struct monitor*) arg;
+
+  // drain the socket: a short batch means recvmmsg already hit EAGAIN
+  do {
+    received = receive_msgs(fd, m->replies, MONITOR_BATCH_SIZE);
+    if (received < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_perror("pm: error receiving replies");
       }
+      break;
+    }
 
-      if (handle_heartbeat(fd, p) < 0) {
-        p->lag++;
-        if (p->lag >= p->max_lag) {
-          recover_process(fd, processes, i);
-        }
-        goto NEXT;
+    for (int i = 0; i < received; i++) {
+      handle_reply(m, batch_slot(m->replies, i));
+    }
+  } while (received == MONITOR_BATCH_SIZE);
+}
+
+// Replies on a connection that knows who is on the other end are
+// attributed to that process, without asking the kernel for the
+// credentials of each one. The rest are handled like any other reply.
+static void peer_reply_handler(int fd, short evtype, void* arg) {
+  struct process* p;
+  struct monitor* m;
+  struct ucred cred;
+  int received;
+
+  p = (struct process*) arg;
+  m = p->monitor;
+
+  if (!p->peer->has_credentials) {
+    reply_handler(fd, evtype, (void*) m);
+    return;
+  }
+  cred.pid = p->peer->pid;
+  cred.uid = p->peer->uid;
+  cred.gid = p->peer->gid;
+
+  do {
+    received = receive_conn_msgs(fd, m->replies, MONITOR_BATCH_SIZE, &cred);
+    if (received < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_perror("pm: error receiving replies");
       }
+      break;
+    }
+    if (received == 0) {
+      // reconnected to whoever listens next, once they are ready
+      log_warn("pm: %s (%d) closed its connection", p->spec->name, p->pid);
+      disconnect_process(p);
+      return;
+    }
+
+    for (int i = 0; i < received; i++) {
+      handle_reply(m, batch_slot(m->replies, i));
+    }
+  } while (received == MONITOR_BATCH_SIZE);
+}
+
+static void handle_reply(struct monitor* m, struct msg_slot* msg) {
+  struct inflight_request* req;
+  struct authorization* auth;
+  struct process* p;
+  ns(Message_table_t) reply;
+  ns(Payload_union_type_t) type;
 
-      NEXT: {
-        p->seq_num++;
-        free(payload);
-        sleep(SLEEP_TIMEOUT);
+  if (!msg->md.has_credentials) {
+    log_warn("pm: empty or invalid credentials");
+    return;
+  }
+
+  p = lookup_pid(&m->index, msg->md.pid);
+  if (!p) {
+    log_warn("pm: reply from unknown process %d", msg->md.pid);
+    return;
+  }
+
+  if (ns(Message_verify_as_root(msg->payload, msg->md.len)) != 0) {
+    log_warn("pm: reply from %d could not be verified", p->pid);
+    return;
+  }
+  reply = ns(Message_as_root(msg->payload));
+  type = ns(Message_payload_type_get(reply));
+
+  // anything not in flight answers a request we already gave up on
+  req = find_request(m->inflight, p->pid, ns(Message_seq_num_get(reply)));
+  if (!req) {
+    m->stale_replies++;
+    return;
+  }
+
+  switch (type) {
+    case ns(Payload_HeartbeatResponse):
+      if (req->type != REQUEST_HEARTBEAT) {
+        break;
       }
+      handle_heartbeat(m, p, req);
+      return;
+    case ns(Payload_AuthorizeProcessResponse):
+      if (req->type != REQUEST_AUTHORIZE) {
+        break;
+      }
+      auth = (struct authorization*) req->owner;
+      release_request(m->inflight, req);
+      auth->outstanding = 0;
+      log_info("%s (%d) authorized %s (%d)", p->spec->name, p->pid,
+               auth->subject->spec->name, auth->req.new_pid);
+      return;
+    default:
+      break;
+  }
+  log_warn("pm: unexpected message from %d", p->pid);
+}
+
+static void handle_heartbeat(struct monitor* m, struct process* p, struct inflight_request* req) {
+  struct inflight_request* lost;
+  uint64_t seq;
+
+  record_rtt(p->detector, elapsed_ms(&req->sent));
+
+  // replies come back in the order the heartbeats were sent, so the ones
+  // sent before this one were lost
+  while (p->hb_outstanding > 0) {
+    seq = p->hb_seqs[p->hb_first];
+    p->hb_first = (p->hb_first + 1) % MAX_PIPELINED_HEARTBEATS;
+    p->hb_outstanding--;
+    if (seq == req->seq) {
+      break;
+    }
+
+    lost = find_request(m->inflight, p->pid, seq);
+    if (lost) {
+      release_request(m->inflight, lost);
+    }
+    m->lost_heartbeats++;
+  }
+  release_request(m->inflight, req);
+
+  if (p->hb_outstanding > 0) {
+    req = find_request(m->inflight, p->pid, p->hb_seqs[p->hb_first]);
+    if (req) {
+      p->hb_since = req->sent;
     }
   }
 }
 
-static int recover_process(int fd, struct process** processes, size_t process_entry) {
-  int status;
-  struct process* p, *peer;
-  pid_t new_pid, old_pid;
+static void stats_handler(int signum, short evtype, void* arg) {
+  struct detector_stats stats;
+  struct monitor* m;
+  char phi[32];
 
-  p = processes[process_entry];
-  old_pid = p->pid;
-  
-  printf("Killing %d\n", old_pid);
-  kill(old_pid, SIGKILL);
+  m = (struct monitor*) arg;
+  for (size_t i = 0; i < m->num_processes; i++) {
+    struct process* p = &m->processes[i];
 
-  printf("Reaping %d\n", old_pid);
-  waitpid(old_pid, &status, 0);
+    get_detector_stats(p->detector, &stats);
+    phi[0] = '\0';
+    if (p->hb_outstanding > 0) {
+      snprintf(phi, sizeof(phi), " phi %.2f", suspicion(p->detector, elapsed_ms(&p->hb_since)));
+    }
+    log_info("pm: %s (%d) rtt ms over %zu samples: mean %.3f sd %.3f min %.3f p50 %.3f p90 %.3f p99 %.3f max %.3f%s",
+             p->spec->name, p->pid, stats.samples, stats.mean, stats.std_dev,
+             stats.min, stats.p50, stats.p90, stats.p99, stats.max, phi);
+  }
+  log_info("pm: %zu requests in flight, %lu stale replies, %lu heartbeats lost",
+           inflight_len(m->inflight), m->stale_replies, m->lost_heartbeats);
+}
 
-  new_pid = fork();
-  if (new_pid < 0) {
-    perror("failed to fork new process");
-    return -1;
+static int queue_request(struct monitor* m, struct process* p, uint8_t* payload, size_t payload_len) {
+  struct sockaddr_un dst;
+
+  if (send_to_peer(p->peer, payload, payload_len) == 0) {
+    return 0;
   }
-  
-  if (new_pid == 0) {
-    if (strcmp(p->addr, SERVER_ADDR) == 0) {
-      spawn_server();
-    } else {
-      spawn_proxy();
+  if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    // dropped, same as when sendmmsg finds the queue full
+    return 0;
+  }
+  if (errno != ENOTCONN) {
+    // whoever we were connected to is gone, try wherever the path leads now
+    disconnect_process(p);
+  }
+
+  // a seqpacket socket takes no datagrams, only a new connection reaches it
+  if (p->spec->transport == TRANSPORT_SEQPACKET) {
+    if (!p->ready || connect_process(p) < 0) {
+      return -1;
+    }
+    if (send_to_peer(p->peer, payload, payload_len) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      log_perror("pm: failed to send request");
+      return -1;
     }
+    return 0;
+  }
+
+  if (resolve_address(p->addr, &dst) < 0) {
+    log_perror("could not resolve destination address");
+    return -1;
+  }
+
+  if (batch_len(m->requests) == MONITOR_BATCH_SIZE) {
+    send_msgs(m->fd, m->requests);
+  }
+
+  if (queue_msg(m->requests, &dst, sizeof(struct sockaddr_un), payload, payload_len) < 0) {
+    return -1;
+  }
+  event_active(m->flush_event, EV_WRITE, 0);
+
+  return 0;
+}
+
+// one timer for all requests in flight, due with the earliest of them
+static void arm_deadlines(struct monitor* m) {
+  struct timeval timeout;
+
+  if (next_deadline(m->inflight, &timeout) < 0) {
+    event_del(m->deadline_event);
+    return;
+  }
+  event_add(m->deadline_event, &timeout);
+}
+
+// Connects to p so requests go out with one send() each and its replies
+// come back on a socket of their own. Until then, or if it fails, requests
+// are batched on the monitor's socket.
+static int connect_process(struct process* p) {
+  int fd;
+
+  fd = connect_peer(p->peer);
+  if (fd < 0) {
+    log_perror("pm: could not connect to process");
+    return -1;
+  }
+
+  // a handed over listener reports whoever listened on it last, which is
+  // the instance before p until p is up
+  if (p->peer->has_credentials && p->peer->pid != p->pid) {
+    log_warn("pm: %s is still served by %d, not %d", p->addr, p->peer->pid, p->pid);
+    disconnect_process(p);
+    return -1;
+  }
+
+  return watch_connection(p);
+}
+
+static int watch_connection(struct process* p) {
+  p->peer_event = event_new(p->monitor->evloop, p->peer->fd, EV_READ | EV_PERSIST, peer_reply_handler, (void*) p);
+  if (!p->peer_event || event_add(p->peer_event, NULL)) {
+    log_error("pm: failed to watch connection to %d", p->pid);
+    disconnect_process(p);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void disconnect_process(struct process* p) {
+  if (p->peer_event) {
+    event_free(p->peer_event);
+    p->peer_event = NULL;
+  }
+  if (p->peer) {
+    disconnect_peer(p->peer);
+  }
+}
+
+// forgets the requests in flight to the instance p runs
+static void drop_requests(struct process* p) {
+  if (p->pid > 0) {
+    release_requests(p->monitor->inflight, p->pid);
+  }
+
+  p->hb_first = 0;
+  p->hb_outstanding = 0;
+  for (size_t i = 0; i < p->num_authorizes; i++) {
+    p->authorizes[i].outstanding = 0;
+  }
+}
+
+static int watch_child(struct process* p) {
+  p->pidfd = open_pidfd(p->pid);
+  if (p->pidfd < 0) {
+    log_perror("pm: could not open pidfd");
+    return -1;
+  }
+
+  p->exit_event = event_new(p->monitor->evloop, p->pidfd, EV_READ, child_exit_handler, (void*) p);
+  if (!p->exit_event || event_add(p->exit_event, NULL)) {
+    log_error("pm: failed to watch %d", p->pid);
+    unwatch_child(p);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void unwatch_child(struct process* p) {
+  if (p->exit_event) {
+    event_free(p->exit_event);
+    p->exit_event = NULL;
+  }
+  if (p->pidfd >= 0) {
+    close(p->pidfd);
+    p->pidfd = -1;
+  }
+}
+
+static void child_exit_handler(int pidfd, short evtype, void* arg) {
+  struct process* p;
+  int status;
+
+  p = (struct process*) arg;
+
+  // the pidfd only becomes readable once the child is a zombie
+  if (waitpid(p->pid, &status, WNOHANG) <= 0) {
+    log_perror("pm: failed to reap child");
   } else {
-    p->seq_num = 0;
-    p->lag = 0;
-    p->pid = new_pid;
-    peer = processes[OTHER_PROCESS(process_entry)];
-    return authorize_peer(fd, peer, old_pid, p->pid);
+    log_exit(p, status);
+  }
+
+  restart_process(p);
+}
+
+// Without pidfds, children are watched through SIGCHLD instead. Signals
+// coalesce, so every process without an exit watch is checked.
+static void sigchld_handler(int signum, short evtype, void* arg) {
+  struct monitor* m;
+
+  m = (struct monitor*) arg;
+  for (size_t i = 0; i < m->num_processes; i++) {
+    reap_unwatched(&m->processes[i]);
+    if (m->processes[i].standby) {
+      reap_unwatched(m->processes[i].standby);
+    }
+  }
+}
+
+static void reap_unwatched(struct process* p) {
+  int status;
+
+  // a pid of 0 would reap any child
+  if (p->pid <= 0 || p->exit_event) {
+    return;
   }
+  if (waitpid(p->pid, &status, WNOHANG) <= 0) {
+    return;
+  }
+  log_exit(p, status);
+  restart_process(p);
+}
 
-  return -1;
+static void log_exit(struct process* p, int status) {
+  if (WIFSIGNALED(status)) {
+    log_info("%s (%d) killed by signal %d", p->spec->name, p->pid, WTERMSIG(status));
+  } else {
+    log_info("%s (%d) exited with %d", p->spec->name, p->pid, WEXITSTATUS(status));
+  }
 }
 
-static int handle_heartbeat(int fd, struct process* p) {
-  struct msghdr* hdr; 
-  struct ucred* ucred_data;
+// starts a new instance of p, which gets the write end of a pipe through
+// READY_FD_ENV and reports on it once its socket is bound
+static int start_process(struct process* p) {
+  int ready_pipe[2];
+  pid_t pid;
+
+  struct timeval ready_timeout = {
+    .tv_sec = READY_TIMEOUT,
+    .tv_usec = 0,
+  };
 
-  if (receive_msg(fd, &hdr) < 0) {
-    perror("pm: error receiving heartbeat");
+  if (pipe2(ready_pipe, O_CLOEXEC) < 0) {
+    log_perror("failed to create ready pipe");
     return -1;
-  } 
+  }
 
-  ucred_data = get_header_credentials(hdr);
-  if (!ucred_data || ucred_data->pid != p->pid) {
-    fprintf(stderr, "pm: empty or invalid credentials\n");
-    free(hdr);
+  pid = p->spawn(p, ready_pipe[1]);
+  close(ready_pipe[1]);
+  if (pid < 0) {
+    close(ready_pipe[0]);
     return -1;
   }
 
+  p->pid = pid;
+  p->ready = 0;
+  p->ready_fd = ready_pipe[0];
+  clock_gettime(CLOCK_MONOTONIC, &p->spawned);
+  if (index_pid(&p->monitor->index, pid, p) < 0) {
+    log_warn("pm: replies from %d will be dropped", pid);
+  }
+
+  p->ready_event = event_new(p->monitor->evloop, p->ready_fd, EV_READ, ready_handler, (void*) p);
+  if (!p->ready_event || event_add(p->ready_event, &ready_timeout)) {
+    log_error("pm: failed to wait for %d to be ready", pid);
+    unwatch_ready(p);
+  }
+
+  // without pidfds, sigchld_handler notices its exit instead
+  if (watch_child(p) < 0) {
+    log_warn("pm: watching %d through SIGCHLD", pid);
+  }
+
   return 0;
 }
 
-int authorize_peer(int fd, struct process* peer, pid_t old_pid, pid_t new_pid) {
-  uint8_t* payload;
-  struct sockaddr_un server;
-  size_t payload_len;
-  struct msghdr* hdr; 
-  struct ucred* ucred_data;
+static void unwatch_ready(struct process* p) {
+  if (p->ready_event) {
+    event_free(p->ready_event);
+    p->ready_event = NULL;
+  }
+  if (p->ready_fd >= 0) {
+    close(p->ready_fd);
+    p->ready_fd = -1;
+  }
+}
+
+static void ready_handler(int ready_fd, short evtype, void* arg) {
+  char buf[32];
+  struct process* p;
+  struct monitor* m;
+  ssize_t n;
+
+  p = (struct process*) arg;
+  m = p->monitor;
+
+  if (evtype & EV_TIMEOUT) {
+    log_warn("pm: %s (%d) not ready after %ds", p->spec->name, p->pid, READY_TIMEOUT);
+    unwatch_ready(p);
+    recover_process(p);
+    return;
+  }
+
+  n = read(ready_fd, buf, sizeof(buf));
+  unwatch_ready(p);
+  if (n <= 0) {
+    // exited before binding, the exit watch or sigchld_handler respawns it
+    log_warn("pm: %s (%d) exited before becoming ready", p->spec->name, p->pid);
+    return;
+  }
+
+  p->ready = 1;
+  log_info("%s%s (%d) ready in %.1fms", p->spec->name, p->is_standby ? " standby" : "",
+           p->pid, elapsed_ms(&p->spawned));
+  connect_process(p);
+
+  // whitelist the current instance of everything p depends on. Later
+  // instances are announced by respawn_process
+  for (size_t i = 0; i < p->num_authorizes; i++) {
+    authorize(&p->authorizes[i], 0, p->authorizes[i].subject->pid);
+  }
+
+  if (p->is_standby) {
+    return;
+  }
+  start_heartbeats(p);
+
+  if (!m->all_ready) {
+    for (size_t i = 0; i < m->num_processes; i++) {
+      if (!m->processes[i].ready) {
+        return;
+      }
+    }
+    m->all_ready = 1;
+    log_info("All %zu processes ready %.1fms after startup", m->num_processes, elapsed_ms(&m->started));
+  }
+}
 
-  struct authorize_process_request r = {
-    .old_pid = old_pid,
-    .new_pid = new_pid,
+static int start_heartbeats(struct process* p) {
+  struct timeval interval = {
+    .tv_sec = p->spec->heartbeat_interval / 1000,
+    .tv_usec = (p->spec->heartbeat_interval % 1000) * 1000,
   };
 
-  payload_len = marshall_authorize_process_request(&r, peer->seq_num, &payload);
-  if (payload_len == 0) {
-    perror("failed to render payload");
+  return event_add(p->hb_timer, &interval);
+}
+
+// hung processes are killed, their exit watch then takes care of the rest.
+// Without one they are reaped here, before sigchld_handler gets to them
+static int recover_process(struct process* p) {
+  int status;
+
+  log_info("Killing %s (%d)", p->spec->name, p->pid);
+  kill(p->pid, SIGKILL);
+
+  if (p->exit_event) {
+    return 0;
+  }
+
+  log_info("Reaping %d", p->pid);
+  waitpid(p->pid, &status, 0);
+
+  return restart_process(p);
+}
+
+static int restart_process(struct process* p) {
+  // nothing depends on a standby, so it is simply replaced
+  if (p->is_standby) {
+    reset_process(p);
+    return start_process(p);
+  }
+
+  return respawn_process(p);
+}
+
+// forgets everything about the instance p used to run
+static void reset_process(struct process* p) {
+  unindex_pid(&p->monitor->index, p->pid);
+  unwatch_child(p);
+  unwatch_ready(p);
+  disconnect_process(p);
+
+  p->seq_num = 0;
+  p->ready = 0;
+  reset_detector(p->detector);
+
+  // whatever the old instance owed us is void
+  event_del(p->hb_timer);
+  drop_requests(p);
+}
+
+static int respawn_process(struct process* p) {
+  struct process* authorizer;
+  size_t edge;
+  pid_t old_pid;
+
+  old_pid = p->pid;
+  reset_process(p);
+
+  if (!(p->standby && p->standby->ready && promote_standby(p) == 0) && start_process(p) < 0) {
     return -1;
   }
-  peer->seq_num++;
 
-  if (resolve_address(peer->addr, &server) < 0) {
-    perror("could not resolve destination address");
+  // everything that whitelists p can accept the new instance right away,
+  // while a fresh instance authorizes what it depends on once it is ready
+  for (size_t i = 0; i < p->num_authorized_by; i++) {
+    authorizer = p->authorized_by[i]->authorizer;
+    edge = p->authorized_by[i] - authorizer->authorizes;
+
+    if (authorizer->ready) {
+      authorize(p->authorized_by[i], old_pid, p->pid);
+    }
+    if (authorizer->standby && authorizer->standby->ready) {
+      authorize(&authorizer->standby->authorizes[edge], old_pid, p->pid);
+    }
+  }
+
+  return 0;
+}
+
+// Moves the standby's sockets over the active paths, which atomically
+// redirects all traffic to it, and hands its instance over to p. The
+// standby already authorized what it depends on when it became ready, so
+// the failover only costs the authorizers' swap of the new pid.
+static int promote_standby(struct process* p) {
+  char standby_path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+  char active_path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+  struct process* standby;
+  size_t reactors;
+
+  standby = p->standby;
+  reactors = p->spec->reactors;
+
+  for (size_t i = 0; i < reactors; i++) {
+    if (shard_path(standby->bind_addr, i, reactors, standby_path, sizeof(standby_path)) < 0 ||
+        shard_path(p->bind_addr, i, reactors, active_path, sizeof(active_path)) < 0) {
+      return -1;
+    }
+    if (rename(standby_path, active_path) < 0) {
+      log_perror("pm: failed to promote standby");
+      return -1;
+    }
+  }
+  if (rename(standby->addr, p->addr) < 0) {
+    log_perror("pm: failed to promote standby");
     return -1;
   }
 
-  if (connect_to_destination(fd, &server) < 0) {
-    perror("could not connect to destination");
+  p->pid = standby->pid;
+  p->seq_num = standby->seq_num;
+  p->spawned = standby->spawned;
+  p->ready = 1;
+
+  // authorizations the standby is still waiting on are answered to p
+  for (size_t i = 0; i < p->num_authorizes; i++) {
+    struct authorization* auth = &standby->authorizes[i];
+    struct inflight_request* req;
+
+    if (!auth->outstanding) {
+      continue;
+    }
+    req = find_request(p->monitor->inflight, p->pid, auth->seq);
+    if (req) {
+      req->owner = &p->authorizes[i];
+    }
+    p->authorizes[i].req = auth->req;
+    p->authorizes[i].seq = auth->seq;
+    p->authorizes[i].retries = auth->retries;
+    p->authorizes[i].outstanding = 1;
+    auth->outstanding = 0;
+  }
+
+  // the exit watch moves over with the instance, whose requests now belong to p
+  p->pidfd = standby->pidfd;
+  standby->pidfd = -1;
+
+  // the connection is to the socket, not its path, so it survived the rename
+  if (standby->peer->fd >= 0) {
+    p->peer->fd = standby->peer->fd;
+    p->peer->has_credentials = standby->peer->has_credentials;
+    p->peer->pid = standby->peer->pid;
+    p->peer->uid = standby->peer->uid;
+    p->peer->gid = standby->peer->gid;
+    standby->peer->fd = -1;
+    disconnect_process(standby);
+    watch_connection(p);
+  }
+  standby->pid = 0;
+  reset_process(standby);
+  if (p->pidfd >= 0) {
+    p->exit_event = event_new(p->monitor->evloop, p->pidfd, EV_READ, child_exit_handler, (void*) p);
+    if (!p->exit_event || event_add(p->exit_event, NULL)) {
+      log_error("pm: failed to watch %d", p->pid);
+    }
+  }
+  if (index_pid(&p->monitor->index, p->pid, p) < 0) {
+    log_warn("pm: replies from %d will be dropped", p->pid);
+  }
+  start_heartbeats(p);
+
+  log_info("Promoted standby %d in %.1fms since it was spawned", p->pid, elapsed_ms(&p->spawned));
+
+  // the old instance's place is taken by the next standby
+  start_process(standby);
+  return 0;
+}
+
+int authorize(struct authorization* auth, pid_t old_pid, pid_t new_pid) {
+  auth->req.old_pid = old_pid;
+  auth->req.new_pid = new_pid;
+  auth->retries = 0;
+
+  return send_authorization(auth);
+}
+
+static int send_authorization(struct authorization* auth) {
+  uint8_t payload[MAX_MSG_SIZE];
+  size_t payload_len;
+  struct inflight_request* req;
+  struct process* authorizer;
+  struct monitor* m;
+
+  authorizer = auth->authorizer;
+  m = authorizer->monitor;
+
+  // only the latest request counts, so a late answer to an earlier one is stale
+  if (auth->outstanding) {
+    req = find_request(m->inflight, authorizer->pid, auth->seq);
+    if (req) {
+      release_request(m->inflight, req);
+    }
+    auth->outstanding = 0;
+  }
+
+  payload_len = marshall_authorize_process_request_into(&auth->req, authorizer->seq_num, payload, sizeof(payload));
+  if (payload_len == 0) {
+    log_perror("failed to render payload");
     return -1;
   }
-  
-  if (send_msg(fd, payload, payload_len) < 0) {
-    perror("message failed");
+
+  req = track_request(m->inflight, authorizer->pid, authorizer->seq_num, REQUEST_AUTHORIZE, auth, AUTHORIZE_TIMEOUT);
+  if (!req) {
+    log_warn("pm: too many requests in flight, can't authorize %d", auth->req.new_pid);
     return -1;
   }
 
- if (receive_msg(fd, &hdr) < 0) {
-    perror("pm: error receiving heartbeat");
+  if (queue_request(m, authorizer, payload, payload_len) < 0) {
+    release_request(m->inflight, req);
     return -1;
-  } 
+  }
+
+  auth->seq = authorizer->seq_num++;
+  auth->outstanding = 1;
+  arm_deadlines(m);
 
-  ucred_data = get_header_credentials(hdr);
+  return 0;
+}
 
-  if (!ucred_data || ucred_data->pid != peer->pid) {
-    fprintf(stderr, "empty or invalid credentials\n");
-    free(hdr);
+static double elapsed_ms(struct timespec* since) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+// sized so that capacity pids fill at most half the slots
+static int init_pid_index(struct pid_index* index, size_t capacity) {
+  size_t num_slots;
+
+  num_slots = MIN_INDEX_SLOTS;
+  while (num_slots < 2 * capacity) {
+    num_slots <<= 1;
+  }
+
+  index->slots = calloc(num_slots, sizeof(struct pid_slot));
+  if (!index->slots) {
     return -1;
   }
+  index->mask = num_slots - 1;
+  index->len = 0;
 
-  free(hdr);
   return 0;
 }
 
-static void spawn_server() {
+// Fibonacci hashing, pids are mostly sequential
+static size_t pid_home(struct pid_index* index, pid_t pid) {
+  return ((uint32_t) pid * 2654435769u) & index->mask;
+}
+
+static int index_pid(struct pid_index* index, pid_t pid, struct process* p) {
+  struct pid_index grown;
+  size_t i;
+
+  if (2 * (index->len + 1) > index->mask + 1) {
+    if (init_pid_index(&grown, index->len + 1) < 0) {
+      return -1;
+    }
+    for (i = 0; i <= index->mask; i++) {
+      if (index->slots[i].pid != 0) {
+        index_pid(&grown, index->slots[i].pid, index->slots[i].process);
+      }
+    }
+    free(index->slots);
+    *index = grown;
+  }
+
+  for (i = pid_home(index, pid); index->slots[i].pid != 0; i = (i + 1) & index->mask) {
+    if (index->slots[i].pid == pid) {
+      index->slots[i].process = p;
+      return 0;
+    }
+  }
+  index->slots[i].pid = pid;
+  index->slots[i].process = p;
+  index->len++;
+
+  return 0;
+}
+
+static void unindex_pid(struct pid_index* index, pid_t pid) {
+  size_t hole, i;
+
+  if (pid == 0) {
+    return;
+  }
+
+  for (hole = pid_home(index, pid); index->slots[hole].pid != pid; hole = (hole + 1) & index->mask) {
+    if (index->slots[hole].pid == 0) {
+      return;
+    }
+  }
+
+  // pull back every later entry of the run that may not probe past the
+  // hole, so lookups never stop early without tombstones
+  for (i = (hole + 1) & index->mask; index->slots[i].pid != 0; i = (i + 1) & index->mask) {
+    if (((i - pid_home(index, index->slots[i].pid)) & index->mask) >= ((i - hole) & index->mask)) {
+      index->slots[hole] = index->slots[i];
+      hole = i;
+    }
+  }
+  index->slots[hole].pid = 0;
+  index->slots[hole].process = NULL;
+  index->len--;
+}
+
+static struct process* lookup_pid(struct pid_index* index, pid_t pid) {
+  for (size_t i = pid_home(index, pid); index->slots[i].pid != 0; i = (i + 1) & index->mask) {
+    if (index->slots[i].pid == pid) {
+      return index->slots[i].process;
+    }
+  }
+  return NULL;
+}
+
+static pid_t spawn_server(struct process* p, int ready_fd) {
   struct server_state* s;
+  char fd_str[16];
+  pid_t pid;
 
-  s = new_server(SERVER_ADDR);
+  struct server_config config = {
+    .addr = p->bind_addr,
+    .access_capacity = DEFAULT_ACCESS_CAPACITY,
+    .access_backend = ACCESS_BACKEND_BITMAP,
+    .num_reactors = p->spec->reactors,
+    .num_workers = p->spec->workers,
+    .fds = p->listen_fds,
+    .transport = p->spec->transport,
+    .io_engine = p->spec->io_uring ? IO_ENGINE_URING : IO_ENGINE_LIBEVENT,
+    .control_addr = p->addr,
+  };
+
+  pid = fork();
+  if (pid != 0) {
+    if (pid < 0) {
+      log_perror("failed to fork server");
+    }
+    return pid;
+  }
+
+  snprintf(fd_str, sizeof(fd_str), "%d", ready_fd);
+  setenv(READY_FD_ENV, fd_str, 1);
+
+  s = new_server(&config);
   if (!s) {
-    perror("failed to create server instance");
-    return;
+    log_perror("failed to create server instance");
+    exit(EXIT_FAILURE);
   }
 
-  start_server(s);
+  exit(start_server(s) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
-static void spawn_proxy() {
+// Binds the sockets of p on its behalf. They survive the processes serving
+// them, so a replacement reads on from the same kernel queue without the
+// path ever disappearing.
+static int bind_listen_fds(struct process* p, size_t num_fds) {
+  char path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+
+  p->listen_fds = malloc(num_fds * sizeof(int));
+  if (!p->listen_fds) {
+    return -1;
+  }
+
+  for (p->num_listen_fds = 0; p->num_listen_fds < num_fds; p->num_listen_fds++) {
+    int fd;
+
+    if (shard_path(p->bind_addr, p->num_listen_fds, num_fds, path, sizeof(path)) < 0) {
+      return -1;
+    }
+
+    if (p->spec->transport == TRANSPORT_SEQPACKET) {
+      // connections queue up in its backlog instead
+      fd = setup_seqpacket_listener(path);
+    } else {
+      fd = setup_datagram_socket(path);
+    }
+    if (fd < 0) {
+      log_perror("failed to bind socket for handoff");
+      return -1;
+    }
+    // handed over explicitly, never leaked into other children's execs
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    p->listen_fds[p->num_listen_fds] = fd;
+  }
+
+  return 0;
+}
+
+static uint8_t is_env_var(const char* var, const char* name) {
+  size_t len = strlen(name);
+  return strncmp(var, name, len) == 0 && var[len] == '=';
+}
+
+// Executables are spawned without copying the daemon's address space:
+// glibc's posix_spawn runs the child on a vfork-style clone until it execs.
+static pid_t spawn_exec(struct process* p, int ready_fd) {
+  posix_spawn_file_actions_t actions;
+  char ready_env[32];
+  char listen_env[32];
+  char** env;
   char* args[2];
-  
-  args[0] = PROXY_BIN; // first argument is name of the program, by convention
-  // null-terminate list of arguments as per execvp man
+  size_t env_len;
+  pid_t pid;
+  int err;
+
+  args[0] = p->spec->binary; // first argument is name of the program, by convention
+  // null-terminate list of arguments as per execve man
   args[1] = NULL;
 
-  execvp(PROXY_BIN, args); 
+  // our environment plus where to report readiness. Ours may carry these
+  // variables already, e.g. if the daemon was itself spawned by one, and
+  // getenv in the child would find those first
+  env_len = 0;
+  while (environ[env_len]) {
+    env_len++;
+  }
+  env = malloc((env_len + 3) * sizeof(char*));
+  if (!env) {
+    return -1;
+  }
+  env_len = 0;
+  for (char** var = environ; *var; var++) {
+    if (is_env_var(*var, READY_FD_ENV) || is_env_var(*var, LISTEN_FD_ENV)) {
+      continue;
+    }
+    env[env_len++] = *var;
+  }
+  snprintf(ready_env, sizeof(ready_env), "%s=%d", READY_FD_ENV, ready_fd);
+  env[env_len++] = ready_env;
+
+  posix_spawn_file_actions_init(&actions);
+  // dup2 onto itself clears close-on-exec, so the child inherits it
+  posix_spawn_file_actions_adddup2(&actions, ready_fd, ready_fd);
+
+  if (p->num_listen_fds > 0) {
+    snprintf(listen_env, sizeof(listen_env), "%s=%d", LISTEN_FD_ENV, p->listen_fds[0]);
+    env[env_len++] = listen_env;
+    posix_spawn_file_actions_adddup2(&actions, p->listen_fds[0], p->listen_fds[0]);
+  }
+  env[env_len] = NULL;
+
+  err = posix_spawn(&pid, p->spec->binary, &actions, NULL, args, env);
+  posix_spawn_file_actions_destroy(&actions);
+  free(env);
+
+  if (err) {
+    errno = err;
+    log_perror("failed to spawn %s", p->spec->name);
+    return -1;
+  }
+
+  return pid;
 }
@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "detector.h"
+
+#define MAX_PHI 1e6 // reported once the tail probability underflows
+
+struct failure_detector {
+  struct detector_config config;
+
+  // ring of the last config.window rtts, oldest at next once full
+  double* samples;
+  size_t len;
+  size_t next;
+};
+
+static void mean_std_dev(struct failure_detector* detector, double* mean, double* std_dev);
+static int compare_doubles(const void* a, const void* b);
+static double percentile(double* sorted, size_t len, double p);
+
+struct failure_detector* new_failure_detector(struct detector_config* config) {
+  struct failure_detector* detector;
+
+  if (config->window == 0) {
+    return NULL;
+  }
+
+  detector = malloc(sizeof(struct failure_detector));
+  if (!detector) {
+    return NULL;
+  }
+  detector->config = *config;
+
+  detector->samples = malloc(config->window * sizeof(double));
+  if (!detector->samples) {
+    free(detector);
+    return NULL;
+  }
+  reset_detector(detector);
+
+  return detector;
+}
+
+void free_failure_detector(struct failure_detector* detector) {
+  free(detector->samples);
+  free(detector);
+}
+
+void record_rtt(struct failure_detector* detector, double rtt) {
+  detector->samples[detector->next] = rtt;
+  detector->next = (detector->next + 1) % detector->config.window;
+  if (detector->len < detector->config.window) {
+    detector->len++;
+  }
+}
+
+void reset_detector(struct failure_detector* detector) {
+  detector->len = 0;
+  detector->next = 0;
+}
+
+double suspicion(struct failure_detector* detector, double elapsed) {
+  double mean, std_dev, tail;
+
+  mean_std_dev(detector, &mean, &std_dev);
+  mean += detector->config.acceptable_pause;
+
+  // P(rtt > elapsed) for a normal distribution
+  tail = 0.5 * erfc((elapsed - mean) / (std_dev * M_SQRT2));
+  if (tail <= 0) {
+    return MAX_PHI;
+  }
+
+  return -log10(tail);
+}
+
+int is_suspected(struct failure_detector* detector, double elapsed) {
+  return suspicion(detector, elapsed) > detector->config.threshold;
+}
+
+void get_detector_stats(struct failure_detector* detector, struct detector_stats* stats) {
+  double sorted[detector->len > 0 ? detector->len : 1];
+
+  memset(stats, 0, sizeof(struct detector_stats));
+  stats->samples = detector->len;
+  if (detector->len == 0) {
+    return;
+  }
+
+  mean_std_dev(detector, &stats->mean, &stats->std_dev);
+
+  memcpy(sorted, detector->samples, detector->len * sizeof(double));
+  qsort(sorted, detector->len, sizeof(double), compare_doubles);
+  stats->min = sorted[0];
+  stats->p50 = percentile(sorted, detector->len, 0.50);
+  stats->p90 = percentile(sorted, detector->len, 0.90);
+  stats->p99 = percentile(sorted, detector->len, 0.99);
+  stats->max = sorted[detector->len - 1];
+}
+
+/**
+ * mean_std_dev: estimates the rtt distribution from the window, falling
+ * back to the configured initial rtt until there is a sample
+ *
+ * @detector: detector of the process
+ * @mean: return parameter, in ms
+ * @std_dev: return parameter, in ms, never below config.min_std_dev
+**/
+static void mean_std_dev(struct failure_detector* detector, double* mean, double* std_dev) {
+  double sum, sq_sum, var;
+
+  if (detector->len == 0) {
+    *mean = detector->config.initial_rtt;
+    *std_dev = fmax(detector->config.initial_rtt / 4, detector->config.min_std_dev);
+    return;
+  }
+
+  sum = 0;
+  for (size_t i = 0; i < detector->len; i++) {
+    sum += detector->samples[i];
+  }
+  *mean = sum / detector->len;
+
+  sq_sum = 0;
+  for (size_t i = 0; i < detector->len; i++) {
+    double d = detector->samples[i] - *mean;
+    sq_sum += d * d;
+  }
+  var = sq_sum / detector->len;
+
+  *std_dev = fmax(sqrt(var), detector->config.min_std_dev);
+}
+
+static int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*) a;
+  double y = *(const double*) b;
+
+  return (x > y) - (x < y);
+}
+
+// nearest-rank percentile of a sorted, non-empty array
+static double percentile(double* sorted, size_t len, double p) {
+  size_t rank = (size_t) ceil(p * len);
+
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
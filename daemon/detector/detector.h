@@ -0,0 +1,99 @@
+#ifndef DETECTOR_H
+#define DETECTOR_H
+
+#include <stddef.h>
+
+// The failure detector decides when a process that hasn't answered a
+// heartbeat should be considered dead. Instead of a fixed timeout it keeps
+// a sliding window of the process' heartbeat round-trip times and turns
+// the time a heartbeat has been outstanding into a suspicion level phi
+// (phi-accrual): phi = -log10(P(rtt > elapsed)), assuming rtts are normally
+// distributed. A phi of 1 means a 10% chance that the reply is still
+// coming, 2 means 1%, 3 means 0.1% and so on, so the threshold directly
+// trades detection latency for false positives, and a process that gets
+// slower under load raises its own bar.
+
+#define DEFAULT_DETECTOR_WINDOW 100
+#define DEFAULT_PHI_THRESHOLD 8.0
+
+struct failure_detector;
+
+struct detector_config {
+  size_t window; // number of rtt samples kept
+  double threshold; // phi above which a process is suspected
+  double initial_rtt; // ms, rtt assumed until the first sample arrives
+  double min_std_dev; // ms, floor so a very steady process isn't suspected on jitter
+  double acceptable_pause; // ms, added to the mean to tolerate short stalls
+};
+
+struct detector_stats {
+  size_t samples;
+  double mean;
+  double std_dev;
+  double min;
+  double p50;
+  double p90;
+  double p99;
+  double max;
+};
+
+/**
+ * new_failure_detector: instantiate a detector for one process
+ *
+ * @config: detector configuration, copied
+ *
+ * @returns a new detector or NULL on error. Caller must free after use
+ * by calling free_failure_detector.
+**/
+struct failure_detector* new_failure_detector(struct detector_config* config);
+
+/**
+ * free_failure_detector: free resources used by the detector
+ *
+ * @detector: detector to free
+**/
+void free_failure_detector(struct failure_detector* detector);
+
+/**
+ * record_rtt: adds a heartbeat round-trip time to the window, evicting
+ * the oldest sample once the window is full
+ *
+ * @detector: detector of the process that answered
+ * @rtt: round-trip time in ms
+**/
+void record_rtt(struct failure_detector* detector, double rtt);
+
+/**
+ * reset_detector: forgets all samples, e.g. once the process is replaced
+ *
+ * @detector: detector to reset
+**/
+void reset_detector(struct failure_detector* detector);
+
+/**
+ * suspicion: computes phi for a heartbeat outstanding for elapsed ms
+ *
+ * @detector: detector of the process
+ * @elapsed: time since the heartbeat was sent, in ms
+ *
+ * @returns phi, which grows without bound as elapsed does
+**/
+double suspicion(struct failure_detector* detector, double elapsed);
+
+/**
+ * is_suspected: whether a heartbeat outstanding for elapsed ms crosses
+ * the detector's threshold
+ *
+ * @returns 1 if the process should be considered dead, 0 otherwise
+**/
+int is_suspected(struct failure_detector* detector, double elapsed);
+
+/**
+ * get_detector_stats: summarizes the rtt distribution in the window
+ *
+ * @detector: detector of the process
+ * @stats: return parameter
+**/
+void get_detector_stats(struct failure_detector* detector, struct detector_stats* stats);
+
+#endif // DETECTOR_H
@@ -0,0 +1,307 @@
+#include <stdlib.h>
+
+#include "inflight.h"
+
+#define NO_SLOT 0 // slots hold request index + 1
+
+// Requests live in a fixed pool so their addresses stay put. An open
+// addressing table maps (pid, seq) to them, and a binary min-heap orders
+// them by deadline.
+struct inflight_table {
+  struct inflight_request* requests;
+  size_t* free_list; // stack of unused request indexes
+  size_t num_free;
+  size_t capacity;
+
+  size_t* slots;
+  size_t mask;
+
+  size_t* heap; // request indexes
+  size_t len;
+};
+
+static size_t request_home(struct inflight_table* table, pid_t pid, uint64_t seq);
+static size_t* find_slot(struct inflight_table* table, pid_t pid, uint64_t seq);
+static void unlink_slot(struct inflight_table* table, size_t* slot);
+static int before(struct timespec* a, struct timespec* b);
+static void heap_swap(struct inflight_table* table, size_t i, size_t j);
+static void sift_up(struct inflight_table* table, size_t pos);
+static void sift_down(struct inflight_table* table, size_t pos);
+static void set_deadline(struct timespec* deadline, struct timespec* from, unsigned int timeout_ms);
+
+struct inflight_table* new_inflight_table(size_t capacity) {
+  struct inflight_table* table;
+  size_t num_slots;
+
+  if (capacity == 0) {
+    return NULL;
+  }
+
+  table = calloc(1, sizeof(struct inflight_table));
+  if (!table) {
+    return NULL;
+  }
+
+  // at most half full, so probe runs stay short
+  num_slots = 1;
+  while (num_slots < 2 * capacity) {
+    num_slots <<= 1;
+  }
+
+  table->requests = calloc(capacity, sizeof(struct inflight_request));
+  table->free_list = malloc(capacity * sizeof(size_t));
+  table->slots = calloc(num_slots, sizeof(size_t));
+  table->heap = malloc(capacity * sizeof(size_t));
+  if (!table->requests || !table->free_list || !table->slots || !table->heap) {
+    free_inflight_table(table);
+    return NULL;
+  }
+  table->capacity = capacity;
+  table->mask = num_slots - 1;
+
+  for (size_t i = 0; i < capacity; i++) {
+    table->free_list[i] = capacity - 1 - i;
+  }
+  table->num_free = capacity;
+
+  return table;
+}
+
+void free_inflight_table(struct inflight_table* table) {
+  free(table->requests);
+  free(table->free_list);
+  free(table->slots);
+  free(table->heap);
+  free(table);
+}
+
+struct inflight_request* track_request(struct inflight_table* table, pid_t pid, uint64_t seq,
+                                       int type, void* owner, unsigned int timeout_ms) {
+  struct inflight_request* request;
+  size_t* slot;
+  size_t index;
+
+  if (table->num_free == 0) {
+    return NULL;
+  }
+
+  slot = find_slot(table, pid, seq);
+  if (*slot != NO_SLOT) {
+    return NULL;
+  }
+
+  index = table->free_list[--table->num_free];
+  *slot = index + 1;
+
+  request = &table->requests[index];
+  request->pid = pid;
+  request->seq = seq;
+  request->type = type;
+  request->owner = owner;
+  clock_gettime(CLOCK_MONOTONIC, &request->sent);
+  set_deadline(&request->deadline, &request->sent, timeout_ms);
+
+  request->heap_pos = table->len;
+  table->heap[table->len++] = index;
+  sift_up(table, request->heap_pos);
+
+  return request;
+}
+
+struct inflight_request* find_request(struct inflight_table* table, pid_t pid, uint64_t seq) {
+  size_t* slot;
+
+  slot = find_slot(table, pid, seq);
+  if (*slot == NO_SLOT) {
+    return NULL;
+  }
+  return &table->requests[*slot - 1];
+}
+
+void release_request(struct inflight_table* table, struct inflight_request* request) {
+  size_t index, pos, moved;
+
+  index = request - table->requests;
+  unlink_slot(table, find_slot(table, request->pid, request->seq));
+
+  // the last leaf takes its place, then goes wherever it belongs
+  pos = request->heap_pos;
+  heap_swap(table, pos, --table->len);
+  if (pos < table->len) {
+    moved = table->heap[pos];
+    sift_up(table, pos);
+    sift_down(table, table->requests[moved].heap_pos);
+  }
+
+  table->free_list[table->num_free++] = index;
+}
+
+size_t release_requests(struct inflight_table* table, pid_t pid) {
+  size_t released;
+
+  // only done when a process goes away, walking the pool is fine
+  released = 0;
+  for (size_t i = 0; i < table->capacity; i++) {
+    struct inflight_request* request = &table->requests[i];
+
+    if (request->heap_pos < table->len && table->heap[request->heap_pos] == i && request->pid == pid) {
+      release_request(table, request);
+      released++;
+    }
+  }
+
+  return released;
+}
+
+void postpone_request(struct inflight_table* table, struct inflight_request* request, unsigned int timeout_ms) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  set_deadline(&request->deadline, &now, timeout_ms);
+  sift_up(table, request->heap_pos);
+  sift_down(table, request->heap_pos);
+}
+
+struct inflight_request* next_expired(struct inflight_table* table) {
+  struct inflight_request* request;
+  struct timespec now;
+
+  if (table->len == 0) {
+    return NULL;
+  }
+
+  request = &table->requests[table->heap[0]];
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (before(&now, &request->deadline)) {
+    return NULL;
+  }
+  return request;
+}
+
+int next_deadline(struct inflight_table* table, struct timeval* timeout) {
+  struct inflight_request* request;
+  struct timespec now;
+  long long ns;
+
+  if (table->len == 0) {
+    return -1;
+  }
+
+  request = &table->requests[table->heap[0]];
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ns = (request->deadline.tv_sec - now.tv_sec) * 1000000000LL + (request->deadline.tv_nsec - now.tv_nsec);
+  if (ns < 0) {
+    ns = 0;
+  }
+
+  // rounded up, so the deadline has passed once the timer fires
+  timeout->tv_sec = ns / 1000000000LL;
+  timeout->tv_usec = (ns % 1000000000LL + 999) / 1000;
+  if (timeout->tv_usec == 1000000) {
+    timeout->tv_sec++;
+    timeout->tv_usec = 0;
+  }
+  return 0;
+}
+
+size_t inflight_len(struct inflight_table* table) {
+  return table->len;
+}
+
+static size_t request_home(struct inflight_table* table, pid_t pid, uint64_t seq) {
+  uint64_t h;
+
+  h = ((uint64_t) (uint32_t) pid << 32 | (uint32_t) seq) ^ (seq >> 32);
+  h *= 0x9e3779b97f4a7c15ULL;
+  return (h >> 32) & table->mask;
+}
+
+// the slot holding (pid, seq), or the free slot where it would go
+static size_t* find_slot(struct inflight_table* table, pid_t pid, uint64_t seq) {
+  size_t i;
+
+  for (i = request_home(table, pid, seq); table->slots[i] != NO_SLOT; i = (i + 1) & table->mask) {
+    struct inflight_request* request = &table->requests[table->slots[i] - 1];
+
+    if (request->pid == pid && request->seq == seq) {
+      break;
+    }
+  }
+  return &table->slots[i];
+}
+
+// backward shift deletion, so lookups never need tombstones
+static void unlink_slot(struct inflight_table* table, size_t* slot) {
+  size_t hole, i, home;
+
+  hole = slot - table->slots;
+  for (i = (hole + 1) & table->mask; table->slots[i] != NO_SLOT; i = (i + 1) & table->mask) {
+    struct inflight_request* request = &table->requests[table->slots[i] - 1];
+
+    home = request_home(table, request->pid, request->seq);
+    if (((i - home) & table->mask) >= ((i - hole) & table->mask)) {
+      table->slots[hole] = table->slots[i];
+      hole = i;
+    }
+  }
+  table->slots[hole] = NO_SLOT;
+}
+
+static int before(struct timespec* a, struct timespec* b) {
+  return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void heap_swap(struct inflight_table* table, size_t i, size_t j) {
+  size_t tmp;
+
+  tmp = table->heap[i];
+  table->heap[i] = table->heap[j];
+  table->heap[j] = tmp;
+  table->requests[table->heap[i]].heap_pos = i;
+  table->requests[table->heap[j]].heap_pos = j;
+}
+
+static void sift_up(struct inflight_table* table, size_t pos) {
+  while (pos > 0) {
+    size_t parent = (pos - 1) / 2;
+
+    if (!before(&table->requests[table->heap[pos]].deadline, &table->requests[table->heap[parent]].deadline)) {
+      break;
+    }
+    heap_swap(table, pos, parent);
+    pos = parent;
+  }
+}
+
+static void sift_down(struct inflight_table* table, size_t pos) {
+  for (;;) {
+    size_t child = 2 * pos + 1;
+    size_t smallest = pos;
+
+    if (child >= table->len) {
+      break;
+    }
+    if (before(&table->requests[table->heap[child]].deadline, &table->requests[table->heap[smallest]].deadline)) {
+      smallest = child;
+    }
+    if (child + 1 < table->len &&
+        before(&table->requests[table->heap[child + 1]].deadline, &table->requests[table->heap[smallest]].deadline)) {
+      smallest = child + 1;
+    }
+    if (smallest == pos) {
+      break;
+    }
+    heap_swap(table, pos, smallest);
+    pos = smallest;
+  }
+}
+
+static void set_deadline(struct timespec* deadline, struct timespec* from, unsigned int timeout_ms) {
+  *deadline = *from;
+  deadline->tv_sec += timeout_ms / 1000;
+  deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (deadline->tv_nsec >= 1000000000L) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000L;
+  }
+}
@@ -0,0 +1,134 @@
+#ifndef INFLIGHT_H
+#define INFLIGHT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+// The in-flight table tracks every request the monitor is waiting on,
+// keyed by the pid it was sent to and its seq_num, so a reply is matched
+// to exactly the request it answers no matter how many are outstanding or
+// in which order they come back. A reply that matches nothing answers a
+// request that was already given up on, and can be dropped. Each request
+// also has a deadline, and the table hands back the expired ones earliest
+// first, so one timer serves all of them.
+
+struct inflight_table;
+
+struct inflight_request {
+  pid_t pid;
+  uint64_t seq;
+  int type; // what was asked, up to the caller
+  void* owner; // whatever the caller needs to act on the answer
+
+  struct timespec sent;
+  struct timespec deadline;
+
+  size_t heap_pos; // internal, position in the deadline heap
+};
+
+/**
+ * new_inflight_table: instantiate a table
+ *
+ * @capacity: maximum number of requests in flight at once
+ *
+ * @returns a new table or NULL on error. Caller must free after use by
+ * calling free_inflight_table.
+**/
+struct inflight_table* new_inflight_table(size_t capacity);
+
+/**
+ * free_inflight_table: frees resources used by the table
+ *
+ * @table: table to free
+**/
+void free_inflight_table(struct inflight_table* table);
+
+/**
+ * track_request: records a request about to be sent
+ *
+ * @table: table to add to
+ * @pid: process the request is sent to
+ * @seq: seq_num of the request
+ * @type: kind of request, stored as is
+ * @owner: stored as is
+ * @timeout_ms: time the request has to be answered
+ *
+ * @returns the tracked request, valid until released, or NULL if the table
+ * is full or (pid, seq) is already in flight
+**/
+struct inflight_request* track_request(struct inflight_table* table, pid_t pid, uint64_t seq,
+                                       int type, void* owner, unsigned int timeout_ms);
+
+/**
+ * find_request: looks up the request a reply answers
+ *
+ * @table: table to search
+ * @pid: process that replied, from its credentials
+ * @seq: seq_num of the reply
+ *
+ * @returns the request or NULL if it isn't (or no longer) in flight
+**/
+struct inflight_request* find_request(struct inflight_table* table, pid_t pid, uint64_t seq);
+
+/**
+ * release_request: stops tracking a request, answered or not
+ *
+ * @table: table the request is in
+ * @request: request to release, invalid afterwards
+**/
+void release_request(struct inflight_table* table, struct inflight_request* request);
+
+/**
+ * release_requests: stops tracking every request sent to a process, e.g.
+ * once it is gone
+ *
+ * @table: table to release from
+ * @pid: process whose requests are released
+ *
+ * @returns number of requests released
+**/
+size_t release_requests(struct inflight_table* table, pid_t pid);
+
+/**
+ * postpone_request: moves the deadline of a request
+ *
+ * @table: table the request is in
+ * @request: request to postpone
+ * @timeout_ms: new deadline, counted from now
+**/
+void postpone_request(struct inflight_table* table, struct inflight_request* request, unsigned int timeout_ms);
+
+/**
+ * next_expired: finds the request whose deadline passed first. It stays
+ * in the table, so the caller must release or postpone it before asking
+ * for the next one
+ *
+ * @table: table to search
+ *
+ * @returns the request or NULL if no deadline has passed
+**/
+struct inflight_request* next_expired(struct inflight_table* table);
+
+/**
+ * next_deadline: computes how long until the earliest deadline
+ *
+ * @table: table to search
+ * @timeout: set to the time left, zero if it already passed
+ *
+ * @returns 0, or -1 if nothing is in flight
+**/
+int next_deadline(struct inflight_table* table, struct timeval* timeout);
+
+/**
+ * inflight_len: number of requests in flight
+ *
+ * @table: table to count
+ *
+ * @returns the number of requests
+**/
+size_t inflight_len(struct inflight_table* table);
+
+#endif // INFLIGHT_H
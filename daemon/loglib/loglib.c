@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "commslib/commslib.h"
+#include "loglib.h"
+
+#define LOG_OUT_SIZE 65536 // bytes written to fd at a time
+#define LOG_PREFIX_MAX 64 // time, level and pid before the message
+
+struct log_record {
+  uint64_t ns; // wall clock
+  uint8_t level;
+  uint16_t len;
+  char text[LOG_LINE_MAX];
+};
+
+// A ring with a single producer, the thread it belongs to, and a single
+// consumer, whoever holds the drain lock. Rings are never freed, a thread
+// that exits hands its ring over to the next thread that starts logging.
+struct log_ring {
+  // written by the producer
+  uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+  uint32_t dropped; // records that found the ring full
+
+  // written by the consumer
+  uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+
+  uint32_t in_use; // owned by a live thread
+  struct log_ring* next;
+
+  struct log_record records[LOG_RING_SLOTS];
+};
+
+struct logger {
+  struct log_ring* rings; // pushed onto, never removed from
+  pthread_key_t owner; // releases a thread's ring when it exits
+
+  // held by whoever consumes the rings, the flusher or the process exiting,
+  // and by fork. Never held across a write, which may block for good
+  pthread_mutex_t drain;
+  pthread_t flusher;
+  uint8_t running; // records go to the rings rather than straight to fd
+  uint8_t stopping;
+  uint8_t registered; // fork and exit handlers
+  int wake_fd;
+  uint32_t signalled; // a wake_fd write is pending
+  int fd;
+  pid_t pid;
+
+  char out[LOG_OUT_SIZE]; // only touched by whoever consumes the rings
+  size_t out_len;
+};
+
+enum log_level log_threshold = LOG_LEVEL_INFO;
+
+static struct logger logger = {
+  .drain = PTHREAD_MUTEX_INITIALIZER,
+  .wake_fd = -1,
+  .fd = STDERR_FILENO,
+};
+
+static __thread struct log_ring* thread_ring;
+
+static const char* level_names[] = {"debug", "info", "warn", "error"};
+
+static uint64_t now_ns();
+static uint8_t admit(struct log_site* site);
+static size_t append(char* text, size_t len, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+static struct log_ring* claim_ring();
+static void release_ring(void* arg);
+static int start_flusher();
+static void* run_flusher(void* arg);
+static void flush_rings();
+static uint8_t drain_rings();
+static size_t format_line(char* line, size_t cap, uint64_t ns, uint8_t level, const char* text, size_t len);
+static void write_out(const char* buf, size_t len);
+static void stop_flusher();
+static void before_fork();
+static void after_fork_parent();
+static void after_fork_child();
+
+int log_start(enum log_level level, int fd) {
+  log_threshold = level;
+  if (__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  logger.fd = fd;
+  logger.pid = getpid();
+
+  if (!logger.registered) {
+    if (pthread_key_create(&logger.owner, release_ring) ||
+        pthread_atfork(before_fork, after_fork_parent, after_fork_child) ||
+        atexit(stop_flusher)) {
+      log_error("could not set up logging");
+      return -1;
+    }
+    logger.registered = 1;
+  }
+
+  return start_flusher();
+}
+
+int log_parse_level(const char* name, enum log_level* level) {
+  for (size_t i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++) {
+    if (strcmp(name, level_names[i]) == 0) {
+      *level = (enum log_level) i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+void log_write(struct log_site* site, enum log_level level, uint8_t with_errno, const char* fmt, ...) {
+  char line[LOG_PREFIX_MAX + LOG_LINE_MAX + 1];
+  char error[128];
+  struct log_record local;
+  struct log_record* rec;
+  struct log_ring* ring;
+  uint32_t tail, head, suppressed;
+  int saved_errno;
+  uint8_t queued;
+  va_list args;
+  int len;
+
+  saved_errno = errno;
+  rec = &local;
+  ring = NULL;
+  tail = 0;
+  head = 0;
+
+  if (!admit(site)) {
+    errno = saved_errno;
+    return;
+  }
+  rec->ns = now_ns();
+  suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+
+  queued = __atomic_load_n(&logger.running, __ATOMIC_ACQUIRE);
+  if (queued) {
+    ring = thread_ring ? thread_ring : claim_ring();
+    if (!ring) {
+      errno = saved_errno;
+      return;
+    }
+    // the consumer only ever frees slots, so a stale head errs on the side of full
+    tail = ring->tail;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (tail - head == LOG_RING_SLOTS) {
+      __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+      errno = saved_errno;
+      return;
+    }
+    rec = &ring->records[tail % LOG_RING_SLOTS];
+    rec->ns = local.ns;
+  }
+
+  // formatted here, since the arguments may not outlive the call
+  rec->level = level;
+  va_start(args, fmt);
+  len = vsnprintf(rec->text, LOG_LINE_MAX, fmt, args);
+  va_end(args);
+  len = len < 0 ? 0 : len >= LOG_LINE_MAX ? LOG_LINE_MAX - 1 : len;
+  if (with_errno) {
+    len = append(rec->text, len, ": %s", strerror_r(saved_errno, error, sizeof(error)));
+  }
+  if (suppressed) {
+    len = append(rec->text, len, " (%u more suppressed)", suppressed);
+  }
+  rec->len = len;
+
+  if (!queued) {
+    write_out(line, format_line(line, sizeof(line), rec->ns, rec->level, rec->text, rec->len));
+    errno = saved_errno;
+    return;
+  }
+
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+  // otherwise the flusher gets to it on its own
+  if (tail + 1 - head >= LOG_RING_SLOTS / 2 &&
+      !__atomic_exchange_n(&logger.signalled, 1, __ATOMIC_ACQ_REL)) {
+    uint64_t one = 1;
+    if (write(logger.wake_fd, &one, sizeof(one)) < 0) {
+      // the flusher wakes up on its own soon enough
+    }
+  }
+  errno = saved_errno;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Counts the records of a site in windows of a second. Sites are shared by
+// every thread logging from them, so the count is approximate around the
+// start of a window, which is fine for a rate limit. So is the coarse
+// clock, which is a fraction of the cost of the precise one.
+static uint8_t admit(struct log_site* site) {
+  struct timespec ts;
+  uint64_t window, seen;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  window = ts.tv_sec;
+  seen = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+  if (seen != window &&
+      __atomic_compare_exchange_n(&site->window, &seen, window, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+  }
+
+  if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) > LOG_SITE_RATE) {
+    __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  return 1;
+}
+
+// appends to a message of len, returning its new length
+static size_t append(char* text, size_t len, const char* fmt, ...) {
+  va_list args;
+  int n;
+
+  if (len >= LOG_LINE_MAX - 1) {
+    return len;
+  }
+  va_start(args, fmt);
+  n = vsnprintf(text + len, LOG_LINE_MAX - len, fmt, args);
+  va_end(args);
+  if (n < 0) {
+    return len;
+  }
+  return len + n >= LOG_LINE_MAX ? LOG_LINE_MAX - 1 : len + n;
+}
+
+// Gives the calling thread a ring, taking over one whose thread exited if
+// there is any. Only runs on the first record of a thread.
+static struct log_ring* claim_ring() {
+  struct log_ring* ring;
+
+  for (ring = __atomic_load_n(&logger.rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+    if (!__atomic_exchange_n(&ring->in_use, 1, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+  }
+
+  if (!ring) {
+    ring = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct log_ring));
+    if (!ring) {
+      return NULL;
+    }
+    memset(ring, 0, sizeof(struct log_ring));
+    ring->in_use = 1;
+    ring->next = __atomic_load_n(&logger.rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&logger.rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+  }
+
+  pthread_setspecific(logger.owner, ring);
+  thread_ring = ring;
+  return ring;
+}
+
+// its records are still flushed, the next owner appends to them
+static void release_ring(void* arg) {
+  struct log_ring* ring;
+
+  ring = (struct log_ring*) arg;
+  thread_ring = NULL;
+  __atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static int start_flusher() {
+  logger.stopping = 0;
+  logger.signalled = 0;
+  logger.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (logger.wake_fd < 0) {
+    log_perror("could not create log flusher wakeup");
+    return -1;
+  }
+
+  __atomic_store_n(&logger.running, 1, __ATOMIC_RELEASE);
+  if (pthread_create(&logger.flusher, NULL, run_flusher, NULL)) {
+    __atomic_store_n(&logger.running, 0, __ATOMIC_RELEASE);
+    close(logger.wake_fd);
+    logger.wake_fd = -1;
+    log_error("could not start log flusher, logging synchronously");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void* run_flusher(void* arg) {
+  struct pollfd wake = {.fd = logger.wake_fd, .events = POLLIN};
+  uint64_t count;
+
+  while (!__atomic_load_n(&logger.stopping, __ATOMIC_ACQUIRE)) {
+    if (poll(&wake, 1, LOG_FLUSH_INTERVAL) > 0 && read(logger.wake_fd, &count, sizeof(count)) < 0) {
+      // cleared by an earlier read
+    }
+    __atomic_store_n(&logger.signalled, 0, __ATOMIC_RELEASE);
+    flush_rings();
+  }
+  return NULL;
+}
+
+// Drains the rings under the drain lock and writes out what they held
+// without it, a buffer at a time, so a fork never waits on a stuck fd.
+static void flush_rings() {
+  uint8_t more;
+
+  do {
+    pthread_mutex_lock(&logger.drain);
+    more = drain_rings();
+    pthread_mutex_unlock(&logger.drain);
+
+    write_out(logger.out, logger.out_len);
+    logger.out_len = 0;
+  } while (more);
+}
+
+// Formats the pending records of every ring into out, oldest first, so the
+// lines of different threads interleave as they were logged. A record
+// published after a drain it was timestamped before still comes out in the
+// next one. Called with the drain lock held.
+//
+// returns 1 if out filled up before the rings were drained, 0 otherwise
+static uint8_t drain_rings() {
+  struct log_ring* ring;
+  struct log_ring* oldest;
+  struct log_record* rec;
+  char note[LOG_LINE_MAX];
+  uint32_t dropped;
+  size_t len;
+
+  for (;;) {
+    oldest = NULL;
+    for (ring = __atomic_load_n(&logger.rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+      if (ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+        continue;
+      }
+      if (!oldest || ring->records[ring->head % LOG_RING_SLOTS].ns <
+                     oldest->records[oldest->head % LOG_RING_SLOTS].ns) {
+        oldest = ring;
+      }
+    }
+    if (!oldest) {
+      break;
+    }
+
+    if (LOG_OUT_SIZE - logger.out_len < LOG_PREFIX_MAX + LOG_LINE_MAX + 1) {
+      return 1;
+    }
+    rec = &oldest->records[oldest->head % LOG_RING_SLOTS];
+    logger.out_len += format_line(logger.out + logger.out_len, LOG_OUT_SIZE - logger.out_len,
+                                  rec->ns, rec->level, rec->text, rec->len);
+    __atomic_store_n(&oldest->head, oldest->head + 1, __ATOMIC_RELEASE);
+  }
+
+  for (ring = __atomic_load_n(&logger.rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+    if (LOG_OUT_SIZE - logger.out_len < LOG_PREFIX_MAX + LOG_LINE_MAX + 1) {
+      return 1;
+    }
+    dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped) {
+      len = append(note, 0, "log ring was full, dropped %u records", dropped);
+      logger.out_len += format_line(logger.out + logger.out_len, LOG_OUT_SIZE - logger.out_len,
+                                    now_ns(), LOG_LEVEL_WARN, note, len);
+    }
+  }
+  return 0;
+}
+
+// renders "<time> <level> [<pid>] <text>\n", returning its length
+static size_t format_line(char* line, size_t cap, uint64_t ns, uint8_t level, const char* text, size_t len) {
+  struct tm tm;
+  time_t secs;
+  size_t n;
+  int prefix;
+
+  secs = ns / 1000000000;
+  localtime_r(&secs, &tm);
+  n = strftime(line, cap, "%Y-%m-%d %H:%M:%S", &tm);
+  prefix = snprintf(line + n, cap - n, ".%06u %-5s [%d] ", (unsigned int) (ns % 1000000000 / 1000),
+                    level_names[level], logger.pid ? logger.pid : getpid());
+  n += prefix < 0 ? 0 : prefix;
+
+  if (len > cap - n - 1) {
+    len = cap - n - 1;
+  }
+  memcpy(line + n, text, len);
+  n += len;
+  line[n++] = '\n';
+  return n;
+}
+
+static void write_out(const char* buf, size_t len) {
+  ssize_t written;
+
+  while (len > 0) {
+    written = write(logger.fd, buf, len);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    buf += written;
+    len -= written;
+  }
+}
+
+// runs at exit, records logged from then on are written synchronously
+static void stop_flusher() {
+  uint64_t one = 1;
+
+  if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+
+  __atomic_store_n(&logger.stopping, 1, __ATOMIC_RELEASE);
+  if (write(logger.wake_fd, &one, sizeof(one)) < 0) {
+    // the flusher notices within LOG_FLUSH_INTERVAL
+  }
+  pthread_join(logger.flusher, NULL);
+  __atomic_store_n(&logger.running, 0, __ATOMIC_RELEASE);
+
+  flush_rings();
+
+  close(logger.wake_fd);
+  logger.wake_fd = -1;
+}
+
+// keeps the flusher from being forked in the middle of a drain, which is
+// quick: the flusher writes out what it drained after letting go
+static void before_fork() {
+  pthread_mutex_lock(&logger.drain);
+}
+
+static void after_fork_parent() {
+  pthread_mutex_unlock(&logger.drain);
+}
+
+// The child only has the forking thread, and a copy of the rings and of
+// the output whose records the parent still flushes. It starts over with
+// empty rings, every one but its own free to take, and a flusher of its own.
+static void after_fork_child() {
+  struct log_ring* ring;
+
+  pthread_mutex_unlock(&logger.drain);
+  logger.pid = getpid();
+  logger.out_len = 0;
+
+  for (ring = logger.rings; ring; ring = ring->next) {
+    ring->head = ring->tail;
+    ring->dropped = 0;
+    ring->in_use = ring == thread_ring;
+  }
+
+  if (!logger.running) {
+    return;
+  }
+  close(logger.wake_fd);
+  start_flusher();
+}
@@ -0,0 +1,99 @@
+/**
+ * Loglib - Asynchronous logging
+ *
+ * Logging from a reactor must never block it, so records are formatted by
+ * the thread logging them into a ring of its own, and written out by a
+ * flusher thread in batches. Producers take no lock and make no syscall:
+ * when a ring is full the record is dropped and counted, and the count is
+ * reported once there is room again.
+ *
+ * Records below the configured level cost a load and a branch. Every call
+ * site is also rate limited, so a flood of the same error can't crowd out
+ * everything else; what a site had suppressed is reported along with its
+ * next record.
+ *
+ * Until log_start is called, and if the flusher can't run, records are
+ * written to stderr right away.
+ *
+ */
+
+#ifndef LOGLIB_H
+#define LOGLIB_H
+
+#include <stdint.h>
+
+#define LOG_RING_SLOTS 256 // records each thread can have pending
+#define LOG_LINE_MAX 224 // longest message, longer ones are cut short
+#define LOG_FLUSH_INTERVAL 50 // ms between flushes of rings that aren't filling up
+#define LOG_SITE_RATE 20 // records per second a call site may log
+
+enum log_level {
+  LOG_LEVEL_DEBUG, // once per request or more, off by default
+  LOG_LEVEL_INFO, // changes of state, e.g. processes authorized
+  LOG_LEVEL_WARN, // something was refused or dropped, the server carries on
+  LOG_LEVEL_ERROR, // something failed
+};
+
+// state of a call site, one per log statement
+struct log_site {
+  uint64_t window; // second its count is for
+  uint32_t count;
+  uint32_t suppressed; // records over the rate, to report with the next one
+};
+
+extern enum log_level log_threshold;
+
+#define LOG_AT(level, with_errno, ...)                                  \
+  do {                                                                  \
+    static struct log_site log_site_;                                   \
+    if ((level) >= log_threshold) {                                     \
+      log_write(&log_site_, (level), (with_errno), __VA_ARGS__);        \
+    }                                                                   \
+  } while (0)
+
+#define log_debug(...) LOG_AT(LOG_LEVEL_DEBUG, 0, __VA_ARGS__)
+#define log_info(...) LOG_AT(LOG_LEVEL_INFO, 0, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LOG_LEVEL_WARN, 0, __VA_ARGS__)
+#define log_error(...) LOG_AT(LOG_LEVEL_ERROR, 0, __VA_ARGS__)
+// like perror: an error, followed by the description of errno
+#define log_perror(...) LOG_AT(LOG_LEVEL_ERROR, 1, __VA_ARGS__)
+
+/**
+ * log_start: starts the flusher, from which point logging is asynchronous.
+ * Whatever is pending when the process exits is flushed then. Children
+ * forked afterwards get a flusher of their own
+ *
+ * @level: lowest level logged
+ * @fd: where records are written to
+ *
+ * @returns -1 if the flusher could not start, in which case logging stays
+ * synchronous, 0 otherwise
+ *
+**/
+int log_start(enum log_level level, int fd);
+
+/**
+ * log_parse_level: reads the name of a level
+ *
+ * @name: debug, info, warn or error
+ * @level: set to the level named
+ *
+ * @returns -1 if name is no level, 0 otherwise
+ *
+**/
+int log_parse_level(const char* name, enum log_level* level);
+
+/**
+ * log_write: logs a record, prefer the log_* macros, which skip it cheaply
+ * if it is below the level and give it a call site
+ *
+ * @site: call site of the record
+ * @level: level of the record
+ * @with_errno: whether to append the description of errno
+ * @fmt: printf format of the message
+ *
+**/
+void log_write(struct log_site* site, enum log_level level, uint8_t with_errno, const char* fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+#endif // LOGLIB_H
@@ -1,38 +1,205 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <string.h>
+#include <endian.h>
 
 #include "service_reader.h"
 #include "service_builder.h"
 #include "service_verifier.h"
+#include "loglib/loglib.h"
 
 #include "protolib.h"
 
+// Each thread keeps one builder for its lifetime and resets it between
+// messages, so its internal buffers are only allocated once.
+static __thread flatcc_builder_t thread_builder;
+static __thread int thread_builder_ready;
+
 /**
- * new_builder allocates and creates a new flatcc builder
+ * get_builder: returns this thread's builder, reset and ready to start
+ * building a new message
  *
- * @returns a pointer to builder ready to start building messages.
- * Client is responsible for calling free_builder(B) after use.
+ * @returns a pointer to builder, or NULL if it could not be initialized.
+ * The builder is owned by the thread and must not be freed.
  *
 **/
-static flatcc_builder_t* new_builder();
+static flatcc_builder_t* get_builder();
 
 /**
- * free_builder: release resources allocated for builder
+ * copy_buffer: copies the message finished by B into a caller supplied buffer
+ *
+ * @B: builder holding a finished message
+ * @buf: destination buffer
+ * @cap: capacity of buf in bytes
  *
- * @B: builder to free
+ * @returns size of the message, or 0 if it does not fit in buf
  *
 **/
-static void free_builder(flatcc_builder_t* B);
+static size_t copy_buffer(flatcc_builder_t* B, uint8_t* buf, size_t cap);
+
+/**
+ * finalize_buffer: copies the message finished by B into a new heap buffer
+ *
+ * @B: builder holding a finished message
+ * @ret_buf: return parameter of the new buffer
+ *
+ * @returns size of the message, or 0 on error. Caller is responsible for buffer's memory
+ *
+**/
+static size_t finalize_buffer(flatcc_builder_t* B, uint8_t** ret_buf);
+
+#define TEMPLATE_MAX_SIZE 128
+#define TEMPLATE_SENTINEL UINT64_C(0x0123456789abcdef) // seq_num used to locate the field
+#define TEMPLATE_CHECK_SEQ_NUM UINT64_C(0x00000000deadbeef)
+
+// A message whose only varying field is Message.seq_num, encoded once
+struct msg_template {
+  uint8_t buf[TEMPLATE_MAX_SIZE];
+  size_t len;
+  size_t seq_num_offset;
+};
 
+static struct msg_template heartbeat_request_template;
+static struct msg_template heartbeat_response_template;
+static int templates_ready;
+
+/**
+ * init_template: encodes a fixed-shape message into tmpl and locates its
+ * seq_num field, then checks that patching it reproduces what the builder
+ * would have produced
+ *
+ * @tmpl: template to initialize
+ * @build: builds the message for a given seq_num
+ *
+ * @returns 0 on success or -1 if the message cannot be templated
+ *
+**/
+static int init_template(struct msg_template* tmpl, int (*build)(flatcc_builder_t*, uint64_t));
+
+/**
+ * render_template: produces a message from tmpl with seq_num patched in
+ *
+ * @tmpl: initialized template
+ * @seq_num: sequence number of message
+ * @buf: buffer to render into
+ * @cap: capacity of buf in bytes
+ *
+ * @returns size of the message, or 0 if it does not fit in buf
+ *
+**/
+static size_t render_template(struct msg_template* tmpl, uint64_t seq_num, uint8_t* buf, size_t cap);
+
+static int build_heartbeat_request(flatcc_builder_t* B, uint64_t seq_num);
+static int build_heartbeat_response(flatcc_builder_t* B, uint64_t seq_num);
+static int build_authorize_process_request(flatcc_builder_t* B, struct authorize_process_request* ap_req, uint64_t seq_num);
+static int build_authorize_process_response(flatcc_builder_t* B, struct authorize_process_response* ap_resp, uint64_t seq_num);
+
+
+int init_message_templates() {
+  if (init_template(&heartbeat_request_template, build_heartbeat_request) < 0) {
+    log_error("could not template heartbeat request");
+    return -1;
+  }
+
+  if (init_template(&heartbeat_response_template, build_heartbeat_response) < 0) {
+    log_error("could not template heartbeat response");
+    return -1;
+  }
+
+  templates_ready = 1;
+  return 0;
+}
 
 size_t marshall_heartbeat_request(uint64_t seq_num, uint8_t** ret_buf) {
-  uint8_t *buf;
-  size_t size; 
+  flatcc_builder_t* B = get_builder();
+  if (!B || build_heartbeat_request(B, seq_num) < 0) {
+    return 0;
+  }
+  return finalize_buffer(B, ret_buf);
+}
+
+size_t marshall_heartbeat_request_into(uint64_t seq_num, uint8_t* buf, size_t cap) {
+  // a zero seq_num is a default value the builder leaves out, so only the
+  // builder can produce that message byte for byte
+  if (templates_ready && seq_num != 0) {
+    return render_template(&heartbeat_request_template, seq_num, buf, cap);
+  }
+
+  flatcc_builder_t* B = get_builder();
+  if (!B || build_heartbeat_request(B, seq_num) < 0) {
+    return 0;
+  }
+  return copy_buffer(B, buf, cap);
+}
 
-  flatcc_builder_t* B = new_builder();
-  if (!B) {
+size_t marshall_heartbeat_response(uint64_t seq_num, uint8_t** ret_buf) {
+  flatcc_builder_t* B = get_builder();
+  if (!B || build_heartbeat_response(B, seq_num) < 0) {
     return 0;
   }
+  return finalize_buffer(B, ret_buf);
+}
 
+size_t marshall_heartbeat_response_into(uint64_t seq_num, uint8_t* buf, size_t cap) {
+  if (templates_ready && seq_num != 0) {
+    return render_template(&heartbeat_response_template, seq_num, buf, cap);
+  }
+
+  flatcc_builder_t* B = get_builder();
+  if (!B || build_heartbeat_response(B, seq_num) < 0) {
+    return 0;
+  }
+  return copy_buffer(B, buf, cap);
+}
+
+size_t marshall_authorize_process_request(struct authorize_process_request* ap_req, uint64_t seq_num, uint8_t** ret_buf) {
+  flatcc_builder_t* B = get_builder();
+  if (!B || build_authorize_process_request(B, ap_req, seq_num) < 0) {
+    return 0;
+  }
+  return finalize_buffer(B, ret_buf);
+}
+
+size_t marshall_authorize_process_request_into(struct authorize_process_request* ap_req, uint64_t seq_num, uint8_t* buf, size_t cap) {
+  flatcc_builder_t* B = get_builder();
+  if (!B || build_authorize_process_request(B, ap_req, seq_num) < 0) {
+    return 0;
+  }
+  return copy_buffer(B, buf, cap);
+}
+
+struct authorize_process_request* unmarshall_authorize_process_request(ns(AuthorizeProcessRequest_table_t)* req) {
+  struct authorize_process_request* ap_req = malloc(sizeof(struct authorize_process_request));
+  if (!ap_req) {
+    log_perror("no memory authorize process request");
+    return NULL;
+  }
+  memset(ap_req, 0, sizeof(struct authorize_process_request));
+  
+  ap_req->old_pid = ns(AuthorizeProcessRequest_old_pid_get(*req));
+  ap_req->new_pid = ns(AuthorizeProcessRequest_new_pid_get(*req));
+
+  return ap_req;
+}
+
+size_t marshall_authorize_process_response(struct authorize_process_response* ap_resp, uint64_t seq_num, uint8_t** ret_buf) {
+  flatcc_builder_t* B = get_builder();
+  if (!B || build_authorize_process_response(B, ap_resp, seq_num) < 0) {
+    return 0;
+  }
+  return finalize_buffer(B, ret_buf);
+}
+
+size_t marshall_authorize_process_response_into(struct authorize_process_response* ap_resp, uint64_t seq_num, uint8_t* buf, size_t cap) {
+  flatcc_builder_t* B = get_builder();
+  if (!B || build_authorize_process_response(B, ap_resp, seq_num) < 0) {
+    return 0;
+  }
+  return copy_buffer(B, buf, cap);
+}
+
+static int build_heartbeat_request(flatcc_builder_t* B, uint64_t seq_num) {
   ns(HeartbeatRequest_start(B));
   ns(HeartbeatRequest_ref_t) req = ns(HeartbeatRequest_end(B));  
 
@@ -43,23 +210,10 @@ size_t marshall_heartbeat_request(uint64_t seq_num, uint8_t** ret_buf) {
   ns(Message_payload_add(B, payload));
   ns(Message_end_as_root(B));
 
-  buf = flatcc_builder_finalize_buffer(B, &size); 
-  
-  free_builder(B);
-
-  *ret_buf = buf;
-  return size;
+  return 0;
 }
 
-size_t marshall_heartbeat_response(uint64_t seq_num, uint8_t** ret_buf) {
-  uint8_t* buf;
-  size_t size;
-
-  flatcc_builder_t* B = new_builder();
-  if (!B) {
-    return 0;
-  }
-
+static int build_heartbeat_response(flatcc_builder_t* B, uint64_t seq_num) {
   ns(HeartbeatResponse_start(B));
   ns(HeartbeatResponse_ref_t) resp = ns(HeartbeatResponse_end(B));  
 
@@ -71,26 +225,13 @@ size_t marshall_heartbeat_response(uint64_t seq_num, uint8_t** ret_buf) {
   ns(Message_payload_add(B, payload));
   ns(Message_end_as_root(B));
 
-  buf = flatcc_builder_finalize_buffer(B, &size); 
-
-  free_builder(B);
-
-  *ret_buf = buf;
-  return size;
+  return 0;
 }
 
-size_t marshall_authorize_process_request(struct authorize_process_request* ap_req, uint64_t seq_num, uint8_t** ret_buf) {
-  uint8_t* buf;
-  size_t size;
-
+static int build_authorize_process_request(flatcc_builder_t* B, struct authorize_process_request* ap_req, uint64_t seq_num) {
   if (!ap_req) {
-    perror("invalid authorize process request");
-    return 0;
-  }
-
-  flatcc_builder_t* B = new_builder();
-  if (!B) {
-    return 0;
+    log_error("invalid authorize process request");
+    return -1;
   }
 
   ns(AuthorizeProcessRequest_start(B));
@@ -106,73 +247,135 @@ size_t marshall_authorize_process_request(struct authorize_process_request* ap_r
   ns(Message_payload_add(B, payload));
   ns(Message_end_as_root(B));
 
-  buf = flatcc_builder_finalize_buffer(B, &size); 
+  return 0;
+}
 
-  free_builder(B);
+static int build_authorize_process_response(flatcc_builder_t* B, struct authorize_process_response* ap_resp, uint64_t seq_num) {
+  if (!ap_resp) {
+    log_error("invalid authorize process response");
+    return -1;
+  }
 
-  *ret_buf = buf;
-  return size;
+  ns(AuthorizeProcessResponse_start(B));
+  ns(AuthorizeProcessResponse_ref_t) resp = ns(AuthorizeProcessResponse_end(B));
+
+  ns(Message_start_as_root(B));
+  ns(Message_seq_num_add(B, seq_num));
+
+  ns(Payload_union_ref_t) payload = ns(Payload_as_AuthorizeProcessResponse(resp));
+
+  ns(Message_payload_add(B, payload));
+  ns(Message_end_as_root(B));
+
+  return 0;
 }
 
-struct authorize_process_request* unmarshall_authorize_process_request(ns(AuthorizeProcessRequest_table_t)* req) {
-  struct authorize_process_request* ap_req = malloc(sizeof(struct authorize_process_request));
-  if (!ap_req) {
-    perror("no memory authorize process request");
-    return NULL;
+static int init_template(struct msg_template* tmpl, int (*build)(flatcc_builder_t*, uint64_t)) {
+  uint8_t expected[TEMPLATE_MAX_SIZE], rendered[TEMPLATE_MAX_SIZE];
+  uint64_t sentinel;
+  uint8_t* field;
+  size_t expected_len, rendered_len;
+  flatcc_builder_t* B;
+
+  memset(tmpl, 0, sizeof(struct msg_template));
+
+  B = get_builder();
+  if (!B || build(B, TEMPLATE_SENTINEL) < 0) {
+    return -1;
+  }
+  tmpl->len = copy_buffer(B, tmpl->buf, sizeof(tmpl->buf));
+  if (tmpl->len == 0) {
+    return -1;
   }
-  memset(ap_req, 0, sizeof(struct authorize_process_request));
-  
-  ap_req->old_pid = ns(AuthorizeProcessRequest_old_pid_get(*req));
-  ap_req->new_pid = ns(AuthorizeProcessRequest_new_pid_get(*req));
 
-  return ap_req;
-}
+  // the sentinel must show up exactly once for its offset to be the field's
+  sentinel = htole64(TEMPLATE_SENTINEL);
+  field = memmem(tmpl->buf, tmpl->len, &sentinel, sizeof(sentinel));
+  if (!field) {
+    return -1;
+  }
+  tmpl->seq_num_offset = field - tmpl->buf;
+  if (memmem(field + 1, tmpl->len - tmpl->seq_num_offset - 1, &sentinel, sizeof(sentinel))) {
+    return -1;
+  }
 
-size_t marshall_authorize_process_response(struct authorize_process_response* ap_resp, uint64_t seq_num, uint8_t** ret_buf) {
-  uint8_t* buf;
-  size_t size;
+  // a patched template must verify, read back, and match the builder exactly
+  rendered_len = render_template(tmpl, TEMPLATE_CHECK_SEQ_NUM, rendered, sizeof(rendered));
+  if (ns(Message_verify_as_root(rendered, rendered_len)) != 0) {
+    return -1;
+  }
+  if (ns(Message_seq_num_get(ns(Message_as_root(rendered)))) != TEMPLATE_CHECK_SEQ_NUM) {
+    return -1;
+  }
 
-  if (!ap_resp) {
-    perror("invalid authorize process request");
-    return 0;
+  B = get_builder();
+  if (!B || build(B, TEMPLATE_CHECK_SEQ_NUM) < 0) {
+    return -1;
+  }
+  expected_len = copy_buffer(B, expected, sizeof(expected));
+  if (expected_len != rendered_len || memcmp(expected, rendered, rendered_len) != 0) {
+    return -1;
   }
 
-  flatcc_builder_t* B = new_builder();
-  if (!B) {
+  return 0;
+}
+
+static size_t render_template(struct msg_template* tmpl, uint64_t seq_num, uint8_t* buf, size_t cap) {
+  uint64_t le_seq_num;
+
+  if (tmpl->len > cap) {
+    log_error("message does not fit in buffer");
     return 0;
   }
 
-  ns(AuthorizeProcessResponse_start(B));
-  ns(AuthorizeProcessResponse_ref_t) resp = ns(AuthorizeProcessResponse_end(B));
+  le_seq_num = htole64(seq_num);
+  memcpy(buf, tmpl->buf, tmpl->len);
+  memcpy(buf + tmpl->seq_num_offset, &le_seq_num, sizeof(le_seq_num));
 
-  ns(Message_start_as_root(B));
-  ns(Message_seq_num_add(B, seq_num));
+  return tmpl->len;
+}
 
-  ns(Payload_union_ref_t) payload = ns(Payload_as_AuthorizeProcessResponse(resp));
+static flatcc_builder_t* get_builder() {
+  if (!thread_builder_ready) {
+    if (flatcc_builder_init(&thread_builder)) {
+      log_error("failed to initialize builder");
+      return NULL;
+    }
+    thread_builder_ready = 1;
+    return &thread_builder;
+  }
 
-  ns(Message_payload_add(B, payload));
-  ns(Message_end_as_root(B));
+  flatcc_builder_reset(&thread_builder);
+  return &thread_builder;
+}
 
-  buf = flatcc_builder_finalize_buffer(B, &size); 
+static size_t copy_buffer(flatcc_builder_t* B, uint8_t* buf, size_t cap) {
+  size_t size;
 
-  free_builder(B);
+  size = flatcc_builder_get_buffer_size(B);
+  if (size > cap) {
+    log_error("message does not fit in buffer");
+    return 0;
+  }
+
+  if (!flatcc_builder_copy_buffer(B, buf, cap)) {
+    log_error("failed to copy message");
+    return 0;
+  }
 
-  *ret_buf = buf;
   return size;
 }
 
-static void free_builder(flatcc_builder_t* B) {
-  flatcc_builder_clear(B);
-  free(B);
-}
+static size_t finalize_buffer(flatcc_builder_t* B, uint8_t** ret_buf) {
+  uint8_t* buf;
+  size_t size;
 
-static flatcc_builder_t* new_builder() {
-  flatcc_builder_t* B = malloc(sizeof(flatcc_builder_t));
-  if (!B) {
-    perror("no memory for builder");
-    return NULL;
-  } 
-  memset(B, 0, sizeof(flatcc_builder_t));
-  flatcc_builder_init(B);
-  return B;
+  buf = flatcc_builder_finalize_buffer(B, &size);
+  if (!buf) {
+    log_error("failed to finalize message");
+    return 0;
+  }
+
+  *ret_buf = buf;
+  return size;
 }
@@ -3,6 +3,14 @@
  *  messages defined by our protocol, for convenient usage
  *  by the various C programs.
  *
+ *  Messages are built with a per-thread flatcc builder that is reset, not
+ *  reallocated, between messages. The *_into variants finalize straight
+ *  into a caller supplied buffer and never touch the heap.
+ *
+ *  Heartbeats only differ in their seq_num, so once init_message_templates
+ *  has run they are produced by copying a pre-encoded message and storing
+ *  the sequence number in place.
+ *
  */
 
 #ifndef PROTOLIB_H
@@ -19,6 +27,19 @@
 
 struct heartbeat_request {};
 
+/**
+ * init_message_templates: pre-encodes the fixed-shape heartbeat messages so that
+ * marshall_heartbeat_*_into can render them with a copy and an 8 byte store.
+ *
+ * Each template is checked on creation: it must pass the verifier and render
+ * byte for byte what the builder produces. Call once at startup, before any
+ * thread marshalls heartbeats.
+ *
+ * @returns 0 on success or -1 if templates are unavailable, in which case
+ * messages keep being built with the builder
+*/
+int init_message_templates();
+
 /**
  * marshall_heartbeart_request: marshalls a new HeartbeatRequest buffer ready to be
  * trasmitted. 
@@ -30,6 +51,18 @@ struct heartbeat_request {};
 */
 size_t marshall_heartbeat_request(uint64_t seq_num, uint8_t** ret_buf);
 
+/**
+ * marshall_heartbeart_request_into: marshalls a new HeartbeatRequest into a caller
+ * supplied buffer, without allocating.
+ *
+ * @seq_num: sequence number associated with request
+ * @buf: buffer to marshall into
+ * @cap: capacity of buf in bytes
+ *
+ * @returns size of the marshalled buffer, or 0 on error or if it does not fit in buf
+*/
+size_t marshall_heartbeat_request_into(uint64_t seq_num, uint8_t* buf, size_t cap);
+
 /**
  * marshall_heartbeart_response: marshalls a new HeartbeatResponse buffer ready to be
  * trasmitted. 
@@ -41,6 +74,18 @@ size_t marshall_heartbeat_request(uint64_t seq_num, uint8_t** ret_buf);
 */
 size_t marshall_heartbeat_response(uint64_t seq_num, uint8_t** ret_buf);
 
+/**
+ * marshall_heartbeart_response_into: marshalls a new HeartbeatResponse into a caller
+ * supplied buffer, without allocating.
+ *
+ * @seq_num: sequence number associated with response
+ * @buf: buffer to marshall into
+ * @cap: capacity of buf in bytes
+ *
+ * @returns size of the marshalled buffer, or 0 on error or if it does not fit in buf
+*/
+size_t marshall_heartbeat_response_into(uint64_t seq_num, uint8_t* buf, size_t cap);
+
 struct authorize_process_request {
   uint32_t old_pid;
   uint32_t new_pid;
@@ -58,6 +103,19 @@ struct authorize_process_request {
 */
 size_t marshall_authorize_process_request(struct authorize_process_request* ap_req, uint64_t seq_num, uint8_t** ret_buf);
 
+/**
+ * marshall_authorize_process_request_into: marshalls a new AuthorizeProcessRequest into
+ * a caller supplied buffer, without allocating.
+ *
+ * @ap_req: authorize_process_request struct to marshall
+ * @seq_num: sequence number associated with request
+ * @buf: buffer to marshall into
+ * @cap: capacity of buf in bytes
+ *
+ * @returns size of the marshalled buffer, or 0 on error or if it does not fit in buf
+*/
+size_t marshall_authorize_process_request_into(struct authorize_process_request* ap_req, uint64_t seq_num, uint8_t* buf, size_t cap);
+
 /**
  * unmarshall_authorize_process_request: unmarshalls a AuthorizeProcessRequest into an internal struct for
  * easier consumption.
@@ -84,6 +142,19 @@ struct authorize_process_response {
 */
 size_t marshall_authorize_process_response(struct authorize_process_response* ap_resp, uint64_t seq_num, uint8_t** ret_buf);
 
+/**
+ * marshall_authorize_process_response_into: marshalls a new AuthorizeProcessResponse into
+ * a caller supplied buffer, without allocating.
+ *
+ * @ap_resp: authorize_process_response struct to marshall
+ * @seq_num: sequence number associated with response
+ * @buf: buffer to marshall into
+ * @cap: capacity of buf in bytes
+ *
+ * @returns size of the marshalled buffer, or 0 on error or if it does not fit in buf
+*/
+size_t marshall_authorize_process_response_into(struct authorize_process_response* ap_resp, uint64_t seq_num, uint8_t* buf, size_t cap);
+
 /**
  * unmarshall_authorize_process_response: unmarshalls a AuthorizeProcessResponse into an internal struct for
  * easier consumption.
@@ -0,0 +1,362 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "commslib/commslib.h"
+#include "loglib/loglib.h"
+#include "ring.h"
+
+#define RING_MIN_SPIN 16 // polls of an empty ring before sleeping
+#define RING_MAX_SPIN 4096
+#define RING_INITIAL_SPIN 256
+#define EVENTFD_LINK "anon_inode:[eventfd]"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+// Lives at the start of the memfd. Each side writes its own cache line only,
+// so polling the other side's index doesn't bounce the line it writes.
+struct ring_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t capacity;
+  uint32_t attached; // set by the consumer once it maps the ring
+
+  // written by the consumer
+  uint64_t head __attribute__((aligned(CACHE_LINE_SIZE))); // next frame to read
+  uint32_t sleeping; // the consumer waits for the eventfd
+
+  // written by the producer
+  uint64_t tail __attribute__((aligned(CACHE_LINE_SIZE))); // next frame to write
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct ring_frame {
+  uint32_t len;
+  uint8_t payload[MAX_MSG_SIZE];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+// Each side keeps its own index, and the last index of the other side it
+// read, locally. A consumer never reads its index back from the shared
+// memory, where the client could have changed it.
+struct ring {
+  struct ring_header* header;
+  struct ring_frame* frames;
+  size_t size;
+  uint32_t capacity;
+
+  int memfd;
+  int eventfd;
+  uint8_t consumer;
+
+  uint64_t head;
+  uint64_t tail;
+  unsigned int spin; // consumer only, polls before sleeping
+};
+
+static size_t ring_size(uint32_t capacity);
+static int valid_capacity(size_t capacity);
+static int is_eventfd(int fd);
+
+struct ring* new_ring(size_t capacity) {
+  struct ring* ring;
+
+  if (!valid_capacity(capacity)) {
+    log_error("ring capacity must be a power of two up to %d", RING_MAX_CAPACITY);
+    return NULL;
+  }
+
+  ring = calloc(1, sizeof(struct ring));
+  if (!ring) {
+    return NULL;
+  }
+  ring->capacity = capacity;
+  ring->size = ring_size(capacity);
+  ring->eventfd = -1;
+
+  ring->memfd = memfd_create("ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (ring->memfd < 0) {
+    log_perror("failed to create ring");
+    free(ring);
+    return NULL;
+  }
+
+  // sealed, so the server can trust the mapping won't shrink under it
+  if (ftruncate(ring->memfd, ring->size) < 0 ||
+      fcntl(ring->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+    log_perror("failed to size ring");
+    goto ERROR;
+  }
+
+  ring->header = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->memfd, 0);
+  if (ring->header == MAP_FAILED) {
+    ring->header = NULL;
+    log_perror("failed to map ring");
+    goto ERROR;
+  }
+  ring->frames = (struct ring_frame*) (ring->header + 1);
+  ring->header->magic = RING_MAGIC;
+  ring->header->version = RING_VERSION;
+  ring->header->capacity = capacity;
+
+  ring->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (ring->eventfd < 0) {
+    log_perror("failed to create ring wakeup");
+    goto ERROR;
+  }
+
+  return ring;
+
+ERROR:
+  free_ring(ring);
+  return NULL;
+}
+
+int offer_ring(struct ring* ring, int src_fd, struct sockaddr_un* dst) {
+  struct ring_offer offer;
+  struct msghdr hdr;
+  struct iovec iov;
+  union {
+    struct cmsghdr cmh;
+    char buf[CMSG_SPACE(RING_FDS * sizeof(int))];
+  } control;
+  int fds[RING_FDS];
+
+  offer.magic = RING_MAGIC;
+  offer.version = RING_VERSION;
+  offer.capacity = ring->capacity;
+
+  iov.iov_base = &offer;
+  iov.iov_len = sizeof(offer);
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_name = dst;
+  hdr.msg_namelen = sizeof(struct sockaddr_un);
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+
+  memset(&control, 0, sizeof(control));
+  hdr.msg_control = control.buf;
+  hdr.msg_controllen = sizeof(control.buf);
+  control.cmh.cmsg_len = CMSG_LEN(RING_FDS * sizeof(int));
+  control.cmh.cmsg_level = SOL_SOCKET;
+  control.cmh.cmsg_type = SCM_RIGHTS;
+  fds[0] = ring->memfd;
+  fds[1] = ring->eventfd;
+  memcpy(CMSG_DATA(&control.cmh), fds, sizeof(fds));
+
+  if (sendmsg(src_fd, &hdr, MSG_NOSIGNAL) < 0) {
+    log_perror("failed to offer ring");
+    return -1;
+  }
+  return 0;
+}
+
+uint8_t ring_attached(struct ring* ring) {
+  return __atomic_load_n(&ring->header->attached, __ATOMIC_ACQUIRE) != 0;
+}
+
+int ring_push(struct ring* ring, uint8_t* payload, size_t payload_len) {
+  struct ring_frame* frame;
+
+  if (payload_len > MAX_MSG_SIZE) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  if (!ring_attached(ring)) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  // only read the consumer's index when the last one read says we're full
+  if (ring->tail - ring->head == ring->capacity) {
+    ring->head = __atomic_load_n(&ring->header->head, __ATOMIC_ACQUIRE);
+    if (ring->tail - ring->head >= ring->capacity) {
+      errno = EAGAIN;
+      return -1;
+    }
+  }
+
+  frame = &ring->frames[ring->tail & (ring->capacity - 1)];
+  frame->len = payload_len;
+  memcpy(frame->payload, payload, payload_len);
+
+  // publishing the frame and then checking for a sleeper pairs with the
+  // consumer announcing it sleeps and then checking for frames, so one of
+  // us always sees the other
+  __atomic_store_n(&ring->header->tail, ++ring->tail, __ATOMIC_SEQ_CST);
+  if (__atomic_exchange_n(&ring->header->sleeping, 0, __ATOMIC_SEQ_CST)) {
+    uint64_t one = 1;
+    if (write(ring->eventfd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      log_perror("failed to wake ring consumer");
+    }
+  }
+
+  return 0;
+}
+
+struct ring* attach_ring(struct ring_offer* offer, size_t offer_len, int memfd, int eventfd) {
+  struct ring* ring;
+  struct stat st;
+  int seals;
+
+  if (offer_len != sizeof(struct ring_offer) || offer->magic != RING_MAGIC ||
+      offer->version != RING_VERSION || !valid_capacity(offer->capacity)) {
+    log_error("invalid ring offer");
+    goto ERROR;
+  }
+
+  // a file that could shrink would fault us on access, and the wakeup has
+  // to be something reading can't block on
+  seals = fcntl(memfd, F_GET_SEALS);
+  if (seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(memfd, &st) < 0 ||
+      (size_t) st.st_size < ring_size(offer->capacity) || !is_eventfd(eventfd)) {
+    log_error("ring offered with invalid fds");
+    goto ERROR;
+  }
+  fcntl(eventfd, F_SETFL, fcntl(eventfd, F_GETFL) | O_NONBLOCK);
+
+  ring = calloc(1, sizeof(struct ring));
+  if (!ring) {
+    goto ERROR;
+  }
+  ring->consumer = 1;
+  ring->capacity = offer->capacity;
+  ring->size = ring_size(offer->capacity);
+  ring->memfd = memfd;
+  ring->eventfd = eventfd;
+  ring->spin = RING_INITIAL_SPIN;
+
+  ring->header = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (ring->header == MAP_FAILED) {
+    log_perror("failed to map ring");
+    ring->header = NULL;
+    free_ring(ring);
+    return NULL;
+  }
+  ring->frames = (struct ring_frame*) (ring->header + 1);
+
+  ring->head = __atomic_load_n(&ring->header->head, __ATOMIC_ACQUIRE);
+  ring->tail = ring->head;
+  __atomic_store_n(&ring->header->attached, 1, __ATOMIC_RELEASE);
+
+  return ring;
+
+ERROR:
+  close(memfd);
+  close(eventfd);
+  return NULL;
+}
+
+ssize_t ring_pop(struct ring* ring, uint8_t* buf, size_t buf_len) {
+  struct ring_frame* frame;
+  uint32_t len;
+
+  if (ring->head == ring->tail) {
+    ring->tail = __atomic_load_n(&ring->header->tail, __ATOMIC_ACQUIRE);
+    if (ring->head == ring->tail) {
+      errno = EAGAIN;
+      return -1;
+    }
+  }
+  if (ring->tail - ring->head > ring->capacity) {
+    errno = EBADMSG;
+    return -1;
+  }
+
+  frame = &ring->frames[ring->head & (ring->capacity - 1)];
+  len = __atomic_load_n(&frame->len, __ATOMIC_RELAXED);
+  if (len > MAX_MSG_SIZE || len > buf_len) {
+    errno = EBADMSG;
+    return -1;
+  }
+  memcpy(buf, frame->payload, len);
+
+  __atomic_store_n(&ring->header->head, ++ring->head, __ATOMIC_RELEASE);
+  return len;
+}
+
+int ring_spin(struct ring* ring) {
+  for (unsigned int i = 0; i < ring->spin; i++) {
+    cpu_relax();
+    if (__atomic_load_n(&ring->header->tail, __ATOMIC_ACQUIRE) != ring->head) {
+      if (ring->spin < RING_MAX_SPIN) {
+        ring->spin *= 2;
+      }
+      return 1;
+    }
+  }
+
+  if (ring->spin > RING_MIN_SPIN) {
+    ring->spin /= 2;
+  }
+  return 0;
+}
+
+int ring_sleep(struct ring* ring) {
+  __atomic_store_n(&ring->header->sleeping, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->header->tail, __ATOMIC_SEQ_CST) != ring->head) {
+    __atomic_store_n(&ring->header->sleeping, 0, __ATOMIC_RELAXED);
+    return -1;
+  }
+  return 0;
+}
+
+int ring_wakeup_fd(struct ring* ring) {
+  return ring->eventfd;
+}
+
+void ring_woken(struct ring* ring) {
+  uint64_t count;
+
+  if (read(ring->eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    log_perror("failed to read ring wakeup");
+  }
+  __atomic_store_n(&ring->header->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+void free_ring(struct ring* ring) {
+  if (ring->header) {
+    if (ring->consumer) {
+      __atomic_store_n(&ring->header->attached, 0, __ATOMIC_RELEASE);
+    }
+    munmap(ring->header, ring->size);
+  }
+  if (ring->memfd >= 0) {
+    close(ring->memfd);
+  }
+  if (ring->eventfd >= 0) {
+    close(ring->eventfd);
+  }
+  free(ring);
+}
+
+static size_t ring_size(uint32_t capacity) {
+  return sizeof(struct ring_header) + capacity * sizeof(struct ring_frame);
+}
+
+static int valid_capacity(size_t capacity) {
+  return capacity > 0 && capacity <= RING_MAX_CAPACITY && (capacity & (capacity - 1)) == 0;
+}
+
+static int is_eventfd(int fd) {
+  char path[32];
+  char target[sizeof(EVENTFD_LINK)];
+  ssize_t len;
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  len = readlink(path, target, sizeof(target));
+  return len == sizeof(EVENTFD_LINK) - 1 && memcmp(target, EVENTFD_LINK, len) == 0;
+}
@@ -0,0 +1,169 @@
+/**
+ * Ring - Shared memory request ring
+ *
+ * A single producer, single consumer ring of message frames in a memfd,
+ * mapped by a client and the server it talks to, so that requests reach
+ * the server without a syscall each. The consumer sleeps on an eventfd
+ * once the ring is drained, and the producer only writes to it when the
+ * consumer said it is asleep, so a busy ring costs no syscalls at all.
+ *
+ * The client creates the ring and offers it over the datagram socket it
+ * already talks to the server on, passing the memfd and eventfd along. The
+ * server only takes the offer from a process it has authorized, and marks
+ * the ring attached once it does. Until then, and whenever the ring is
+ * full, the client keeps sending datagrams.
+ *
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#define RING_MAGIC 0x474e4952 // "RING"
+#define RING_VERSION 1
+#define RING_FDS 2 // memfd and eventfd, in that order
+#define RING_MAX_CAPACITY 4096 // frames
+
+struct ring;
+
+// payload of the datagram a ring is offered with
+struct ring_offer {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t capacity;
+};
+
+/**
+ * new_ring: creates a ring to produce into, backed by a sealed memfd
+ *
+ * @capacity: number of frames, a power of two up to RING_MAX_CAPACITY
+ *
+ * @returns new ring or NULL on error. Caller must free after use by calling
+ * free_ring
+ *
+**/
+struct ring* new_ring(size_t capacity);
+
+/**
+ * offer_ring: sends the ring to a server, along with its fds
+ *
+ * @ring: ring created with new_ring
+ * @src_fd: authenticated datagram socket the client talks to the server on,
+ * which is also where replies to the frames are sent
+ * @dst: address of server
+ *
+ * @returns -1 on error, 0 otherwise. The server may still refuse it, see
+ * ring_attached
+ *
+**/
+int offer_ring(struct ring* ring, int src_fd, struct sockaddr_un* dst);
+
+/**
+ * ring_attached: tells whether a server consumes the ring
+ *
+ * @ring: ring created with new_ring
+ *
+ * @returns 1 once a server attached it, 0 until then or once it detached
+ *
+**/
+uint8_t ring_attached(struct ring* ring);
+
+/**
+ * ring_push: copies a message into the next free frame, waking the consumer
+ * if it sleeps
+ *
+ * @ring: ring created with new_ring
+ * @payload: message payload
+ * @payload_len: size of payload in bytes, at most MAX_MSG_SIZE
+ *
+ * @returns -1 on error, with errno EAGAIN if the ring is full or not attached,
+ * 0 otherwise
+ *
+**/
+int ring_push(struct ring* ring, uint8_t* payload, size_t payload_len);
+
+/**
+ * attach_ring: maps a ring offered by a client to consume from it. The
+ * memory is shared with the client, so nothing in it is trusted
+ *
+ * @offer: offer received
+ * @offer_len: size of offer in bytes
+ * @memfd: memfd received with the offer, owned by the ring from now on
+ * @eventfd: eventfd received with the offer, owned by the ring from now on
+ *
+ * @returns attached ring, or NULL if the offer is invalid, in which case the
+ * fds are closed. Caller must free after use by calling free_ring
+ *
+**/
+struct ring* attach_ring(struct ring_offer* offer, size_t offer_len, int memfd, int eventfd);
+
+/**
+ * ring_pop: copies the oldest frame out of the ring, so the client can't
+ * change it while it is handled
+ *
+ * @ring: attached ring
+ * @buf: buffer to copy into
+ * @buf_len: size of buf, at least MAX_MSG_SIZE
+ *
+ * @returns size of the message, or -1 with errno EAGAIN if the ring is empty
+ * or EBADMSG if the client corrupted it
+ *
+**/
+ssize_t ring_pop(struct ring* ring, uint8_t* buf, size_t buf_len);
+
+/**
+ * ring_spin: busy-polls an empty ring for a little while, as frames tend
+ * to come in bursts. It polls longer after polling paid off and shorter
+ * after it didn't, and never longer than a few thousand pauses
+ *
+ * @ring: attached ring
+ *
+ * @returns 1 if a frame arrived, 0 otherwise
+ *
+**/
+int ring_spin(struct ring* ring);
+
+/**
+ * ring_sleep: tells the producer to wake us through the eventfd from now on
+ *
+ * @ring: attached ring
+ *
+ * @returns 0 if the consumer can wait for the eventfd, or -1 if frames arrived
+ * in the meantime and the ring has to be drained first
+ *
+**/
+int ring_sleep(struct ring* ring);
+
+/**
+ * ring_wakeup_fd: eventfd that becomes readable when a sleeping consumer is
+ * woken up
+ *
+ * @ring: any ring
+ *
+ * @returns eventfd of ring
+ *
+**/
+int ring_wakeup_fd(struct ring* ring);
+
+/**
+ * ring_woken: clears the wakeup once the consumer is running again
+ *
+ * @ring: attached ring
+ *
+**/
+void ring_woken(struct ring* ring);
+
+/**
+ * free_ring: unmaps the ring and closes its fds. A consumer marks it
+ * detached first, so the producer goes back to datagrams
+ *
+ * @ring: ring to free
+ *
+**/
+void free_ring(struct ring* ring);
+
+#endif // RING_H
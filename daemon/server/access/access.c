@@ -1,76 +1,598 @@
+#define _GNU_SOURCE
+
 #include <string.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 
+#include "commslib/commslib.h"
+#include "loglib/loglib.h"
 #include "access.h"
 
+#define EMPTY_SLOT 0 // pid 0 is never a valid peer
+#define MIN_SLOTS 8
+#define PID_MAX_PATH "/proc/sys/kernel/pid_max"
+#define PID_MAX_LIMIT 4194304 // kernel ceiling for pid_max on 64 bit
+
+// The access store is an open-addressing hash set of pids with linear
+// probing. Deletion shifts later entries of the probe run back instead
+// of leaving tombstones, so lookups never scan past dead slots.
+//
+// The bitmap backend additionally keeps one bit per possible pid, so that
+// check_authentication is a single load and test. The hash set remains
+// the record of which pids are whitelisted, and is what pids beyond the
+// pid_max the bitmap was sized for are checked against.
+//
+// Each entry is bound to its process through a pidfd, which the store's
+// watcher can poll to revoke the entry the moment the process exits,
+// before the kernel can hand its pid to someone else.
+//
+// Several reactors share one store. Writers serialize on a mutex, while
+// check_authentication never locks: bitmap bits are updated atomically,
+// and hash set lookups are validated against a sequence counter that is
+// odd while a writer is moving entries around, retrying if it changed.
+// Tables replaced by a resize are kept until the store is freed, so a
+// lookup racing with a resize never reads freed memory.
+struct access_entry {
+  pid_t pid; // only ever stored atomically, as lookups read it unlocked
+  int pidfd; // -1 if the kernel does not support pidfds
+  uint64_t start_time; // in clock ticks since boot, from /proc/<pid>/stat
+
+  void* watch; // handle returned by the watcher, if any
+};
+
+struct access_table {
+  struct access_entry* slots;
+  size_t mask; // number of slots - 1, slots are a power of two
+  unsigned int shift; // 32 - log2(number of slots)
+
+  struct access_table* retired; // next older table replaced by a resize
+};
 
 struct access_store {
-  pid_t* whitelisted;
-  size_t whitelisted_size;
+  struct access_table* table;
+  size_t size;
+
+  uint64_t* bitmap; // NULL unless backed by ACCESS_BACKEND_BITMAP
+  uint32_t pid_max;
 
-  size_t capacity;
+  pthread_mutex_t lock; // serializes writers
+  uint32_t seq; // odd while a writer modifies the hash set
+  uint32_t revocations; // bumped whenever a pid loses access
+
+  struct access_watcher watcher;
 };
 
-struct access_store* new_access_store(size_t capacity) {
+/**
+ * modify_begin: marks the hash set as being modified, so that concurrent
+ * lookups retry. Writers only.
+ *
+ * @store: access store
+ *
+**/
+static inline void modify_begin(struct access_store* store);
+
+/**
+ * modify_end: marks the hash set as consistent again. Writers only.
+ *
+ * @store: access store
+ *
+**/
+static inline void modify_end(struct access_store* store);
+
+/**
+ * lookup: checks whether a pid is in the hash set, without locking
+ *
+ * @store: access store
+ * @process: pid to look for
+ *
+ * @returns 1 if present and 0 otherwise
+ *
+**/
+static uint8_t lookup(struct access_store* store, pid_t process);
+
+/**
+ * bind_entry: binds a new entry to the process currently running as its pid,
+ * and starts watching for the process' exit
+ *
+ * @store: access store
+ * @entry: entry to fill in
+ * @process: pid of process
+ *
+ * @returns -1 if the process is gone or 0 on success
+ *
+**/
+static int bind_entry(struct access_store* store, struct access_entry* entry, pid_t process);
+
+/**
+ * release_entry: stops watching an entry's process and closes its pidfd
+ *
+ * @store: access store
+ * @entry: entry to release
+ *
+**/
+static void release_entry(struct access_store* store, struct access_entry* entry);
+
+/**
+ * read_pid_max: reads the largest pid the kernel hands out, plus one
+ *
+ * @returns pid_max, or PID_MAX_LIMIT if it cannot be read
+ *
+**/
+static uint32_t read_pid_max();
+
+/**
+ * set_bit: updates the bitmap entry of a pid, if the store has a bitmap
+ * and the pid is within it
+ *
+ * @store: access store
+ * @process: pid whose bit to update
+ * @value: 1 to set the bit, 0 to clear it
+ *
+**/
+static inline void set_bit(struct access_store* store, pid_t process, int value);
+
+/**
+ * home_slot: returns the slot a pid hashes to
+ *
+ * @table: hash table
+ * @process: pid to hash
+ *
+**/
+static inline size_t home_slot(struct access_table* table, pid_t process);
+
+/**
+ * find_slot: probes for a pid. Writers only.
+ *
+ * @table: hash table
+ * @process: pid to look for
+ *
+ * @returns slot holding process, or the empty slot that ends its probe run
+*/
+static inline size_t find_slot(struct access_table* table, pid_t process);
+
+/**
+ * put_entry: copies an entry into a slot, publishing its pid last
+ *
+ * @slot: destination slot
+ * @entry: entry to copy
+ *
+*/
+static inline void put_entry(struct access_entry* slot, struct access_entry* entry);
+
+/**
+ * insert_entry: inserts an entry whose pid is known not to be in the store,
+ * growing it if needed
+ *
+ * @store: access store
+ * @entry: entry to insert
+ *
+ * @returns -1 on error or 0 on success
+*/
+static int insert_entry(struct access_store* store, struct access_entry* entry);
+
+/**
+ * delete_slot: empties a slot, shifting back the entries of its probe run
+ *
+ * @store: access store
+ * @slot: slot to delete
+ *
+*/
+static void delete_slot(struct access_store* store, size_t slot);
+
+/**
+ * resize: rehashes all entries into a new table with the given number of slots
+ *
+ * @store: access store
+ * @num_slots: new number of slots, a power of two
+ *
+ * @returns -1 on error or 0 on success
+*/
+static int resize(struct access_store* store, size_t num_slots);
+
+struct access_store* new_access_store(size_t capacity, enum access_backend backend) {
+  size_t num_slots;
+
   struct access_store* store = malloc(sizeof(struct access_store));
   if (!store) {
     return NULL;
   }
-  
-  pid_t* whitelisted = malloc(sizeof(pid_t) * capacity);
-  if (!whitelisted) {
+  memset(store, 0, sizeof(struct access_store));
+  pthread_mutex_init(&store->lock, NULL);
+
+  // keep the load factor at or below one half
+  num_slots = MIN_SLOTS;
+  while (num_slots < capacity * 2) {
+    num_slots <<= 1;
+  }
+
+  if (resize(store, num_slots) < 0) {
+    free(store);
     return NULL;
   }
-  memset(whitelisted, 0, sizeof(pid_t) * capacity);
-  
-  store->whitelisted = whitelisted;
-  store->whitelisted_size = 0;
-  store->capacity = capacity;
+
+  if (backend == ACCESS_BACKEND_BITMAP) {
+    store->pid_max = read_pid_max();
+    // zeroed pages are mapped lazily, so untouched pid ranges cost nothing
+    store->bitmap = calloc((store->pid_max + 63) / 64, sizeof(uint64_t));
+    if (!store->bitmap) {
+      free_access_store(store);
+      return NULL;
+    }
+  }
 
   return store;
 }
 
 void free_access_store(struct access_store* store) {
-  free(store->whitelisted);
+  struct access_table* table, *retired;
+
+  table = store->table;
+  for (size_t i = 0; i <= table->mask; i++) {
+    if (table->slots[i].pid != EMPTY_SLOT) {
+      release_entry(store, &table->slots[i]);
+    }
+  }
+
+  while (table) {
+    retired = table->retired;
+    free(table->slots);
+    free(table);
+    table = retired;
+  }
+
+  pthread_mutex_destroy(&store->lock);
+  free(store->bitmap);
   free(store);
 }
 
+void set_access_watcher(struct access_store* store, struct access_watcher* watcher) {
+  store->watcher = *watcher;
+}
+
+uint32_t access_revocations(struct access_store* store) {
+  return __atomic_load_n(&store->revocations, __ATOMIC_ACQUIRE);
+}
+
 uint8_t check_authentication(struct access_store* store, pid_t candidate) {
-  for (size_t i = 0; i < store->whitelisted_size; i++) {
-    if (store->whitelisted[i] == candidate) {
-      return 1;
-    }
+  // pid_max may have been raised since the bitmap was sized, pids past it
+  // are only in the hash set
+  if (store->bitmap && candidate >= 0 && (uint32_t) candidate < store->pid_max) {
+    return (__atomic_load_n(&store->bitmap[candidate >> 6], __ATOMIC_ACQUIRE) >> (candidate & 63)) & 1;
   }
-  return 0;
+
+  if (candidate == EMPTY_SLOT) {
+    return 0;
+  }
+  return lookup(store, candidate);
 }
 
 int authorize_new_process(struct access_store* store, pid_t process) {
-  for (size_t i = 0; i < store->whitelisted_size; i++) {
-    if (store->whitelisted[i] == process) {
-      fprintf(stderr, "process already authorized\n");
-      return -1;
+  struct access_entry entry;
+  int err;
+
+  if (process == EMPTY_SLOT) {
+    log_error("invalid pid");
+    return -1;
+  }
+
+  err = -1;
+  pthread_mutex_lock(&store->lock);
+
+  if (store->table->slots[find_slot(store->table, process)].pid == process) {
+    log_warn("process already authorized");
+    goto EXIT;
+  }
+
+  if (bind_entry(store, &entry, process) < 0) {
+    log_warn("process %d is gone", process);
+    goto EXIT;
+  }
+
+  if (insert_entry(store, &entry) < 0) {
+    log_error("access control store could not grow");
+    release_entry(store, &entry);
+    goto EXIT;
+  }
+  set_bit(store, process, 1);
+  log_info("authorized %d", process);
+  err = 0;
+
+  EXIT:
+    pthread_mutex_unlock(&store->lock);
+    return err;
+}
+
+int swap_processes(struct access_store* store, pid_t old_process, pid_t new_process) {
+  struct access_entry entry;
+  size_t slot;
+  int err;
+
+  if (old_process == EMPTY_SLOT || new_process == EMPTY_SLOT) {
+    return -1;
+  }
+
+  err = -1;
+  pthread_mutex_lock(&store->lock);
+
+  slot = find_slot(store->table, old_process);
+  if (store->table->slots[slot].pid != old_process) {
+    goto EXIT;
+  }
+  release_entry(store, &store->table->slots[slot]);
+  delete_slot(store, slot);
+  set_bit(store, old_process, 0);
+  __atomic_add_fetch(&store->revocations, 1, __ATOMIC_RELEASE);
+
+  if (store->table->slots[find_slot(store->table, new_process)].pid != new_process) {
+    if (bind_entry(store, &entry, new_process) < 0) {
+      log_warn("process %d is gone", new_process);
+      goto EXIT;
+    }
+    if (insert_entry(store, &entry) < 0) {
+      log_error("access control store could not grow");
+      release_entry(store, &entry);
+      goto EXIT;
     }
   }
-  if (store->whitelisted_size + 1 > store->capacity) {
-    fprintf(stderr, "access control store has reached capacity\n");
+  set_bit(store, new_process, 1);
+  log_info("authorized %d in place of %d", new_process, old_process);
+  err = 0;
+
+  EXIT:
+    pthread_mutex_unlock(&store->lock);
+    return err;
+}
+
+int revoke_process(struct access_store* store, pid_t process) {
+  size_t slot;
+  int err;
+
+  if (process == EMPTY_SLOT) {
     return -1;
   }
-  store->whitelisted[store->whitelisted_size] = process;
-  store->whitelisted_size++; 
-  printf("authorized %d\n", process);
 
-  return 0;
+  err = -1;
+  pthread_mutex_lock(&store->lock);
+
+  slot = find_slot(store->table, process);
+  if (store->table->slots[slot].pid != process) {
+    goto EXIT;
+  }
+  release_entry(store, &store->table->slots[slot]);
+  delete_slot(store, slot);
+  set_bit(store, process, 0);
+  __atomic_add_fetch(&store->revocations, 1, __ATOMIC_RELEASE);
+  log_info("revoked %d", process);
+  err = 0;
+
+  EXIT:
+    pthread_mutex_unlock(&store->lock);
+    return err;
 }
 
-int swap_processes(struct access_store* store, pid_t old_process, pid_t new_process) {
-  for (size_t i = 0; i < store->whitelisted_size; i++) {
-    if (store->whitelisted[i] == old_process) {
-      store->whitelisted[i] = new_process;
-      printf("authorized %d in place of %d\n", new_process, old_process);
+static inline void modify_begin(struct access_store* store) {
+  __atomic_store_n(&store->seq, store->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void modify_end(struct access_store* store) {
+  __atomic_store_n(&store->seq, store->seq + 1, __ATOMIC_RELEASE);
+}
+
+static uint8_t lookup(struct access_store* store, pid_t process) {
+  struct access_table* table;
+  uint32_t seq;
+  uint8_t found;
+  pid_t pid;
+  size_t slot;
+
+  do {
+    seq = __atomic_load_n(&store->seq, __ATOMIC_ACQUIRE);
+    table = __atomic_load_n(&store->table, __ATOMIC_ACQUIRE);
+
+    // tables are never more than half full, so the probe always ends
+    found = 0;
+    slot = home_slot(table, process);
+    for (size_t i = 0; i <= table->mask; i++) {
+      pid = __atomic_load_n(&table->slots[slot].pid, __ATOMIC_RELAXED);
+      if (pid == EMPTY_SLOT) {
+        break;
+      }
+      if (pid == process) {
+        found = 1;
+        break;
+      }
+      slot = (slot + 1) & table->mask;
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((seq & 1) || seq != __atomic_load_n(&store->seq, __ATOMIC_RELAXED));
+
+  return found;
+}
+
+static int bind_entry(struct access_store* store, struct access_entry* entry, pid_t process) {
+  uint64_t start_time;
+
+  memset(entry, 0, sizeof(struct access_entry));
+  entry->pid = process;
+
+  // reading the start time on both sides of pidfd_open proves the pidfd
+  // refers to the process we looked at, and not to a reused pid
+  entry->start_time = get_process_start_time(process);
+  if (entry->start_time == 0) {
+    return -1;
+  }
+
+  entry->pidfd = open_pidfd(process);
+  if (entry->pidfd < 0) {
+    // no pidfd support, entries only go away when explicitly revoked. Any
+    // other failure, e.g. ESRCH if it just exited, leaves the pid unbound
+    if (errno == ENOSYS) {
       return 0;
     }
-  } 
-  return -1;
+    return -1;
+  }
+
+  start_time = get_process_start_time(process);
+  if (start_time != entry->start_time) {
+    close(entry->pidfd);
+    return -1;
+  }
+
+  if (store->watcher.watch) {
+    entry->watch = store->watcher.watch(process, entry->pidfd, store->watcher.arg);
+  }
+
+  return 0;
+}
+
+static void release_entry(struct access_store* store, struct access_entry* entry) {
+  if (entry->watch && store->watcher.unwatch) {
+    store->watcher.unwatch(entry->watch, store->watcher.arg);
+  }
+  entry->watch = NULL;
+
+  if (entry->pidfd >= 0) {
+    close(entry->pidfd);
+  }
+  entry->pidfd = -1;
 }
 
+static uint32_t read_pid_max() {
+  FILE* f;
+  unsigned long pid_max;
+
+  f = fopen(PID_MAX_PATH, "r");
+  if (!f) {
+    return PID_MAX_LIMIT;
+  }
+  if (fscanf(f, "%lu", &pid_max) != 1 || pid_max == 0 || pid_max > PID_MAX_LIMIT) {
+    pid_max = PID_MAX_LIMIT;
+  }
+  fclose(f);
+
+  return (uint32_t) pid_max;
+}
+
+static inline void set_bit(struct access_store* store, pid_t process, int value) {
+  if (!store->bitmap || (uint32_t) process >= store->pid_max) {
+    return;
+  }
+
+  if (value) {
+    __atomic_fetch_or(&store->bitmap[process >> 6], UINT64_C(1) << (process & 63), __ATOMIC_RELEASE);
+  } else {
+    __atomic_fetch_and(&store->bitmap[process >> 6], ~(UINT64_C(1) << (process & 63)), __ATOMIC_RELEASE);
+  }
+}
+
+static inline size_t home_slot(struct access_table* table, pid_t process) {
+  // fibonacci hashing spreads the sequential pids the kernel hands out
+  return ((uint32_t) process * UINT32_C(2654435769)) >> table->shift;
+}
+
+static inline size_t find_slot(struct access_table* table, pid_t process) {
+  size_t slot;
+
+  slot = home_slot(table, process);
+  while (table->slots[slot].pid != EMPTY_SLOT && table->slots[slot].pid != process) {
+    slot = (slot + 1) & table->mask;
+  }
+  return slot;
+}
+
+static inline void put_entry(struct access_entry* slot, struct access_entry* entry) {
+  slot->pidfd = entry->pidfd;
+  slot->start_time = entry->start_time;
+  slot->watch = entry->watch;
+  __atomic_store_n(&slot->pid, entry->pid, __ATOMIC_RELAXED);
+}
+
+static int insert_entry(struct access_store* store, struct access_entry* entry) {
+  struct access_table* table;
+
+  table = store->table;
+  if ((store->size + 1) * 2 > table->mask + 1) {
+    if (resize(store, (table->mask + 1) * 2) < 0) {
+      return -1;
+    }
+    table = store->table;
+  }
+
+  modify_begin(store);
+  put_entry(&table->slots[find_slot(table, entry->pid)], entry);
+  modify_end(store);
+  store->size++;
+
+  return 0;
+}
+
+static void delete_slot(struct access_store* store, size_t slot) {
+  struct access_table* table;
+  size_t next, home;
+
+  table = store->table;
+  next = slot;
+  modify_begin(store);
+  while (1) {
+    next = (next + 1) & table->mask;
+    if (table->slots[next].pid == EMPTY_SLOT) {
+      break;
+    }
+
+    // an entry may fill the hole unless its home lies cyclically in (slot, next]
+    home = home_slot(table, table->slots[next].pid);
+    if ((next > slot && (home <= slot || home > next)) ||
+        (next < slot && (home <= slot && home > next))) {
+      put_entry(&table->slots[slot], &table->slots[next]);
+      slot = next;
+    }
+  }
+
+  __atomic_store_n(&table->slots[slot].pid, EMPTY_SLOT, __ATOMIC_RELAXED);
+  table->slots[slot].pidfd = -1;
+  table->slots[slot].start_time = 0;
+  table->slots[slot].watch = NULL;
+  modify_end(store);
+  store->size--;
+}
+
+static int resize(struct access_store* store, size_t num_slots) {
+  struct access_table* old_table, *table;
+
+  table = malloc(sizeof(struct access_table));
+  if (!table) {
+    return -1;
+  }
+  memset(table, 0, sizeof(struct access_table));
+
+  table->slots = calloc(num_slots, sizeof(struct access_entry));
+  if (!table->slots) {
+    free(table);
+    return -1;
+  }
+  table->mask = num_slots - 1;
+  table->shift = 32;
+  while (num_slots > 1) {
+    num_slots >>= 1;
+    table->shift--;
+  }
+
+  old_table = store->table;
+  if (old_table) {
+    for (size_t i = 0; i <= old_table->mask; i++) {
+      if (old_table->slots[i].pid != EMPTY_SLOT) {
+        table->slots[find_slot(table, old_table->slots[i].pid)] = old_table->slots[i];
+      }
+    }
+  }
+
+  // lookups may still be probing the old table, so it is retired, not freed
+  table->retired = old_table;
+  __atomic_store_n(&store->table, table, __ATOMIC_RELEASE);
+
+  return 0;
+}
@@ -13,18 +13,43 @@
 // The access store defines what processes can talk to the server via its
 // IPC socket. Incoming messages must have ancilliary data which informs
 // the requestor's pid, which can then be authrorized against the store.
+//
+// The store is shared by all reactors of a server. check_authentication
+// takes no lock and may run concurrently with anything; calls that change
+// the store are serialized by an internal mutex.
 
 struct access_store;
 
+// A watcher is told about the pidfd of every process the store authorizes, so
+// that it can call revoke_process as soon as that pidfd becomes readable,
+// i.e. as soon as the process exits.
+struct access_watcher {
+  // starts watching pidfd, returns a handle passed back to unwatch
+  void* (*watch)(pid_t process, int pidfd, void* arg);
+  // stops watching, called when the process' entry is revoked or swapped out
+  void (*unwatch)(void* handle, void* arg);
+  void* arg;
+};
+
+enum access_backend {
+  // hash set of pids, memory proportional to the number of whitelisted pids
+  ACCESS_BACKEND_HASH,
+  // hash set plus one bit per possible pid (512KiB at the default pid_max of
+  // 4M), so that checks are a single load and test
+  ACCESS_BACKEND_BITMAP,
+};
+
 /**
  * new_access_store: instantiate a new access store with a capacity
  *
- * @capacity: maximum number of whitelistable pids to hold
+ * @capacity: number of whitelisted pids to size the store for. The store
+ * grows past it as more processes are authorized.
+ * @backend: how check_authentication looks pids up
  *
  * @returns a new instance of access store. Caller must free after use by calling
  * free_access_store.
 **/
-struct access_store* new_access_store(size_t capcity);
+struct access_store* new_access_store(size_t capcity, enum access_backend backend);
 
 /**
  * free_access_store: free resources used by access store.
@@ -33,6 +58,15 @@ struct access_store* new_access_store(size_t capcity);
 */
 void free_access_store(struct access_store* store);
 
+/**
+ * set_access_watcher: registers the watcher to notify of authorized processes.
+ * Must be set before any process is authorized.
+ *
+ * @store: access store
+ * @watcher: watcher to copy into the store
+*/
+void set_access_watcher(struct access_store* store, struct access_watcher* watcher);
+
 /**
  * check_authentication: checks if a candidate process is whitelisted by the store
  * candidate: pid of iniquiring process
@@ -44,6 +78,17 @@ void free_access_store(struct access_store* store);
 */
 uint8_t check_authentication(struct access_store* store, pid_t candidate);
 
+/**
+ * access_revocations: counts the pids that lost access so far, so that a
+ * caller which checked a pid can keep trusting the result, without checking
+ * again, for as long as the count stays the same. Takes no lock
+ *
+ * @store: access store
+ *
+ * @returns number of revocations since the store was created
+*/
+uint32_t access_revocations(struct access_store* store);
+
 /**
  * swap_processes: revokes access and authorization of old_process, and insert new_process
  * with all of old_process' roles and auth.
@@ -57,13 +102,24 @@ uint8_t check_authentication(struct access_store* store, pid_t candidate);
 int swap_processes(struct access_store* store, pid_t old_process, pid_t new_process);
 
 /**
- * authorize_new_process: authorizes a new pid
+ * authorize_new_process: authorizes a new pid, binding it to the process
+ * currently running under it
  *
  * @store: access store
  * @process: pid of process to authorize handlers on
  *
- * @returns -1 on error or 0 on success
+ * @returns -1 on error or if process is not running, 0 on success
 */
 int authorize_new_process(struct access_store* store, pid_t process);
 
+/**
+ * revoke_process: revokes access and authorization of process
+ *
+ * @store: access store
+ * @process: pid of process to revoke
+ *
+ * @returns 0 on success or -1 if process does not exist
+*/
+int revoke_process(struct access_store* store, pid_t process);
+
 #endif
@@ -0,0 +1,114 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "commslib/commslib.h"
+#include "loglib/loglib.h"
+#include "dispatch.h"
+
+// Stats are bumped by every reactor, so each entry gets a cache line of its
+// own to keep reactors serving different RPCs from contending on it.
+struct dispatch_entry {
+  rpc_handler fn; // NULL if unregistered
+  unsigned int flags;
+
+  uint64_t calls;
+  uint64_t failures;
+  uint64_t ns;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct dispatch_table {
+  struct dispatch_entry entries[DISPATCH_SLOTS];
+};
+
+static uint64_t now_ns();
+
+struct dispatch_table* new_dispatch_table() {
+  struct dispatch_table* table;
+
+  table = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct dispatch_table));
+  if (!table) {
+    log_perror("no memory for dispatch table");
+    return NULL;
+  }
+  memset(table, 0, sizeof(struct dispatch_table));
+
+  return table;
+}
+
+void free_dispatch_table(struct dispatch_table* table) {
+  free(table);
+}
+
+int register_handler(struct dispatch_table* table, ns(Payload_union_type_t) type, rpc_handler fn, unsigned int flags) {
+  struct dispatch_entry* entry;
+
+  if (type == ns(Payload_NONE) || !fn) {
+    log_error("invalid handler for payload type %u", (unsigned int) type);
+    return -1;
+  }
+
+  entry = &table->entries[type];
+  entry->fn = fn;
+  entry->flags = flags;
+
+  return 0;
+}
+
+int handler_flags(struct dispatch_table* table, ns(Payload_union_type_t) type) {
+  struct dispatch_entry* entry;
+
+  entry = &table->entries[type];
+  if (!entry->fn) {
+    return -1;
+  }
+  return entry->flags;
+}
+
+size_t dispatch(struct dispatch_table* table, ns(Payload_union_type_t) type, struct rpc_context* ctx,
+                const void* req, uint8_t* buf, size_t cap) {
+  struct dispatch_entry* entry;
+  uint64_t start;
+  size_t len;
+
+  entry = &table->entries[type];
+  if (!entry->fn) {
+    log_error("no handler for payload type %u", (unsigned int) type);
+    return 0;
+  }
+
+  start = now_ns();
+  len = entry->fn(ctx, req, buf, cap);
+
+  __atomic_add_fetch(&entry->calls, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&entry->ns, now_ns() - start, __ATOMIC_RELAXED);
+  if (len == 0) {
+    __atomic_add_fetch(&entry->failures, 1, __ATOMIC_RELAXED);
+  }
+
+  return len;
+}
+
+int get_handler_stats(struct dispatch_table* table, ns(Payload_union_type_t) type, struct handler_stats* stats) {
+  struct dispatch_entry* entry;
+
+  entry = &table->entries[type];
+  if (!entry->fn) {
+    return -1;
+  }
+
+  stats->calls = __atomic_load_n(&entry->calls, __ATOMIC_RELAXED);
+  stats->failures = __atomic_load_n(&entry->failures, __ATOMIC_RELAXED);
+  stats->ns = __atomic_load_n(&entry->ns, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,135 @@
+/**
+ * Dispatch - RPC handler table
+ *
+ * Maps every Payload union type to the handler serving it, so routing a
+ * request is a single indexed call and adding an RPC is a handler plus a
+ * register_handler call, without touching the server core.
+ *
+ * Handlers are registered before the reactors start. From then on the
+ * table is only read, apart from the stats, which any reactor updates.
+ *
+ */
+
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "service_reader.h"
+#include "server/access/access.h"
+
+#undef ns
+#define ns(x) FLATBUFFERS_WRAP_NAMESPACE(service, x) // Specified in the schema.
+
+#define DISPATCH_SLOTS 256 // one per value of a Payload union type
+
+enum handler_flags {
+  // cheap enough to run on the reactor that received the request
+  HANDLER_INLINE = 0,
+  // may block or run long, so it is better served off the reactor
+  HANDLER_DEFERRED = 1 << 0,
+};
+
+// what a handler gets to serve a request with, besides the request
+struct rpc_context {
+  struct access_store* access;
+  uint64_t seq_num;
+  pid_t pid; // authenticated sender
+};
+
+/**
+ * rpc_handler: serves a request, rendering the response into buf
+ *
+ * @ctx: request context
+ * @req: payload table of the type the handler was registered for
+ * @buf: buffer to render the response into
+ * @cap: size of buf
+ *
+ * @returns size of the response, or 0 if there is none to send
+ *
+**/
+typedef size_t (*rpc_handler)(struct rpc_context* ctx, const void* req, uint8_t* buf, size_t cap);
+
+struct handler_stats {
+  uint64_t calls;
+  uint64_t failures; // calls that rendered no response
+  uint64_t ns; // total time spent in the handler
+};
+
+struct dispatch_table;
+
+/**
+ * new_dispatch_table: creates a table with no handlers registered
+ *
+ * @returns new table or NULL on error. Caller must free after use by
+ * calling free_dispatch_table
+ *
+**/
+struct dispatch_table* new_dispatch_table();
+
+/**
+ * free_dispatch_table: releases the table
+ *
+ * @table: table to free
+ *
+**/
+void free_dispatch_table(struct dispatch_table* table);
+
+/**
+ * register_handler: sets the handler serving a payload type, replacing any
+ * registered before
+ *
+ * @table: dispatch table
+ * @type: payload type, anything but Payload_NONE
+ * @fn: handler
+ * @flags: handler_flags
+ *
+ * @returns -1 on error, 0 otherwise
+ *
+**/
+int register_handler(struct dispatch_table* table, ns(Payload_union_type_t) type, rpc_handler fn, unsigned int flags);
+
+/**
+ * handler_flags: finds how the handler for a payload type wants to run
+ *
+ * @table: dispatch table
+ * @type: payload type
+ *
+ * @returns handler_flags of the handler, or -1 if none is registered
+ *
+**/
+int handler_flags(struct dispatch_table* table, ns(Payload_union_type_t) type);
+
+/**
+ * dispatch: serves a request with the handler registered for its type,
+ * accounting for it in the handler's stats
+ *
+ * @table: dispatch table
+ * @type: payload type of the request
+ * @ctx: request context
+ * @req: payload table of the request
+ * @buf: buffer to render the response into
+ * @cap: size of buf
+ *
+ * @returns size of the response, or 0 if there is none to send or no
+ * handler is registered for type
+ *
+**/
+size_t dispatch(struct dispatch_table* table, ns(Payload_union_type_t) type, struct rpc_context* ctx,
+                const void* req, uint8_t* buf, size_t cap);
+
+/**
+ * get_handler_stats: reads the stats of the handler for a payload type
+ *
+ * @table: dispatch table
+ * @type: payload type
+ * @stats: filled in with the stats so far
+ *
+ * @returns -1 if no handler is registered for type, 0 otherwise
+ *
+**/
+int get_handler_stats(struct dispatch_table* table, ns(Payload_union_type_t) type, struct handler_stats* stats);
+
+#endif // DISPATCH_H
@@ -1,41 +1,58 @@
 #include <stdio.h>
 
 #include "protolib/protolib.h"
+#include "loglib/loglib.h"
 
 #include "handlers.h"
 
-size_t handle_heartbeat_request(ns(HeartbeatRequest_table_t) hb_req, uint64_t seq_num, uint8_t** ret_buf) {
+int register_service_handlers(struct dispatch_table* table) {
+  if (register_handler(table, ns(Payload_HeartbeatRequest), handle_heartbeat_request, HANDLER_INLINE) < 0 ||
+      register_handler(table, ns(Payload_AuthorizeProcessRequest), handle_authorize_process_request, HANDLER_DEFERRED) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+size_t handle_heartbeat_request(struct rpc_context* ctx, const void* req, uint8_t* buf, size_t cap) {
   size_t buf_size;
 
-  buf_size = marshall_heartbeat_response(seq_num, ret_buf);
+  buf_size = marshall_heartbeat_response_into(ctx->seq_num, buf, cap);
 
   return buf_size;
 }
 
-size_t handle_authorize_process_request(struct access_store* access, ns(AuthorizeProcessRequest_table_t) req, uint64_t seq_num, uint8_t** ret_buf) {
+size_t handle_authorize_process_request(struct rpc_context* ctx, const void* req, uint8_t* buf, size_t cap) {
+  ns(AuthorizeProcessRequest_table_t) ap_table;
   struct authorize_process_request* ap_req;
   struct authorize_process_response ap_resp;
+  struct access_store* access;
   int auth_err;
 
-  ap_req = unmarshall_authorize_process_request(&req);
+  access = ctx->access;
+  ap_table = (ns(AuthorizeProcessRequest_table_t)) req;
+  ap_req = unmarshall_authorize_process_request(&ap_table);
   if (!ap_req) {
-    fprintf(stderr, "invalid authorize process request\n");
+    log_error("invalid authorize process request");
     return 0;
   }
 
   if (ap_req->old_pid == 0) {
     // we authorize the new process
     auth_err = authorize_new_process(access, ap_req->new_pid);
-  } else {
+  } else if (check_authentication(access, ap_req->old_pid)) {
     // we swap the old process with the new
     auth_err = swap_processes(access, ap_req->old_pid, ap_req->new_pid);
+  } else {
+    // the old process was already revoked when it exited
+    auth_err = authorize_new_process(access, ap_req->new_pid);
   }
 
+  free(ap_req);
+
   if (auth_err < 0) {
-    fprintf(stderr, "failed to reauth new process\n");
-    free(ap_req);
+    log_error("failed to reauth new process");
     return 0;
   }
 
-  return marshall_authorize_process_response(&ap_resp, seq_num, ret_buf);
+  return marshall_authorize_process_response_into(&ap_resp, ctx->seq_num, buf, cap);
 }
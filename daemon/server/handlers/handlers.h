@@ -3,11 +3,23 @@
 
 #include "service_reader.h"
 #include "server/access/access.h"
+#include "server/dispatch/dispatch.h"
 
 #undef ns
 #define ns(x) FLATBUFFERS_WRAP_NAMESPACE(service, x) // Specified in the schema.
 
-size_t handle_heartbeat_request(ns(HeartbeatRequest_table_t) hb_req, uint64_t seq_num, uint8_t** ret_buf);
-size_t handle_authorize_process_request(struct access_store* access, ns(AuthorizeProcessRequest_table_t) req, uint64_t seq_num, uint8_t** ret_buf);
+/**
+ * register_service_handlers: registers a handler for every request of the
+ * service schema. New RPCs go here
+ *
+ * @table: dispatch table
+ *
+ * @returns -1 on error, 0 otherwise
+ *
+**/
+int register_service_handlers(struct dispatch_table* table);
+
+size_t handle_heartbeat_request(struct rpc_context* ctx, const void* req, uint8_t* buf, size_t cap);
+size_t handle_authorize_process_request(struct rpc_context* ctx, const void* req, uint8_t* buf, size_t cap);
 
 #endif // HANDLERS_H
@@ -10,7 +10,11 @@
 #include <sys/socket.h>
 #include <fcntl.h>
 #include <sys/un.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <pthread.h>
 #include <event2/event.h>
+#include <event2/thread.h>
 
 #include "service_reader.h"
 #include "service_builder.h"
@@ -19,252 +23,1457 @@
 #include "access/access.h"
 #include "protolib/protolib.h"
 #include "commslib/commslib.h"
+#include "loglib/loglib.h"
+#include "ring/ring.h"
+#include "uring/uring.h"
+#include "workers/workers.h"
+#include "dispatch/dispatch.h"
 #include "handlers/handlers.h"
+#include "server.h"
 
-#define MAX_WHITELISTED_CAP 5
+#define RECV_BATCH_SIZE 32 // datagrams drained per recvmmsg call
+// Batches drained per wakeup before the other events of the loop get a turn.
+// A single batch bounds how long the control lane waits behind bulk traffic,
+// and costs nothing but an extra pass through the loop when the socket is
+// busy. The monitor may burst authorizations at startup, so it drains more.
+#define REACTOR_BUDGET 1
+#define CONTROL_BUDGET 4
+
+// Loops run the active events of the highest priority first. The control
+// lane goes ahead of everything else, including reactor 0's exit watches.
+#define NUM_PRIORITIES 2
+#define CONTROL_PRIORITY 0
+#define BULK_PRIORITY 1
+#define RING_BUDGET 128 // frames drained from a ring before others get a turn
+#define REACTOR_DEFERRED 64 // requests a reactor can have on workers at once
+
+#define URING_ENTRIES 256
+#define URING_BUFFERS 256 // datagrams the kernel can receive ahead of us
+#define URING_BUFFER_GROUP 0
+#define URING_REPLIES 128 // replies in flight at once
+#define URING_RECV_TAG 1 // user_data of the multishot receive
+#define URING_WAKE_TAG 2 // user_data of the poll on wake_fd
+#define URING_DONE_TAG 3 // user_data of the poll on completions, the rest are replies
 
 #undef ns
 #define ns(x) FLATBUFFERS_WRAP_NAMESPACE(service, x) // Specified in the schema.
 
-struct server_state {
-  struct sockaddr_un* server_address;
+// A reactor serves one shard of the server: it owns a bound socket, an
+// event loop and the buffers to drain it, and runs on its own thread.
+// Reactor 0 runs on the thread calling start_server, and its loop also
+// watches for the exit of authorized processes.
+//
+// The control lane is a reactor of its own for the monitor's requests, on
+// a socket no one else can flood. It has no loop of its own: its events
+// run on reactor 0's loop at a higher priority, so heartbeats never queue
+// behind bulk traffic, and within a budget, so they can't starve it either.
+struct reactor {
+  struct server_state* server;
+  size_t id;
   int fd;
+  uint8_t is_control;
+  int priority; // of its events
+  size_t budget; // batches drained per wakeup
 
-  struct access_store* access_control;
+  struct msg_batch* batch;
+  struct msg_batch* replies;
+  struct msg_batch* frame; // one slot ring frames are copied into
 
   struct event_base* evloop;
   struct event* connect_event;
+
+  // clients connected to a seqpacket reactor, only touched by its thread
+  struct connection* connections;
+  // rings offered by clients of this shard, only touched by its thread
+  struct ring_client* rings;
+
+  // requests of HANDLER_DEFERRED handlers, which come back from the
+  // workers through completions once served. NULL without workers, and on
+  // the control lane, which serves everything inline
+  struct completion_queue* completions;
+  struct event* completion_event;
+  struct deferred_request* deferred;
+  struct deferred_request* free_deferred;
+
+  // io_uring engine only, set up on the reactor's own thread
+  struct uring* uring;
+  struct uring_buffers* uring_bufs;
+  struct msg_pool* uring_replies; // held until their send completes
+  struct msghdr recv_hdr; // room for address and credentials in each buffer
+  int wake_fd; // written to stop the reactor
+  uint8_t stopping;
+
+  pthread_t thread;
+  uint8_t running; // thread was started
+};
+
+// A client of a seqpacket reactor. Its credentials were recorded by the
+// kernel when it connected, and it was checked against the access store
+// when accepted. It is only checked again once the store has revoked
+// someone, which catches a process whose access is gone but whose socket
+// lives on in a child it forked.
+struct connection {
+  struct reactor* reactor;
+  int fd;
+  struct ucred cred;
+  uint32_t revocations; // access_revocations as of the last check
+  // requests still on workers. A closed connection lives on, with fd -1,
+  // until they are all back
+  size_t deferred;
+
+  struct event* event;
+  struct connection* prev;
+  struct connection* next;
+};
+
+// A client sending its requests through a shared ring, which it offered
+// to the reactor its datagrams go to. It was authorized when it offered
+// it, and is checked again the same way as a connection. Replies still go
+// out as datagrams, to the address the offer came from.
+struct ring_client {
+  struct reactor* reactor;
+  struct ring* ring;
+  pid_t pid;
+  uint32_t revocations; // access_revocations as of the last check
+  struct sockaddr_un addr;
+  socklen_t addr_len;
+
+  struct event* event;
+  struct event* yield_event; // drains a busy ring again on the next pass
+  struct ring_client* prev;
+  struct ring_client* next;
 };
 
-struct client_metadata {
-  struct sockaddr_un* client;
+// A request served by a worker, copied off the reactor along with where its
+// reply goes: the connection it came in on, or else the address it came
+// from. The reactor sends the reply once the request is back.
+struct deferred_request {
+  struct work_item work;
+  struct reactor* reactor;
+  struct connection* conn;
+  struct sockaddr_un addr;
+  socklen_t addr_len;
 
-  pid_t client_pid;
-  uint32_t uid;
-  uint32_t gid;
+  ns(Payload_union_type_t) type;
+  struct rpc_context ctx;
+  size_t request_len;
+  size_t reply_len; // 0 if there is no reply to send
+  uint8_t request[MAX_MSG_SIZE];
+  uint8_t reply[MAX_MSG_SIZE];
+
+  struct deferred_request* next; // free list link
+};
+
+struct server_state {
+  // shared by all reactors, it never locks on checks
+  struct access_store* access_control;
+  pid_t monitor; // spawned the server, the only one the control lane serves
+  // read only once the reactors start, but for handler stats
+  struct dispatch_table* handlers;
+  // serves HANDLER_DEFERRED handlers, NULL to serve them inline
+  struct worker_pool* workers;
+  enum transport transport;
+  uint8_t on_uring; // reactors try io_uring first
 
-  uint8_t* buf;
-  size_t buf_len; 
+  struct reactor* reactors;
+  size_t num_reactors;
+  struct reactor* control; // NULL without a control socket
 };
 
-static struct server_state* server_init();
+// an authorized process whose exit we are waiting on
+struct pid_watch {
+  struct event* exit_event;
+  struct access_store* store;
+  pid_t pid;
+};
+
+static struct server_state* server_init(struct server_config* config);
 static void server_free(struct server_state* state);
 
+static void* watch_process(pid_t process, int pidfd, void* arg);
+static void unwatch_process(void* handle, void* arg);
+static void process_exit_handler(int pidfd, short evtype, void* arg);
+static void free_pid_watch(struct event* exit_event, void* arg);
+
+static int reactor_init(struct server_state* state, struct reactor* reactor, size_t id);
+static int reactor_bind(struct reactor* reactor, struct server_config* config);
+static void reactor_free(struct reactor* reactor);
+static uint8_t runs_on_uring(struct reactor* reactor);
+static struct event* reactor_event(struct reactor* reactor, int fd, short what, event_callback_fn cb, void* arg);
+static uint8_t may_serve(struct reactor* reactor, pid_t pid);
+static void* run_reactor(void* arg);
+static void* run_uring_reactor(void* arg);
+static int uring_reactor_init(struct reactor* reactor);
+static void uring_reactor_free(struct reactor* reactor);
+static int arm_receive(struct reactor* reactor);
+static int arm_wakeup(struct reactor* reactor);
+static int arm_completions(struct reactor* reactor);
+static void submit_uring_reply(struct reactor* reactor, struct msg_slot* reply, size_t reply_len);
+static struct io_uring_sqe* next_sqe(struct reactor* reactor);
+static void reap_completions(struct reactor* reactor);
+static void uring_receive(struct reactor* reactor, int res, uint32_t flags);
+static void uring_datagram(struct reactor* reactor, uint8_t* buf, size_t len);
+
 static void connect_handler(int listen_fd, short evtype, void* arg);
-static void process_message(int server_fd, struct server_state* state, struct client_metadata* md);
-static struct client_metadata* setup_client_metadata(struct msghdr* hdr, struct ucred* ucred_data);
+static void accept_handler(int listen_fd, short evtype, void* arg);
+static void connection_handler(int conn_fd, short evtype, void* arg);
+static void close_connection(struct connection* conn);
+static uint8_t still_authorized(struct server_state* state, pid_t pid, uint32_t* revocations);
+static void accept_ring(struct reactor* reactor, struct msg_slot* offer);
+static void ring_handler(int wakeup_fd, short evtype, void* arg);
+static int yield_ring(struct ring_client* client);
+static uint8_t loop_is_idle(struct reactor* reactor);
+static void close_ring_client(struct ring_client* client);
+static size_t handle_message(struct reactor* reactor, struct connection* conn, struct msg_slot* msg, uint8_t* reply, size_t reply_cap);
+static void process_message(struct reactor* reactor, struct connection* conn, struct msg_slot* msg);
+static void defer_message(struct reactor* reactor, struct connection* conn, struct msg_slot* msg_slot,
+                          ns(Message_table_t)* msg, ns(Payload_union_type_t) msg_type);
+static void run_deferred(struct work_item* item);
+static void completion_handler(int fd, short evtype, void* arg);
+static void drain_completions(struct reactor* reactor);
+static void finish_deferred(struct reactor* reactor, struct deferred_request* req, uint8_t send_reply);
 
-static size_t invoke_procedure(struct server_state* state, ns(Message_table_t)* msg, uint8_t** rendered_buf);
+static size_t invoke_procedure(struct server_state* state, ns(Message_table_t)* msg, pid_t sender, uint8_t* rendered_buf, size_t cap);
+static void print_handler_stats(struct server_state* state);
 static ns(Payload_union_type_t) route_message(uint8_t* msg_buf, size_t msg_buf_len, ns(Message_table_t)* valid_msg);
 
-struct server_state* new_server(char* addr) {
+struct server_state* new_server(struct server_config* config) {
   struct server_state* state;
-  int fd, enabled;
-  struct sockaddr_un server;
-  socklen_t len;
-  pid_t client_pid;
-  struct event_base* evloop;
 
-  state = server_init();
-  if (!state) {
-    perror("could not instantiate server");
+  // reactors authorize processes and register their exit watches on
+  // reactor 0's loop from their own threads
+  if (evthread_use_pthreads() < 0) {
+    log_perror("could not enable event loop threading");
     return NULL;
   }
 
-  fd = setup_datagram_socket(addr);
-  if (fd < 0) {
-    perror("failed to create socket");
-    server_free(state);
+  state = server_init(config);
+  if (!state) {
+    log_perror("could not instantiate server");
     return NULL;
   }
-  state->fd = fd;
 
-  evloop = event_base_new();
-  if (!evloop) {
-    perror("could not initialize event loop");
-    server_free(state);
-    return NULL;
+  if (init_message_templates() < 0) {
+    log_warn("heartbeats will be built from scratch");
   }
-  state->evloop = evloop;
-  
-  struct event* connect_event = event_new(evloop, fd, EV_READ | EV_PERSIST, connect_handler, (void*) state);
-  if (event_add(connect_event, NULL)) {
-    perror("failed to add event");
+
+  for (size_t i = 0; i < state->num_reactors; i++) {
+    if (reactor_bind(&state->reactors[i], config) < 0) {
+      server_free(state);
+      return NULL;
+    }
+  }
+  if (state->control && reactor_bind(state->control, config) < 0) {
     server_free(state);
     return NULL;
   }
-  state->connect_event = connect_event;
+
+  // datagrams and connections queue on the bound sockets until the reactors start
+  notify_ready();
 
   return state;
 }
 
 int start_server(struct server_state* state) {
-  printf("Starting server...\n");
-  if (event_base_dispatch(state->evloop)) {
-    perror("failed to start event loop");
-    return -1;
+  int err;
+
+  log_info("Starting server with %zu reactors...", state->num_reactors);
+  // on io_uring every reactor runs on a thread of its own, and this one
+  // only runs reactor 0's loop, for exit watches
+  for (size_t i = state->on_uring ? 0 : 1; i < state->num_reactors; i++) {
+    struct reactor* reactor = &state->reactors[i];
+
+    if (pthread_create(&reactor->thread, NULL, state->on_uring ? run_uring_reactor : run_reactor, (void*) reactor)) {
+      log_perror("failed to start reactor thread");
+      stop_server(state);
+      return -1;
+    }
+    reactor->running = 1;
   }
-  return 0;
+
+  err = 0;
+  if (event_base_loop(state->reactors[0].evloop, state->on_uring ? EVLOOP_NO_EXIT_ON_EMPTY : 0)) {
+    log_perror("failed to start event loop");
+    err = -1;
+  }
+  return err;
+}
+
+int server_register_handler(struct server_state* state, ns(Payload_union_type_t) type, rpc_handler fn, unsigned int flags) {
+  return register_handler(state->handlers, type, fn, flags);
 }
 
 void stop_server(struct server_state* state) {
-  printf("Server exiting...\n");
-  if (event_del(state->connect_event)) {
-    perror("failed to delete event");
-  }
-  event_base_free(state->evloop);
+  log_info("Server exiting...");
+  for (size_t i = 0; i < state->num_reactors; i++) {
+    struct reactor* reactor = &state->reactors[i];
 
-  close(state->fd);
+    event_base_loopbreak(reactor->evloop);
+    if (reactor->wake_fd >= 0) {
+      uint64_t one = 1;
+      if (write(reactor->wake_fd, &one, sizeof(one)) < 0) {
+        log_perror("failed to stop reactor");
+      }
+    }
+    if (reactor->running) {
+      pthread_join(reactor->thread, NULL);
+      reactor->running = 0;
+    }
+  }
 
+  print_handler_stats(state);
   server_free(state);
 }
 
-static void process_message(int server_fd, struct server_state* state, struct client_metadata* md) {
-  uint8_t* rendered_buf;
-  size_t rendered_buf_len;
+// handles a message from an authenticated sender, rendering its reply into
+// reply, or handing it to a worker if its handler is slow. conn is the
+// connection it came in on, if any. Returns the length of the reply, 0 if
+// there is none to send now
+static size_t handle_message(struct reactor* reactor, struct connection* conn, struct msg_slot* msg_slot,
+                             uint8_t* reply, size_t reply_cap) {
   ns(Message_table_t) msg;
   ns(Payload_union_type_t) msg_type;
+  size_t reply_len;
+  int flags;
 
-  if (!check_authentication(state->access_control, md->client_pid)) {
-    fprintf(stderr, "acess denied for %d\n", md->client_pid);
-    goto EXIT;
-  }
-  
-  msg_type = route_message(md->buf, md->buf_len, &msg);
+  msg_type = route_message(msg_slot->payload, msg_slot->md.len, &msg);
   if (msg_type < 0) {
-    perror("failed to match message");
-    goto EXIT;
+    log_perror("failed to match message");
+    return 0;
   }
 
-  rendered_buf_len = invoke_procedure(state, &msg, &rendered_buf);
+  flags = handler_flags(reactor->server->handlers, msg_type);
+  if (reactor->completions && flags >= 0 && (flags & HANDLER_DEFERRED)) {
+    defer_message(reactor, conn, msg_slot, &msg, msg_type);
+    return 0;
+  }
+
+  reply_len = invoke_procedure(reactor->server, &msg, msg_slot->md.pid, reply, reply_cap);
+  if (reply_len == 0) {
+    log_perror("message handling failed");
+  }
+  return reply_len;
+}
+
+// handles a message from an authenticated sender, queueing the reply to go
+// out on conn, or on the reactor's socket if it came in as a datagram
+static void process_message(struct reactor* reactor, struct connection* conn, struct msg_slot* msg_slot) {
+  uint8_t rendered_buf[MAX_MSG_SIZE];
+  size_t rendered_buf_len;
+
+  struct msg_metadata* md;
+
+  md = &msg_slot->md;
+  rendered_buf_len = handle_message(reactor, conn, msg_slot, rendered_buf, sizeof(rendered_buf));
   if (rendered_buf_len == 0) {
-    perror("message handling failed");
-    goto EXIT;
+    return;
+  }
+
+  // make room for the reply if this iteration already produced a full batch
+  if (batch_len(reactor->replies) == RECV_BATCH_SIZE) {
+    send_msgs(conn ? conn->fd : reactor->fd, reactor->replies);
+  }
+
+  // replies on a connection need no address
+  if (queue_msg(reactor->replies, md->addr_len ? &msg_slot->addr : NULL, md->addr_len,
+                rendered_buf, rendered_buf_len) < 0) {
+    log_error("failed to queue response");
+  }
+}
+
+// copies a request off the reactor for a worker to serve. The request was
+// verified on receipt, and the copy is only read by the worker
+static void defer_message(struct reactor* reactor, struct connection* conn, struct msg_slot* msg_slot,
+                          ns(Message_table_t)* msg, ns(Payload_union_type_t) msg_type) {
+  struct deferred_request* req;
+
+  req = reactor->free_deferred;
+  if (!req) {
+    log_warn("too many slow requests, dropped one from %d", msg_slot->md.pid);
+    return;
+  }
+  reactor->free_deferred = req->next;
+
+  req->conn = conn;
+  memcpy(&req->addr, &msg_slot->addr, msg_slot->md.addr_len);
+  req->addr_len = msg_slot->md.addr_len;
+  req->type = msg_type;
+  req->ctx.access = reactor->server->access_control;
+  req->ctx.seq_num = ns(Message_seq_num_get(*msg));
+  req->ctx.pid = msg_slot->md.pid;
+  req->request_len = msg_slot->md.len;
+  memcpy(req->request, msg_slot->payload, msg_slot->md.len);
+  req->reply_len = 0;
+
+  if (submit_work(reactor->server->workers, &req->work) < 0) {
+    log_warn("workers are busy, dropped request from %d", msg_slot->md.pid);
+    req->next = reactor->free_deferred;
+    reactor->free_deferred = req;
+    return;
+  }
+  if (conn) {
+    conn->deferred++;
+  }
+}
+
+// serves a deferred request, on a worker
+static void run_deferred(struct work_item* item) {
+  struct deferred_request* req;
+  ns(Message_table_t) msg;
+
+  req = (struct deferred_request*) item;
+  log_debug("Handling request %lu on a worker", (unsigned long) req->ctx.seq_num);
+
+  msg = ns(Message_as_root(req->request));
+  req->reply_len = dispatch(req->reactor->server->handlers, req->type, &req->ctx, ns(Message_payload_get(msg)),
+                            req->reply, sizeof(req->reply));
+}
+
+static void completion_handler(int fd, short evtype, void* arg) {
+  struct reactor* reactor;
+
+  reactor = (struct reactor*) arg;
+  drain_completions(reactor);
+
+  if (batch_len(reactor->replies) > 0) {
+    send_msgs(reactor->fd, reactor->replies);
   }
+}
+
+static void drain_completions(struct reactor* reactor) {
+  struct work_item* item;
 
-  if (connect_to_destination(server_fd, md->client) < 0) {
-    perror("could not connect to client");
-    goto EXIT;
+  completions_woken(reactor->completions);
+  while ((item = pop_completion(reactor->completions))) {
+    finish_deferred(reactor, (struct deferred_request*) item, 1);
   }
+}
+
+// sends the reply of a request back from a worker, unless its connection
+// closed in the meantime, and takes the request back
+static void finish_deferred(struct reactor* reactor, struct deferred_request* req, uint8_t send_reply) {
+  struct connection* conn;
+  struct msg_slot* reply;
 
-  if (send_msg(server_fd, rendered_buf, rendered_buf_len) < 0) {
-    perror("failed to send response");
+  conn = req->conn;
+  if (!send_reply || req->reply_len == 0) {
+    // nothing to send
+  } else if (conn) {
+    if (conn->fd >= 0 && send(conn->fd, req->reply, req->reply_len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+      log_perror("failed to send reply");
+    }
+  } else if (reactor->uring) {
+    reply = acquire_slot(reactor->uring_replies);
+    if (reply) {
+      memcpy(reply->payload, req->reply, req->reply_len);
+      memcpy(&reply->addr, &req->addr, req->addr_len);
+      reply->hdr.msg_namelen = req->addr_len;
+      submit_uring_reply(reactor, reply, req->reply_len);
+    } else {
+      log_warn("too many replies in flight, dropped reply");
+    }
+  } else {
+    if (batch_len(reactor->replies) == RECV_BATCH_SIZE) {
+      send_msgs(reactor->fd, reactor->replies);
+    }
+    if (queue_msg(reactor->replies, &req->addr, req->addr_len, req->reply, req->reply_len) < 0) {
+      log_error("failed to queue response");
+    }
   }
 
-  EXIT:
-    free(md);
+  req->next = reactor->free_deferred;
+  reactor->free_deferred = req;
+
+  if (conn && --conn->deferred == 0 && conn->fd < 0) {
+    close_connection(conn);
+  }
 }
 
 static void connect_handler(int fd, short evtype, void* arg) {
-  struct msghdr* hdr; 
-  struct iovec iov[1];
-  struct client_metadata* md;
-  struct server_state* state;
-  struct ucred* ucred_data;
-  int bytes_read;
+  struct reactor* reactor;
+  size_t batches;
+  int received;
 
-  state = (struct server_state*) arg;
+  reactor = (struct reactor*) arg;
+  batches = 0;
+
+  // Drain the socket: a short batch means recvmmsg already hit EAGAIN. Past
+  // the budget, the event stays ready and runs again on the next iteration,
+  // once the other events had their turn
+  do {
+    received = receive_msgs(fd, reactor->batch, RECV_BATCH_SIZE);
+    if (received < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_perror("failed to receive messages");
+      }
+      break;
+    }
+
+    for (int i = 0; i < received; i++) {
+      struct msg_slot* msg_slot = batch_slot(reactor->batch, i);
 
-  bytes_read = receive_msg(fd, &hdr);
-  if (bytes_read <= 0) {
-    perror("failed to receive message");
+      if (!msg_slot->md.has_credentials) {
+        log_warn("empty or invalid credentials");
+        continue;
+      }
+      if (!may_serve(reactor, msg_slot->md.pid)) {
+        log_warn("acess denied for %d", msg_slot->md.pid);
+        continue;
+      }
+      // requests never carry fds, only ring offers do, and the monitor
+      // has no use for a ring
+      if (msg_slot->md.num_fds > 0) {
+        if (!reactor->is_control) {
+          accept_ring(reactor, msg_slot);
+        }
+        continue;
+      }
+      process_message(reactor, NULL, msg_slot);
+    }
+  } while (received == RECV_BATCH_SIZE && ++batches < reactor->budget);
+
+  // replies produced during this iteration go out together
+  if (batch_len(reactor->replies) > 0) {
+    send_msgs(fd, reactor->replies);
+  }
+}
+
+static void accept_handler(int listen_fd, short evtype, void* arg) {
+  struct reactor* reactor;
+  struct connection* conn;
+  struct ucred cred;
+  int fd;
+
+  reactor = (struct reactor*) arg;
+
+  while ((fd = accept_connection(listen_fd, &cred)) >= 0) {
+    // read before the check, so a revocation racing with it is noticed later
+    uint32_t revocations = access_revocations(reactor->server->access_control);
+
+    if (!may_serve(reactor, cred.pid)) {
+      log_warn("acess denied for %d", cred.pid);
+      close(fd);
+      continue;
+    }
+
+    conn = calloc(1, sizeof(struct connection));
+    if (!conn) {
+      log_error("no memory to serve %d", cred.pid);
+      close(fd);
+      continue;
+    }
+    conn->reactor = reactor;
+    conn->fd = fd;
+    conn->cred = cred;
+    conn->revocations = revocations;
+
+    conn->event = reactor_event(reactor, fd, EV_READ | EV_PERSIST, connection_handler, (void*) conn);
+    if (!conn->event || event_add(conn->event, NULL)) {
+      log_error("failed to serve %d", cred.pid);
+      close_connection(conn);
+      continue;
+    }
+
+    conn->next = reactor->connections;
+    if (conn->next) {
+      conn->next->prev = conn;
+    }
+    reactor->connections = conn;
+  }
+
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EACCES) {
+    log_perror("failed to accept connection");
+  }
+}
+
+static void connection_handler(int fd, short evtype, void* arg) {
+  struct connection* conn;
+  struct reactor* reactor;
+  size_t batches;
+  uint8_t closed;
+  int received;
+
+  conn = (struct connection*) arg;
+  reactor = conn->reactor;
+
+  batches = 0;
+  closed = 0;
+  do {
+    received = receive_conn_msgs(fd, reactor->batch, RECV_BATCH_SIZE, &conn->cred);
+    if (received < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_perror("failed to receive messages");
+        closed = 1;
+      }
+      break;
+    }
+    if (received == 0) {
+      closed = 1;
+      break;
+    }
+
+    if (!still_authorized(reactor->server, conn->cred.pid, &conn->revocations)) {
+      log_warn("acess revoked for %d", conn->cred.pid);
+      closed = 1;
+      break;
+    }
+
+    for (int i = 0; i < received; i++) {
+      process_message(reactor, conn, batch_slot(reactor->batch, i));
+    }
+  } while (received == RECV_BATCH_SIZE && ++batches < reactor->budget);
+
+  if (batch_len(reactor->replies) > 0) {
+    send_msgs(fd, reactor->replies);
+  }
+
+  if (closed) {
+    close_connection(conn);
+  }
+}
+
+// a single load, unless someone lost access since pid was last checked
+static uint8_t still_authorized(struct server_state* state, pid_t pid, uint32_t* revocations) {
+  uint32_t current;
+
+  current = access_revocations(state->access_control);
+  if (current == *revocations) {
+    return 1;
+  }
+
+  if (!check_authentication(state->access_control, pid)) {
+    return 0;
+  }
+  *revocations = current;
+  return 1;
+}
+
+// Takes a ring offered by an authorized client in place of any it offered
+// before, and drains whatever it already holds.
+static void accept_ring(struct reactor* reactor, struct msg_slot* offer) {
+  struct ring_client* client;
+  struct ring* ring;
+  uint32_t revocations;
+
+  if (offer->md.num_fds != RING_FDS) {
+    log_warn("unexpected fds from %d", offer->md.pid);
+    return;
+  }
+  revocations = access_revocations(reactor->server->access_control);
+
+  // the ring owns the fds from here on, whether it takes them or not
+  offer->md.num_fds = 0;
+  ring = attach_ring((struct ring_offer*) offer->payload, offer->md.len, offer->md.fds[0], offer->md.fds[1]);
+  if (!ring) {
+    return;
+  }
+
+  for (client = reactor->rings; client; client = client->next) {
+    if (client->pid == offer->md.pid) {
+      close_ring_client(client);
+      break;
+    }
   }
 
-  if (!(ucred_data = get_header_credentials(hdr))) {
-    fprintf(stderr, "empty or invalid credentials\n");
-    free(hdr);
+  client = calloc(1, sizeof(struct ring_client));
+  if (!client) {
+    log_error("no memory to serve %d over a ring", offer->md.pid);
+    free_ring(ring);
     return;
   }
+  client->reactor = reactor;
+  client->ring = ring;
+  client->pid = offer->md.pid;
+  client->revocations = revocations;
+  memcpy(&client->addr, &offer->addr, offer->md.addr_len);
+  client->addr_len = offer->md.addr_len;
 
-  md = setup_client_metadata(hdr, ucred_data);
-  if (!md) {
-    free(hdr);
+  client->event = reactor_event(reactor, ring_wakeup_fd(ring), EV_READ | EV_PERSIST, ring_handler, (void*) client);
+  client->yield_event = reactor_event(reactor, -1, 0, ring_handler, (void*) client);
+  if (!client->event || !client->yield_event || event_add(client->event, NULL)) {
+    log_error("failed to serve %d over a ring", client->pid);
+    close_ring_client(client);
     return;
   }
 
-  process_message(fd, state, md);
+  client->next = reactor->rings;
+  if (client->next) {
+    client->next->prev = client;
+  }
+  reactor->rings = client;
+
+  log_info("serving %d over a shared ring", client->pid);
+  if (yield_ring(client) < 0) {
+    log_error("failed to serve %d over a ring", client->pid);
+    close_ring_client(client);
+  }
 }
 
-static struct client_metadata* setup_client_metadata(struct msghdr* hdr, struct ucred* ucred_data) {
-  struct client_metadata* md;
+// Drains frames until the ring stays empty for a short spin, then asks to be
+// woken through the eventfd. It only spins while nothing else on the loop is
+// waiting to run. A busy ring yields to the rest of the loop after
+// RING_BUDGET frames, and is drained again on its next pass.
+static void ring_handler(int wakeup_fd, short evtype, void* arg) {
+  struct ring_client* client;
+  struct reactor* reactor;
+  struct msg_slot* frame;
+  ssize_t len;
+  int handled;
 
-  md = malloc(sizeof(struct client_metadata));
-  if (!md) {
-    fprintf(stderr, "no memory for client md\n");
-    return NULL;
+  client = (struct ring_client*) arg;
+  reactor = client->reactor;
+  len = 0;
+
+  if (evtype & EV_READ) {
+    ring_woken(client->ring);
+  }
+
+  if (!still_authorized(reactor->server, client->pid, &client->revocations)) {
+    log_warn("acess revoked for %d", client->pid);
+    close_ring_client(client);
+    return;
+  }
+
+  frame = batch_slot(reactor->frame, 0);
+  for (handled = 0; handled < RING_BUDGET; handled++) {
+    len = ring_pop(client->ring, frame->payload, sizeof(frame->payload));
+    if (len < 0) {
+      if (errno == EAGAIN && loop_is_idle(reactor) && ring_spin(client->ring)) {
+        continue;
+      }
+      break;
+    }
+
+    memset(&frame->md, 0, sizeof(struct msg_metadata));
+    frame->md.len = len;
+    frame->md.has_credentials = 1;
+    frame->md.pid = client->pid;
+    memcpy(&frame->addr, &client->addr, client->addr_len);
+    frame->md.addr_len = client->addr_len;
+    process_message(reactor, NULL, frame);
+  }
+
+  if (batch_len(reactor->replies) > 0) {
+    send_msgs(reactor->fd, reactor->replies);
+  }
+
+  if (len < 0 && errno == EBADMSG) {
+    log_warn("ring of %d is corrupt", client->pid);
+    close_ring_client(client);
+    return;
+  }
+  if ((handled == RING_BUDGET || ring_sleep(client->ring) < 0) && yield_ring(client) < 0) {
+    log_error("failed to reschedule the ring of %d", client->pid);
+    close_ring_client(client);
+  }
+}
+
+// Runs the handler again once the loop has polled for other events. Made
+// active right away, it would run again in the same pass, ahead of them.
+static int yield_ring(struct ring_client* client) {
+  struct timeval no_wait = {0, 0};
+
+  return event_add(client->yield_event, &no_wait);
+}
+
+// Whether no other event of the loop is ready to run. Sockets that became
+// readable since the loop last polled don't show yet, which is why a spin
+// is kept short.
+static uint8_t loop_is_idle(struct reactor* reactor) {
+  return event_base_get_num_events(reactor->evloop, EVENT_BASE_COUNT_ACTIVE) == 0;
+}
+
+static void close_ring_client(struct ring_client* client) {
+  struct reactor* reactor;
+
+  reactor = client->reactor;
+  if (client->event) {
+    event_free(client->event);
+  }
+  if (client->yield_event) {
+    event_free(client->yield_event);
   }
-  memset(md, 0, sizeof(struct client_metadata));
+  free_ring(client->ring);
 
-  md->gid = ucred_data->gid;
-  md->uid = ucred_data->uid;
-  md->client_pid = (pid_t) ucred_data->pid;
+  if (client->prev) {
+    client->prev->next = client->next;
+  } else if (reactor->rings == client) {
+    reactor->rings = client->next;
+  }
+  if (client->next) {
+    client->next->prev = client->prev;
+  }
+  free(client);
+}
 
-  md->client = hdr->msg_name;
+static void close_connection(struct connection* conn) {
+  struct reactor* reactor;
 
-  md->buf = hdr->msg_iov[0].iov_base;
-  md->buf_len = hdr->msg_iov[0].iov_len;
+  reactor = conn->reactor;
+  if (conn->event) {
+    event_free(conn->event);
+    conn->event = NULL;
+  }
+  if (conn->fd >= 0) {
+    close(conn->fd);
+    conn->fd = -1;
+  }
+  // the last of its requests to come back from the workers frees it
+  if (conn->deferred > 0) {
+    return;
+  }
 
-  return md;
+  if (conn->prev) {
+    conn->prev->next = conn->next;
+  } else if (reactor->connections == conn) {
+    reactor->connections = conn->next;
+  }
+  if (conn->next) {
+    conn->next->prev = conn->prev;
+  }
+  free(conn);
 }
 
-static struct server_state* server_init() {
+static struct server_state* server_init(struct server_config* config) {
   struct server_state* state = malloc(sizeof(struct server_state));
   if (!state) {
     return NULL;
   }
   memset(state, 0, sizeof(struct server_state));
 
-  struct access_store* access_control = new_access_store(MAX_WHITELISTED_CAP);
+  state->transport = config->transport;
+  state->on_uring = config->io_engine == IO_ENGINE_URING && config->transport == TRANSPORT_DATAGRAM;
+  state->num_reactors = config->num_reactors > 0 ? config->num_reactors : 1;
+  state->reactors = calloc(state->num_reactors, sizeof(struct reactor));
+  if (!state->reactors) {
+    server_free(state);
+    return NULL;
+  }
+
+  // each reactor can have REACTOR_DEFERRED requests out, so the pool's
+  // queue never turns one away
+  if (config->num_workers > 0) {
+    state->workers = new_worker_pool(config->num_workers, state->num_reactors * REACTOR_DEFERRED);
+    if (!state->workers) {
+      log_error("could not start workers");
+      server_free(state);
+      return NULL;
+    }
+  }
+
+  for (size_t i = 0; i < state->num_reactors; i++) {
+    if (reactor_init(state, &state->reactors[i], i) < 0) {
+      server_free(state);
+      return NULL;
+    }
+  }
+
+  struct access_store* access_control = new_access_store(config->access_capacity, config->access_backend);
   if (!access_control) {
     server_free(state);
     return NULL;
   }
+  state->access_control = access_control;
+
+  // entries are revoked as soon as their process exits
+  struct access_watcher watcher = {
+    .watch = watch_process,
+    .unwatch = unwatch_process,
+    .arg = (void*) state,
+  };
+  set_access_watcher(access_control, &watcher);
   
-  if (authorize_new_process(access_control, getppid()) < 0) {
-    perror("failed to authorize parent process");
+  state->monitor = getppid();
+  if (authorize_new_process(access_control, state->monitor) < 0) {
+    log_perror("failed to authorize parent process");
     server_free(state);
     return NULL;
   } 
-  state->access_control = access_control;
+
+  state->handlers = new_dispatch_table();
+  if (!state->handlers || register_service_handlers(state->handlers) < 0) {
+    log_error("failed to register handlers");
+    server_free(state);
+    return NULL;
+  }
+
+  if (config->control_addr) {
+    state->control = calloc(1, sizeof(struct reactor));
+    if (!state->control) {
+      server_free(state);
+      return NULL;
+    }
+    state->control->is_control = 1;
+    if (reactor_init(state, state->control, state->num_reactors) < 0) {
+      server_free(state);
+      return NULL;
+    }
+  }
 
   return state;
 }
 
-static size_t invoke_procedure(struct server_state* state, ns(Message_table_t)* msg, uint8_t** rendered_buf) {
-  int seq_num;
-  size_t len;
+static int reactor_init(struct server_state* state, struct reactor* reactor, size_t id) {
+  reactor->server = state;
+  reactor->id = id;
+  reactor->fd = -1;
+  reactor->wake_fd = -1;
+
+  if (reactor->is_control) {
+    reactor->evloop = state->reactors[0].evloop;
+    reactor->priority = CONTROL_PRIORITY;
+    reactor->budget = CONTROL_BUDGET;
+  } else {
+    reactor->evloop = event_base_new();
+    if (!reactor->evloop || event_base_priority_init(reactor->evloop, NUM_PRIORITIES) < 0) {
+      log_perror("could not initialize event loop");
+      return -1;
+    }
+    reactor->priority = BULK_PRIORITY;
+    reactor->budget = REACTOR_BUDGET;
+  }
+
+  reactor->batch = new_msg_batch(RECV_BATCH_SIZE);
+  reactor->replies = new_msg_batch(RECV_BATCH_SIZE);
+  reactor->frame = new_msg_batch(1);
+  if (!reactor->batch || !reactor->replies || !reactor->frame) {
+    return -1;
+  }
 
-  seq_num = ns(Message_seq_num_get(*msg));
-  printf("Handling request %d\n", seq_num);
+  // the monitor's authorizations would wait behind bulk clients' slow
+  // requests on the workers, or be dropped if they are busy
+  if (state->workers && !reactor->is_control) {
+    reactor->deferred = calloc(REACTOR_DEFERRED, sizeof(struct deferred_request));
+    reactor->completions = new_completion_queue();
+    if (!reactor->deferred || !reactor->completions) {
+      log_perror("could not set up slow request handling");
+      return -1;
+    }
+    for (size_t i = 0; i < REACTOR_DEFERRED; i++) {
+      struct deferred_request* req = &reactor->deferred[i];
 
-  switch (ns(Message_payload_type_get(*msg))) {
-    case ns(Payload_HeartbeatRequest): {
-      ns(HeartbeatRequest_table_t) hb_req = ns(Message_payload_get(*msg));
-      len = handle_heartbeat_request(hb_req, seq_num, rendered_buf);
-      break;
+      req->work.run = run_deferred;
+      req->work.done = reactor->completions;
+      req->reactor = reactor;
+      req->next = reactor->free_deferred;
+      reactor->free_deferred = req;
     }
-    case ns(Payload_AuthorizeProcessRequest): {
-      ns(AuthorizeProcessRequest_table_t) auth_req = ns(Message_payload_get(*msg));
-      len = handle_authorize_process_request(state->access_control, auth_req, seq_num, rendered_buf);
+
+    // only added if the reactor falls back from io_uring
+    reactor->completion_event = reactor_event(reactor, completion_queue_fd(reactor->completions),
+                                              EV_READ | EV_PERSIST, completion_handler, (void*) reactor);
+    if (!reactor->completion_event || (!runs_on_uring(reactor) && event_add(reactor->completion_event, NULL))) {
+      log_perror("could not add completion event");
+      return -1;
+    }
+  }
+
+  if (runs_on_uring(reactor)) {
+    reactor->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (reactor->wake_fd < 0) {
+      log_perror("could not create reactor wakeup");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int reactor_bind(struct reactor* reactor, struct server_config* config) {
+  char path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+  event_callback_fn handler;
+  char* bind_path;
+
+  if (config->fds && !reactor->is_control) {
+    reactor->fd = config->fds[reactor->id];
+    // clients learn the credentials of whoever last called listen, which
+    // has to be us rather than whoever bound the socket
+    if (config->transport == TRANSPORT_SEQPACKET && listen(reactor->fd, SOMAXCONN) < 0) {
+      log_perror("failed to listen");
+      return -1;
+    }
+  } else {
+    // the control socket is never handed over, the monitor reconnects to it
+    if (reactor->is_control) {
+      bind_path = config->control_addr;
+    } else if (shard_path(config->addr, reactor->id, reactor->server->num_reactors, path, sizeof(path)) < 0) {
+      return -1;
+    } else {
+      bind_path = path;
+    }
+
+    if (config->transport == TRANSPORT_SEQPACKET) {
+      reactor->fd = setup_seqpacket_listener(bind_path);
+    } else {
+      reactor->fd = setup_datagram_socket(bind_path);
+    }
+    if (reactor->fd < 0) {
+      log_perror("failed to create socket");
+      return -1;
+    }
+  }
+
+  handler = config->transport == TRANSPORT_SEQPACKET ? accept_handler : connect_handler;
+  reactor->connect_event = reactor_event(reactor, reactor->fd, EV_READ | EV_PERSIST, handler, (void*) reactor);
+  // only added if the reactor falls back from io_uring
+  if (!reactor->connect_event || (!runs_on_uring(reactor) && event_add(reactor->connect_event, NULL))) {
+    log_perror("failed to add event");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void reactor_free(struct reactor* reactor) {
+  struct work_item* item;
+
+  // the workers are gone, so whatever they served is back by now
+  if (reactor->completions) {
+    while ((item = pop_completion(reactor->completions))) {
+      finish_deferred(reactor, (struct deferred_request*) item, 0);
+    }
+  }
+  while (reactor->connections) {
+    close_connection(reactor->connections);
+  }
+  while (reactor->rings) {
+    close_ring_client(reactor->rings);
+  }
+  if (reactor->connect_event) {
+    event_free(reactor->connect_event);
+  }
+  if (reactor->fd >= 0) {
+    close(reactor->fd);
+  }
+  if (reactor->batch) {
+    free_msg_batch(reactor->batch);
+  }
+  if (reactor->replies) {
+    free_msg_batch(reactor->replies);
+  }
+  if (reactor->frame) {
+    free_msg_batch(reactor->frame);
+  }
+  if (reactor->wake_fd >= 0) {
+    close(reactor->wake_fd);
+  }
+  if (reactor->completion_event) {
+    event_free(reactor->completion_event);
+  }
+  if (reactor->completions) {
+    free_completion_queue(reactor->completions);
+  }
+  free(reactor->deferred);
+  // the control lane only borrows reactor 0's loop
+  if (reactor->evloop && !reactor->is_control) {
+    event_base_free(reactor->evloop);
+  }
+}
+
+// the control lane stays on libevent, where it can be given priority
+static uint8_t runs_on_uring(struct reactor* reactor) {
+  return reactor->server->on_uring && !reactor->is_control;
+}
+
+// creates an event on the reactor's loop, at the priority of its lane
+static struct event* reactor_event(struct reactor* reactor, int fd, short what, event_callback_fn cb, void* arg) {
+  struct event* ev;
+
+  ev = event_new(reactor->evloop, fd, what, cb, arg);
+  if (ev && event_priority_set(ev, reactor->priority) < 0) {
+    event_free(ev);
+    return NULL;
+  }
+  return ev;
+}
+
+// the control lane only serves the monitor, anyone authorized may use the rest
+static uint8_t may_serve(struct reactor* reactor, pid_t pid) {
+  if (reactor->is_control && pid != reactor->server->monitor) {
+    return 0;
+  }
+  return check_authentication(reactor->server->access_control, pid);
+}
+
+static void* run_reactor(void* arg) {
+  struct reactor* reactor;
+
+  reactor = (struct reactor*) arg;
+  if (event_base_dispatch(reactor->evloop)) {
+    log_error("reactor %zu event loop failed", reactor->id);
+  }
+
+  return NULL;
+}
+
+// runs a datagram reactor on io_uring, or on its libevent loop if the
+// kernel can't give it one
+static void* run_uring_reactor(void* arg) {
+  struct reactor* reactor;
+
+  reactor = (struct reactor*) arg;
+  if (uring_reactor_init(reactor) < 0) {
+    log_warn("reactor %zu falling back to libevent", reactor->id);
+    uring_reactor_free(reactor);
+    if (event_add(reactor->connect_event, NULL) ||
+        (reactor->completion_event && event_add(reactor->completion_event, NULL))) {
+      log_perror("could not add connect event");
+      return NULL;
+    }
+    // reactor 0's loop already runs on the server's thread
+    if (reactor->id != 0) {
+      run_reactor(reactor);
+    }
+    return NULL;
+  }
+
+  // replies queued while reaping go out with the next wait
+  while (!reactor->stopping) {
+    if (uring_enter(reactor->uring, 1) < 0) {
+      log_perror("failed to wait for io_uring");
       break;
     }
-    default:
-      len = 0;
-  } 
+    reap_completions(reactor);
+  }
 
-  return len;
+  uring_reactor_free(reactor);
+  return NULL;
+}
+
+static int uring_reactor_init(struct reactor* reactor) {
+  size_t buffer_size;
+
+  reactor->uring = new_uring(URING_ENTRIES);
+  if (!reactor->uring) {
+    log_perror("could not set up io_uring");
+    return -1;
+  }
+
+  // Received into each buffer: a header, the sender's address, its
+  // credentials and the payload. There's no room for fds, so the kernel
+  // drops any that come along, and ring offers are refused for good
+  memset(&reactor->recv_hdr, 0, sizeof(reactor->recv_hdr));
+  reactor->recv_hdr.msg_namelen = sizeof(struct sockaddr_un);
+  reactor->recv_hdr.msg_controllen = CMSG_SPACE(sizeof(struct ucred));
+  buffer_size = sizeof(struct io_uring_recvmsg_out) + reactor->recv_hdr.msg_namelen +
+                reactor->recv_hdr.msg_controllen + MAX_MSG_SIZE;
+
+  reactor->uring_bufs = new_uring_buffers(reactor->uring, URING_BUFFERS, buffer_size, URING_BUFFER_GROUP);
+  reactor->uring_replies = new_msg_pool(URING_REPLIES);
+  if (!reactor->uring_bufs || !reactor->uring_replies) {
+    return -1;
+  }
+
+  if (arm_receive(reactor) < 0 || arm_wakeup(reactor) < 0 ||
+      (reactor->completions && arm_completions(reactor) < 0)) {
+    return -1;
+  }
+  // fails here, rather than in the loop, on kernels without multishot receives
+  if (uring_enter(reactor->uring, 0) < 0) {
+    log_perror("failed to submit to io_uring");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void uring_reactor_free(struct reactor* reactor) {
+  if (reactor->uring_bufs) {
+    free_uring_buffers(reactor->uring, reactor->uring_bufs);
+    reactor->uring_bufs = NULL;
+  }
+  // cancels the replies still in flight, before their slots go away
+  if (reactor->uring) {
+    free_uring(reactor->uring);
+    reactor->uring = NULL;
+  }
+  if (reactor->uring_replies) {
+    free_msg_pool(reactor->uring_replies);
+    reactor->uring_replies = NULL;
+  }
+}
+
+// A single receive keeps completing, into a buffer the kernel picks, for
+// every datagram that arrives until it runs out of buffers or fails
+static int arm_receive(struct reactor* reactor) {
+  struct io_uring_sqe* sqe;
+
+  sqe = next_sqe(reactor);
+  if (!sqe) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = reactor->fd;
+  sqe->addr = (uint64_t) (uintptr_t) &reactor->recv_hdr;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = URING_RECV_TAG;
+  return 0;
+}
+
+static int arm_wakeup(struct reactor* reactor) {
+  struct io_uring_sqe* sqe;
+
+  sqe = next_sqe(reactor);
+  if (!sqe) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = reactor->wake_fd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = URING_WAKE_TAG;
+  return 0;
+}
+
+static int arm_completions(struct reactor* reactor) {
+  struct io_uring_sqe* sqe;
+
+  sqe = next_sqe(reactor);
+  if (!sqe) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = completion_queue_fd(reactor->completions);
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = URING_DONE_TAG;
+  return 0;
+}
+
+// takes a submission entry, handing the ones taken so far to the kernel
+// first if the queue is full
+static struct io_uring_sqe* next_sqe(struct reactor* reactor) {
+  struct io_uring_sqe* sqe;
+
+  sqe = uring_get_sqe(reactor->uring);
+  if (!sqe) {
+    if (uring_enter(reactor->uring, 0) < 0) {
+      log_perror("failed to submit to io_uring");
+      return NULL;
+    }
+    sqe = uring_get_sqe(reactor->uring);
+  }
+  return sqe;
+}
+
+static void reap_completions(struct reactor* reactor) {
+  struct io_uring_cqe* cqe;
+
+  while ((cqe = uring_peek_cqe(reactor->uring))) {
+    uint64_t user_data = cqe->user_data;
+    int res = cqe->res;
+    uint32_t flags = cqe->flags;
+
+    uring_cqe_seen(reactor->uring);
+    if (user_data == URING_RECV_TAG) {
+      uring_receive(reactor, res, flags);
+    } else if (user_data == URING_WAKE_TAG) {
+      reactor->stopping = 1;
+    } else if (user_data == URING_DONE_TAG) {
+      drain_completions(reactor);
+      if (arm_completions(reactor) < 0) {
+        log_warn("reactor %zu stopped taking slow replies", reactor->id);
+        reactor->stopping = 1;
+      }
+    } else {
+      // a reply went out, or was dropped like a failed sendmmsg would drop it
+      release_slot(reactor->uring_replies, (struct msg_slot*) (uintptr_t) user_data);
+    }
+  }
+}
+
+static void uring_receive(struct reactor* reactor, int res, uint32_t flags) {
+  if (flags & IORING_CQE_F_BUFFER) {
+    uint16_t id = flags >> IORING_CQE_BUFFER_SHIFT;
+
+    if (res >= 0) {
+      uring_datagram(reactor, uring_buffer(reactor->uring_bufs, id), res);
+    }
+    uring_recycle_buffer(reactor->uring_bufs, id);
+  }
+
+  // ENOBUFS means a burst outran the buffers, which are all back by now
+  if (res < 0 && res != -ENOBUFS) {
+    log_error("failed to receive messages: %s", strerror(-res));
+  }
+  if (!(flags & IORING_CQE_F_MORE) && arm_receive(reactor) < 0) {
+    log_warn("reactor %zu stopped receiving", reactor->id);
+    reactor->stopping = 1;
+  }
+}
+
+// handles one datagram laid out in a receive buffer, submitting its reply
+static void uring_datagram(struct reactor* reactor, uint8_t* buf, size_t len) {
+  struct io_uring_recvmsg_out* out;
+  struct msg_slot* msg_slot;
+  struct msg_slot* reply;
+  struct ucred* cred;
+  struct msghdr hdr;
+  uint8_t* name;
+  uint8_t* payload;
+  size_t reply_len;
+
+  out = (struct io_uring_recvmsg_out*) buf;
+  name = buf + sizeof(*out);
+  payload = name + reactor->recv_hdr.msg_namelen + reactor->recv_hdr.msg_controllen;
+  if (len < (size_t) (payload - buf) || out->flags & MSG_TRUNC ||
+      out->payloadlen > len - (payload - buf) || out->namelen > sizeof(struct sockaddr_un)) {
+    log_warn("dropped truncated message");
+    return;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_control = name + reactor->recv_hdr.msg_namelen;
+  hdr.msg_controllen = out->controllen;
+  cred = get_header_credentials(&hdr);
+  if (!cred) {
+    log_warn("empty or invalid credentials");
+    return;
+  }
+  if (!check_authentication(reactor->server->access_control, cred->pid)) {
+    log_warn("acess denied for %d", cred->pid);
+    return;
+  }
+
+  reply = acquire_slot(reactor->uring_replies);
+  if (!reply) {
+    log_warn("too many replies in flight, dropped message");
+    return;
+  }
+
+  // copied out, so the buffer goes back to the kernel right away
+  msg_slot = batch_slot(reactor->frame, 0);
+  memset(&msg_slot->md, 0, sizeof(msg_slot->md));
+  msg_slot->md.len = out->payloadlen;
+  msg_slot->md.has_credentials = 1;
+  msg_slot->md.pid = cred->pid;
+  msg_slot->md.uid = cred->uid;
+  msg_slot->md.gid = cred->gid;
+  memcpy(&msg_slot->addr, name, out->namelen);
+  msg_slot->md.addr_len = out->namelen;
+  memcpy(msg_slot->payload, payload, out->payloadlen);
+
+  reply_len = handle_message(reactor, NULL, msg_slot, reply->payload, sizeof(reply->payload));
+  if (reply_len == 0) {
+    release_slot(reactor->uring_replies, reply);
+    return;
+  }
+
+  memcpy(&reply->addr, name, out->namelen);
+  reply->hdr.msg_namelen = out->namelen;
+  submit_uring_reply(reactor, reply, reply_len);
+}
+
+// sends a reply held in a slot of uring_replies to the address in the slot,
+// with the next io_uring_enter. The slot is released once the send completes
+static void submit_uring_reply(struct reactor* reactor, struct msg_slot* reply, size_t reply_len) {
+  struct io_uring_sqe* sqe;
+
+  sqe = next_sqe(reactor);
+  if (!sqe) {
+    release_slot(reactor->uring_replies, reply);
+    return;
+  }
+
+  reply->iov.iov_len = reply_len;
+  reply->hdr.msg_control = NULL;
+  reply->hdr.msg_controllen = 0;
+  reply->hdr.msg_flags = 0;
+
+  // not linked, so a reply to a client that went away can't cancel the rest
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = reactor->fd;
+  sqe->addr = (uint64_t) (uintptr_t) &reply->hdr;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+  sqe->user_data = (uint64_t) (uintptr_t) reply;
+}
+
+static void* watch_process(pid_t process, int pidfd, void* arg) {
+  struct server_state* state;
+  struct pid_watch* watch;
+
+  state = (struct server_state*) arg;
+
+  watch = malloc(sizeof(struct pid_watch));
+  if (!watch) {
+    log_error("no memory to watch %d", process);
+    return NULL;
+  }
+  watch->store = state->access_control;
+  watch->pid = process;
+
+  watch->exit_event = event_new(state->reactors[0].evloop, pidfd, EV_READ, process_exit_handler, (void*) watch);
+  if (!watch->exit_event || event_add(watch->exit_event, NULL)) {
+    log_error("failed to watch %d", process);
+    if (watch->exit_event) {
+      event_free(watch->exit_event);
+    }
+    free(watch);
+    return NULL;
+  }
+
+  return watch;
+}
+
+static void unwatch_process(void* handle, void* arg) {
+  struct pid_watch* watch;
+
+  watch = (struct pid_watch*) handle;
+  // never blocks, even if the exit handler is running on reactor 0 and
+  // waiting for the access store lock we may be holding
+  event_free_finalize(0, watch->exit_event, free_pid_watch);
+}
+
+static void free_pid_watch(struct event* exit_event, void* arg) {
+  free(arg);
+}
+
+static void process_exit_handler(int pidfd, short evtype, void* arg) {
+  struct pid_watch* watch;
+
+  watch = (struct pid_watch*) arg;
+  log_info("process %d exited", watch->pid);
+
+  // revoking unwatches, which frees watch once we return
+  revoke_process(watch->store, watch->pid);
+}
+
+static size_t invoke_procedure(struct server_state* state, ns(Message_table_t)* msg, pid_t sender, uint8_t* rendered_buf, size_t cap) {
+  struct rpc_context ctx;
+
+  ctx.access = state->access_control;
+  ctx.seq_num = ns(Message_seq_num_get(*msg));
+  ctx.pid = sender;
+  log_debug("Handling request %lu", (unsigned long) ctx.seq_num);
+
+  return dispatch(state->handlers, ns(Message_payload_type_get(*msg)), &ctx, ns(Message_payload_get(*msg)),
+                  rendered_buf, cap);
+}
+
+static void print_handler_stats(struct server_state* state) {
+  struct handler_stats stats;
+
+  for (size_t type = 0; type < DISPATCH_SLOTS; type++) {
+    if (get_handler_stats(state->handlers, type, &stats) < 0 || stats.calls == 0) {
+      continue;
+    }
+    log_info("payload type %zu: %lu calls, %lu failed, %lu ns avg", type, (unsigned long) stats.calls,
+             (unsigned long) stats.failures, (unsigned long) (stats.ns / stats.calls));
+  }
 }
 
 static ns(Payload_union_type_t) route_message(uint8_t* msg_buf, size_t msg_buf_len, ns(Message_table_t)* valid_msg) {
   ns(Message_table_t) msg;
   
   if (msg_buf_len < sizeof(ns(Message_table_t))) {
-    fprintf(stderr, "message is corrupted or malformed\n");
+    log_warn("message is corrupted or malformed");
     return -1;
   }
 
   if (ns(Message_verify_as_root(msg_buf, msg_buf_len)) != 0) {
-    fprintf(stderr, "message could not be verified\n");
+    log_warn("message could not be verified");
     return -1;
   }
   msg = ns(Message_as_root(msg_buf));
@@ -275,8 +1484,27 @@ static ns(Payload_union_type_t) route_message(uint8_t* msg_buf, size_t msg_buf_l
 }
 
 static void server_free(struct server_state* state) {
+  // workers finish what they have before the reactors they reply through go
+  if (state->workers) {
+    free_worker_pool(state->workers);
+  }
+  // the access store's pid watches live on reactor 0's loop, so it goes first
   if (state->access_control) {
     free_access_store(state->access_control);
   }
+  // its events live on reactor 0's loop
+  if (state->control) {
+    reactor_free(state->control);
+    free(state->control);
+  }
+  if (state->reactors) {
+    for (size_t i = 0; i < state->num_reactors; i++) {
+      reactor_free(&state->reactors[i]);
+    }
+    free(state->reactors);
+  }
+  if (state->handlers) {
+    free_dispatch_table(state->handlers);
+  }
   free(state);
 }
@@ -1,26 +1,88 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <stddef.h>
+
+#include "access/access.h"
+#include "commslib/commslib.h"
+#include "dispatch/dispatch.h"
+
+#define DEFAULT_ACCESS_CAPACITY 1024
+#define CONTROL_SUFFIX ".ctl" // appended to a server's addr for its control socket
+
+enum io_engine {
+  // readiness from libevent, then a recvmmsg and a sendmmsg per wakeup
+  IO_ENGINE_LIBEVENT,
+  // a multishot receive into buffers the kernel picks, with replies submitted
+  // along with the wait for the next requests, so a busy reactor makes
+  // about one syscall per batch. Only datagram reactors run on it, without
+  // shared rings, and any that can't set up io_uring fall back to libevent
+  IO_ENGINE_URING,
+};
+
+struct server_config {
+  char* addr; // address path of socket to bind server to
+  size_t access_capacity; // number of whitelisted pids to size the access store for
+  enum access_backend access_backend;
+  // number of reactor threads, each bound to its own shard "<addr>.<i>".
+  // 0 or 1 runs a single reactor bound to addr itself
+  size_t num_reactors;
+  // sockets already bound to those paths, one per reactor, to serve instead
+  // of binding new ones. Lets a replacement server pick up the queue of the
+  // one it replaces. NULL to bind
+  int* fds;
+  // datagram sockets, or seqpacket listeners whose clients are authenticated
+  // once when they connect. fds must be of the same kind
+  enum transport transport;
+  enum io_engine io_engine;
+  // threads serving the requests of HANDLER_DEFERRED handlers, whose
+  // replies go out once they are done. 0 serves them on the reactors
+  size_t num_workers;
+  // socket the requests of the process that spawned the server come in on,
+  // served ahead of everything else on reactor 0's loop, so its heartbeats
+  // never wait behind bulk traffic. Always bound anew. NULL to take them
+  // along with the rest
+  char* control_addr;
+};
+
 /**
- * new_server: creates a new server bound to addr
+ * new_server: creates a new server bound to config->addr, or to one
+ * socket per reactor derived from it with shard_path
  *
- * @addr: address path of socket to bind server to
+ * @config: server configuration
  *
  * @returns server instance. The caller is responsible
  * for memory cleanup
  *
 **/
-struct server_state* new_server(char* addr);
+struct server_state* new_server(struct server_config* config);
 
 /**
  * start_server: starts server listening to clients.
  *
+ * Reactor 0 runs on the calling thread, the rest on threads of their own.
  * This call blocks until server errors or is stopped.
  *
  * @returns -1 if server exited with error or 0 if exited cleanly
  *
 **/
 int start_server(struct server_state*);
+
+/**
+ * server_register_handler: serves a payload type with fn from now on, in
+ * place of the service handler for it, if any. Only to be called before
+ * start_server
+ *
+ * @state: server
+ * @type: payload type
+ * @fn: handler
+ * @flags: handler_flags
+ *
+ * @returns -1 on error, 0 otherwise
+ *
+**/
+int server_register_handler(struct server_state* state, ns(Payload_union_type_t) type, rpc_handler fn, unsigned int flags);
+
 void stop_server(struct server_state*);
 
 
@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "loglib/loglib.h"
+#include "uring.h"
+
+#define BUFFER_ALIGNMENT 64
+
+// The kernel shares the indexes of both queues with us. We are the only
+// writer of the submission tail and the completion head, so those are
+// kept locally and only published.
+struct uring {
+  int fd;
+
+  void* sq_ptr;
+  size_t sq_len;
+  unsigned int* sq_head;
+  unsigned int* sq_tail;
+  unsigned int sq_mask;
+  unsigned int sq_entries;
+  struct io_uring_sqe* sqes;
+  size_t sqes_len;
+  unsigned int sqe_tail; // entries taken
+  unsigned int sqe_submitted; // entries handed to the kernel
+
+  void* cq_ptr;
+  size_t cq_len;
+  unsigned int* cq_head;
+  unsigned int* cq_tail;
+  unsigned int cq_mask;
+  struct io_uring_cqe* cqes;
+};
+
+struct uring_buffers {
+  struct io_uring_buf_ring* br;
+  size_t br_len;
+  uint8_t* mem;
+  size_t size;
+  unsigned int count;
+  uint16_t group;
+  uint16_t tail;
+};
+
+static int setup(unsigned int entries, struct io_uring_params* params);
+
+struct uring* new_uring(unsigned int entries) {
+  struct io_uring_params params;
+  struct uring* ring;
+  unsigned int* sq_array;
+
+  ring = calloc(1, sizeof(struct uring));
+  if (!ring) {
+    return NULL;
+  }
+
+  ring->fd = setup(entries, &params);
+  if (ring->fd < 0) {
+    free(ring);
+    return NULL;
+  }
+
+  ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_len > ring->sq_len) {
+      ring->sq_len = ring->cq_len;
+    }
+    ring->cq_len = ring->sq_len;
+  }
+
+  ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED) {
+    ring->sq_ptr = NULL;
+    goto ERROR;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ptr = ring->sq_ptr;
+  } else {
+    ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED) {
+      ring->cq_ptr = NULL;
+      goto ERROR;
+    }
+  }
+
+  ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto ERROR;
+  }
+
+  ring->sq_head = (unsigned int*) ((uint8_t*) ring->sq_ptr + params.sq_off.head);
+  ring->sq_tail = (unsigned int*) ((uint8_t*) ring->sq_ptr + params.sq_off.tail);
+  ring->sq_mask = *(unsigned int*) ((uint8_t*) ring->sq_ptr + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->sqe_tail = *ring->sq_tail;
+  ring->sqe_submitted = ring->sqe_tail;
+
+  // entries are used in order, so the indirection array never changes
+  sq_array = (unsigned int*) ((uint8_t*) ring->sq_ptr + params.sq_off.array);
+  for (unsigned int i = 0; i < params.sq_entries; i++) {
+    sq_array[i] = i;
+  }
+
+  ring->cq_head = (unsigned int*) ((uint8_t*) ring->cq_ptr + params.cq_off.head);
+  ring->cq_tail = (unsigned int*) ((uint8_t*) ring->cq_ptr + params.cq_off.tail);
+  ring->cq_mask = *(unsigned int*) ((uint8_t*) ring->cq_ptr + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*) ((uint8_t*) ring->cq_ptr + params.cq_off.cqes);
+
+  return ring;
+
+ERROR:
+  log_perror("failed to map io_uring");
+  free_uring(ring);
+  return NULL;
+}
+
+void free_uring(struct uring* ring) {
+  if (ring->sqes) {
+    munmap(ring->sqes, ring->sqes_len);
+  }
+  if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) {
+    munmap(ring->cq_ptr, ring->cq_len);
+  }
+  if (ring->sq_ptr) {
+    munmap(ring->sq_ptr, ring->sq_len);
+  }
+  close(ring->fd);
+  free(ring);
+}
+
+struct io_uring_sqe* uring_get_sqe(struct uring* ring) {
+  struct io_uring_sqe* sqe;
+
+  if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+    return NULL;
+  }
+
+  sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ring->sqe_tail++;
+  return sqe;
+}
+
+int uring_enter(struct uring* ring, unsigned int wait_nr) {
+  unsigned int pending;
+  int submitted;
+
+  pending = ring->sqe_tail - ring->sqe_submitted;
+  if (pending == 0 && wait_nr == 0) {
+    return 0;
+  }
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+  submitted = syscall(__NR_io_uring_enter, ring->fd, pending, wait_nr,
+                      wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  if (submitted < 0) {
+    // interrupted waits still submitted what they could
+    if (errno == EINTR) {
+      return 0;
+    }
+    return -1;
+  }
+  ring->sqe_submitted += submitted;
+  return submitted;
+}
+
+struct io_uring_cqe* uring_peek_cqe(struct uring* ring) {
+  unsigned int head;
+
+  head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring* ring) {
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+struct uring_buffers* new_uring_buffers(struct uring* ring, unsigned int count, size_t size, uint16_t group) {
+  struct io_uring_buf_reg reg;
+  struct uring_buffers* bufs;
+
+  if (count == 0 || count > 32768 || (count & (count - 1)) != 0) {
+    return NULL;
+  }
+
+  bufs = calloc(1, sizeof(struct uring_buffers));
+  if (!bufs) {
+    return NULL;
+  }
+  bufs->count = count;
+  bufs->group = group;
+  bufs->size = (size + BUFFER_ALIGNMENT - 1) & ~(size_t) (BUFFER_ALIGNMENT - 1);
+
+  // the ring of buffer descriptors must be page aligned
+  bufs->br_len = count * sizeof(struct io_uring_buf);
+  bufs->br = mmap(NULL, bufs->br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bufs->br == MAP_FAILED) {
+    free(bufs);
+    return NULL;
+  }
+
+  bufs->mem = aligned_alloc(BUFFER_ALIGNMENT, count * bufs->size);
+  if (!bufs->mem) {
+    munmap(bufs->br, bufs->br_len);
+    free(bufs);
+    return NULL;
+  }
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t) (uintptr_t) bufs->br;
+  reg.ring_entries = count;
+  reg.bgid = group;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    log_perror("failed to register receive buffers");
+    free(bufs->mem);
+    munmap(bufs->br, bufs->br_len);
+    free(bufs);
+    return NULL;
+  }
+
+  for (unsigned int i = 0; i < count; i++) {
+    uring_recycle_buffer(bufs, i);
+  }
+
+  return bufs;
+}
+
+void free_uring_buffers(struct uring* ring, struct uring_buffers* bufs) {
+  struct io_uring_buf_reg reg;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.bgid = bufs->group;
+  syscall(__NR_io_uring_register, ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+
+  free(bufs->mem);
+  munmap(bufs->br, bufs->br_len);
+  free(bufs);
+}
+
+uint8_t* uring_buffer(struct uring_buffers* bufs, uint16_t id) {
+  return bufs->mem + (size_t) id * bufs->size;
+}
+
+void uring_recycle_buffer(struct uring_buffers* bufs, uint16_t id) {
+  struct io_uring_buf* buf;
+
+  buf = &bufs->br->bufs[bufs->tail & (bufs->count - 1)];
+  buf->addr = (uint64_t) (uintptr_t) uring_buffer(bufs, id);
+  buf->len = bufs->size;
+  buf->bid = id;
+
+  // the tail shares its place with the first descriptor's reserved field
+  bufs->tail++;
+  __atomic_store_n(&bufs->br->tail, bufs->tail, __ATOMIC_RELEASE);
+}
+
+// Completions are only ever reaped by the thread waiting for them, so the
+// kernel can defer its work until we enter. Older kernels don't know how.
+static int setup(unsigned int entries, struct io_uring_params* params) {
+  int fd;
+
+  memset(params, 0, sizeof(struct io_uring_params));
+  params->flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  fd = syscall(__NR_io_uring_setup, entries, params);
+  if (fd >= 0 || errno != EINVAL) {
+    return fd;
+  }
+
+  memset(params, 0, sizeof(struct io_uring_params));
+  return syscall(__NR_io_uring_setup, entries, params);
+}
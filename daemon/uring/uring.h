@@ -0,0 +1,129 @@
+/**
+ * Uring - io_uring submission and completion
+ *
+ * Just enough of io_uring for a reactor to run on it, straight on top of
+ * the kernel interface: a ring sized at setup, submission entries that are
+ * handed to the kernel on the next uring_enter along with the wait for
+ * completions, and a ring of provided buffers the kernel picks from for
+ * multishot receives.
+ *
+ * A ring is only ever used by the thread that created it.
+ *
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+struct uring;
+struct uring_buffers;
+
+/**
+ * new_uring: sets up an io_uring owned by the calling thread
+ *
+ * @entries: number of submission entries, a power of two
+ *
+ * @returns new ring or NULL on error (errno is ENOSYS or EPERM where
+ * io_uring is unsupported or disabled). Caller must free after use by
+ * calling free_uring
+ *
+**/
+struct uring* new_uring(unsigned int entries);
+
+/**
+ * free_uring: tears down the ring, cancelling whatever is in flight
+ *
+ * @ring: ring to free
+ *
+**/
+void free_uring(struct uring* ring);
+
+/**
+ * uring_get_sqe: takes the next free submission entry, zeroed
+ *
+ * @ring: io_uring
+ *
+ * @returns entry to fill in, submitted on the next uring_enter, or NULL if
+ * the submission queue is full
+ *
+**/
+struct io_uring_sqe* uring_get_sqe(struct uring* ring);
+
+/**
+ * uring_enter: submits every entry taken so far and waits for completions,
+ * in a single syscall. Does nothing if there's neither
+ *
+ * @ring: io_uring
+ * @wait_nr: number of completions to wait for, 0 not to wait
+ *
+ * @returns number of entries submitted, or -1 on error
+ *
+**/
+int uring_enter(struct uring* ring, unsigned int wait_nr);
+
+/**
+ * uring_peek_cqe: finds the oldest completion, without waiting
+ *
+ * @ring: io_uring
+ *
+ * @returns completion, valid until uring_cqe_seen, or NULL if none
+ *
+**/
+struct io_uring_cqe* uring_peek_cqe(struct uring* ring);
+
+/**
+ * uring_cqe_seen: hands the oldest completion back to the kernel
+ *
+ * @ring: io_uring
+ *
+**/
+void uring_cqe_seen(struct uring* ring);
+
+/**
+ * new_uring_buffers: registers a ring of equally sized buffers for receives
+ * with IOSQE_BUFFER_SELECT to fill
+ *
+ * @ring: io_uring
+ * @count: number of buffers, a power of two up to 32768
+ * @size: size of each buffer
+ * @group: buffer group id receives select from
+ *
+ * @returns buffers or NULL on error. Caller must free after use by calling
+ * free_uring_buffers, before the ring itself
+ *
+**/
+struct uring_buffers* new_uring_buffers(struct uring* ring, unsigned int count, size_t size, uint16_t group);
+
+/**
+ * free_uring_buffers: unregisters and frees buffers
+ *
+ * @ring: io_uring the buffers were registered with
+ * @bufs: buffers to free
+ *
+**/
+void free_uring_buffers(struct uring* ring, struct uring_buffers* bufs);
+
+/**
+ * uring_buffer: finds the buffer a completion says it filled
+ *
+ * @bufs: buffers
+ * @id: buffer id, from the upper bits of the completion's flags
+ *
+ * @returns start of buffer
+ *
+**/
+uint8_t* uring_buffer(struct uring_buffers* bufs, uint16_t id);
+
+/**
+ * uring_recycle_buffer: gives a buffer back for the kernel to fill again
+ *
+ * @bufs: buffers
+ * @id: buffer id
+ *
+**/
+void uring_recycle_buffer(struct uring_buffers* bufs, uint16_t id);
+
+#endif // URING_H
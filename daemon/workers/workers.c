@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "commslib/commslib.h"
+#include "loglib/loglib.h"
+#include "workers.h"
+
+// Submissions come from every reactor and are taken by every worker, so
+// they go through a ring under a mutex, which is held for a few loads and
+// stores at a time.
+struct worker_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  struct work_item** queue;
+  size_t capacity;
+  size_t head; // next item to run
+  size_t len;
+  uint8_t stopping;
+
+  pthread_t* threads;
+  size_t num_threads;
+};
+
+// An intrusive queue with many producers and a single consumer. Producers
+// swap themselves in as the head with one atomic exchange and then link
+// the previous head to them, the consumer follows the links from the tail.
+// A stub item keeps the queue from ever being empty, so neither end needs
+// a lock. Between a producer's exchange and its link, the consumer sees
+// the queue end early, and picks up the item once the producer wakes it.
+struct completion_queue {
+  // written by producers
+  struct work_item* head __attribute__((aligned(CACHE_LINE_SIZE)));
+  uint32_t signalled; // an eventfd write is pending
+
+  // written by the consumer
+  struct work_item* tail __attribute__((aligned(CACHE_LINE_SIZE)));
+  struct work_item stub;
+
+  int fd;
+};
+
+static void* run_worker(void* arg);
+
+struct worker_pool* new_worker_pool(size_t num_threads, size_t capacity) {
+  struct worker_pool* pool;
+
+  if (num_threads == 0 || capacity == 0) {
+    return NULL;
+  }
+
+  pool = calloc(1, sizeof(struct worker_pool));
+  if (!pool) {
+    return NULL;
+  }
+  pool->capacity = capacity;
+
+  pool->queue = calloc(capacity, sizeof(struct work_item*));
+  pool->threads = calloc(num_threads, sizeof(pthread_t));
+  if (!pool->queue || !pool->threads) {
+    log_perror("no memory for worker pool");
+    goto ERROR;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->ready, NULL);
+
+  for (; pool->num_threads < num_threads; pool->num_threads++) {
+    if (pthread_create(&pool->threads[pool->num_threads], NULL, run_worker, (void*) pool)) {
+      log_perror("failed to start worker thread");
+      free_worker_pool(pool);
+      return NULL;
+    }
+  }
+
+  return pool;
+
+ERROR:
+  free(pool->queue);
+  free(pool->threads);
+  free(pool);
+  return NULL;
+}
+
+void free_worker_pool(struct worker_pool* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (size_t i = 0; i < pool->num_threads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  pthread_cond_destroy(&pool->ready);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->queue);
+  free(pool->threads);
+  free(pool);
+}
+
+int submit_work(struct worker_pool* pool, struct work_item* item) {
+  pthread_mutex_lock(&pool->lock);
+  if (pool->len == pool->capacity || pool->stopping) {
+    pthread_mutex_unlock(&pool->lock);
+    errno = EAGAIN;
+    return -1;
+  }
+
+  pool->queue[(pool->head + pool->len) % pool->capacity] = item;
+  pool->len++;
+  pthread_cond_signal(&pool->ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  return 0;
+}
+
+struct completion_queue* new_completion_queue() {
+  struct completion_queue* queue;
+
+  queue = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct completion_queue));
+  if (!queue) {
+    return NULL;
+  }
+  memset(queue, 0, sizeof(struct completion_queue));
+  queue->head = &queue->stub;
+  queue->tail = &queue->stub;
+
+  queue->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (queue->fd < 0) {
+    log_perror("failed to create completion wakeup");
+    free(queue);
+    return NULL;
+  }
+
+  return queue;
+}
+
+void free_completion_queue(struct completion_queue* queue) {
+  close(queue->fd);
+  free(queue);
+}
+
+int completion_queue_fd(struct completion_queue* queue) {
+  return queue->fd;
+}
+
+void push_completion(struct completion_queue* queue, struct work_item* item) {
+  struct work_item* prev;
+
+  item->next = NULL;
+  prev = __atomic_exchange_n(&queue->head, item, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&prev->next, item, __ATOMIC_RELEASE);
+
+  // linking and then checking for a pending wakeup pairs with the consumer
+  // clearing it and then draining, so one of us always sees the other
+  if (!__atomic_exchange_n(&queue->signalled, 1, __ATOMIC_SEQ_CST)) {
+    uint64_t one = 1;
+    if (write(queue->fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      log_perror("failed to wake completion consumer");
+    }
+  }
+}
+
+void completions_woken(struct completion_queue* queue) {
+  uint64_t count;
+
+  if (read(queue->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    log_perror("failed to read completion wakeup");
+  }
+  __atomic_store_n(&queue->signalled, 0, __ATOMIC_SEQ_CST);
+}
+
+struct work_item* pop_completion(struct completion_queue* queue) {
+  struct work_item* tail;
+  struct work_item* next;
+  struct work_item* prev;
+
+  tail = queue->tail;
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (tail == &queue->stub) {
+    if (!next) {
+      return NULL;
+    }
+    queue->tail = next;
+    tail = next;
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  }
+
+  if (next) {
+    queue->tail = next;
+    return tail;
+  }
+
+  // tail is the last item linked, but a producer may be about to link
+  // another after it
+  if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+
+  // put the stub back behind it, so tail can be handed out
+  queue->stub.next = NULL;
+  prev = __atomic_exchange_n(&queue->head, &queue->stub, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&prev->next, &queue->stub, __ATOMIC_RELEASE);
+
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (next) {
+    queue->tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+static void* run_worker(void* arg) {
+  struct worker_pool* pool;
+  struct work_item* item;
+
+  pool = (struct worker_pool*) arg;
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->len == 0 && !pool->stopping) {
+      pthread_cond_wait(&pool->ready, &pool->lock);
+    }
+    // whatever was submitted still runs, so its submitter gets it back
+    if (pool->len == 0) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    item = pool->queue[pool->head];
+    pool->head = (pool->head + 1) % pool->capacity;
+    pool->len--;
+    pthread_mutex_unlock(&pool->lock);
+
+    item->run(item);
+    push_completion(item->done, item);
+  }
+}
@@ -0,0 +1,125 @@
+/**
+ * Workers - Thread pool for slow work
+ *
+ * Runs work that would stall an event loop on a fixed set of threads, and
+ * hands it back to the loop that submitted it once done. Each loop owns a
+ * completion queue, which any worker pushes to without locking, and which
+ * wakes the loop through an eventfd only when it went from idle to having
+ * completions, so a burst of finished work costs one wakeup.
+ *
+ * Work is submitted into a bounded queue, so a flood of slow requests is
+ * refused at the door instead of piling up.
+ *
+ */
+
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct worker_pool;
+struct completion_queue;
+
+// Embedded at the start of whatever the caller submits. The pool never
+// allocates, the item lives as long as the caller keeps it.
+struct work_item {
+  void (*run)(struct work_item* item); // called on a worker
+  struct completion_queue* done; // where the item goes once run
+
+  struct work_item* next; // completion queue link
+};
+
+/**
+ * new_worker_pool: starts the worker threads
+ *
+ * @num_threads: number of workers
+ * @capacity: number of items that can wait to be run
+ *
+ * @returns new pool or NULL on error. Caller must free after use by calling
+ * free_worker_pool
+ *
+**/
+struct worker_pool* new_worker_pool(size_t num_threads, size_t capacity);
+
+/**
+ * free_worker_pool: stops the workers once they ran everything submitted,
+ * and releases the pool
+ *
+ * @pool: pool to free
+ *
+**/
+void free_worker_pool(struct worker_pool* pool);
+
+/**
+ * submit_work: queues an item to be run on a worker, then pushed to
+ * item->done
+ *
+ * @pool: worker pool
+ * @item: item with run and done set
+ *
+ * @returns -1 with errno EAGAIN if the queue is full, 0 otherwise
+ *
+**/
+int submit_work(struct worker_pool* pool, struct work_item* item);
+
+/**
+ * new_completion_queue: creates a queue for a single consumer to take
+ * finished work from
+ *
+ * @returns new queue or NULL on error. Caller must free after use by calling
+ * free_completion_queue
+ *
+**/
+struct completion_queue* new_completion_queue();
+
+/**
+ * free_completion_queue: releases the queue, but not the items left in it
+ *
+ * @queue: queue to free
+ *
+**/
+void free_completion_queue(struct completion_queue* queue);
+
+/**
+ * completion_queue_fd: eventfd that becomes readable when completions
+ * arrive at an idle queue
+ *
+ * @queue: completion queue
+ *
+ * @returns eventfd of queue
+ *
+**/
+int completion_queue_fd(struct completion_queue* queue);
+
+/**
+ * push_completion: adds an item to the queue, from any thread, waking the
+ * consumer if it is idle
+ *
+ * @queue: completion queue
+ * @item: finished item
+ *
+**/
+void push_completion(struct completion_queue* queue, struct work_item* item);
+
+/**
+ * completions_woken: clears the wakeup. The consumer calls it before it
+ * drains the queue with pop_completion, so whatever arrives from then on
+ * wakes it again
+ *
+ * @queue: completion queue
+ *
+**/
+void completions_woken(struct completion_queue* queue);
+
+/**
+ * pop_completion: takes the oldest item out of the queue
+ *
+ * @queue: completion queue
+ *
+ * @returns item, or NULL if there is none yet
+ *
+**/
+struct work_item* pop_completion(struct completion_queue* queue);
+
+#endif // WORKERS_H
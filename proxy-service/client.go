@@ -7,6 +7,7 @@ import (
   "errors"
   "os/signal"
   "syscall"
+  "strconv"
 	"net"
 
   flatbuffers "github.com/google/flatbuffers/go"
@@ -18,6 +19,10 @@ import (
 const (
   proxyAddr = "/tmp/proxy"
   serverAddr = "/tmp/process_monitor"
+  // fd the daemon passes us to report readiness on, see notify_ready in commslib
+  readyFdEnv = "READY_FD"
+  // socket the daemon already bound at proxyAddr for us, if it hands sockets off
+  listenFdEnv = "LISTEN_FD"
 )
 
 // TODO: maybe we ca use builder.Reset() to solve problem
@@ -28,12 +33,9 @@ type server struct {
 }
 
 func main() {
-  // cleanup old files
-  os.Remove(proxyAddr)
-
   accessStore := access.New()
 
-  conn, err := net.ListenUnixgram("unixgram", &net.UnixAddr{proxyAddr, "unixgram"})
+  conn, inherited, err := listen()
   if err != nil {
     log.Fatal("failed to listen on socker", err)
   }
@@ -59,7 +61,11 @@ func main() {
 
   fmt.Printf("Starting proxy at %d\n", os.Getpid())
 
-  closeHandler()
+  if err = notifyReady(); err != nil {
+    log.Printf("failed to notify readiness: %v\n", err)
+  }
+
+  closeHandler(inherited)
 
   payload:= make([]byte, 1024)
   control := make([]byte, 100)
@@ -100,13 +106,69 @@ func (s *server) handleConnection(payload, control []byte) {
   }
 }
 
-func closeHandler() {
+// notifyReady tells the daemon our socket is bound, if it started us
+func notifyReady() error {
+  fdStr, ok := os.LookupEnv(readyFdEnv)
+  if !ok {
+    return nil
+  }
+  os.Unsetenv(readyFdEnv)
+
+  fd, err := strconv.Atoi(fdStr)
+  if err != nil {
+    return err
+  }
+
+  f := os.NewFile(uintptr(fd), "ready")
+  defer f.Close()
+  _, err = f.Write([]byte("READY=1\n"))
+
+  return err
+}
+
+// listen serves the socket the daemon handed us, so that we pick up the
+// datagrams queued while we were being replaced, or binds a new one
+func listen() (*net.UnixConn, bool, error) {
+  fdStr, ok := os.LookupEnv(listenFdEnv)
+  if !ok {
+    // cleanup old files
+    os.Remove(proxyAddr)
+    conn, err := net.ListenUnixgram("unixgram", &net.UnixAddr{proxyAddr, "unixgram"})
+    return conn, false, err
+  }
+  os.Unsetenv(listenFdEnv)
+
+  fd, err := strconv.Atoi(fdStr)
+  if err != nil {
+    return nil, true, err
+  }
+
+  f := os.NewFile(uintptr(fd), "listener")
+  defer f.Close()
+  c, err := net.FilePacketConn(f)
+  if err != nil {
+    return nil, true, err
+  }
+
+  conn, ok := c.(*net.UnixConn)
+  if !ok {
+    c.Close()
+    return nil, true, errors.New("inherited socket is not a unix socket")
+  }
+
+  return conn, true, nil
+}
+
+func closeHandler(inherited bool) {
   c := make(chan os.Signal)
   signal.Notify(c, os.Interrupt, syscall.SIGTERM)
   go func() {
     <-c
     fmt.Println("cleanin up")
-    os.Remove(proxyAddr)
+    // the daemon owns inherited sockets and keeps them for our replacement
+    if !inherited {
+      os.Remove(proxyAddr)
+    }
     os.Exit(0)
   }()
 }